@@ -0,0 +1,414 @@
+// Benchmarks for kparser.h, klexer.h and kalloc.h on synthetic inputs
+//
+//    gcc -O2 bench.c -pthread -o bench
+//    ./bench [size in MB] [punctuation density %] [runs]
+//
+// Every profile is tokenized in each mode, the best of the runs is reported.
+// kparser's allocations go through kalloc (KALLOC_KPARSER) so they can be
+// counted, allocs/token and peak are taken from kmem_get_stats.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define USE_KALLOC
+#define KALLOC_KPARSER
+#define KALLOC_IMPLEMENTATION
+#include "kalloc.h"
+
+#define _KPARSER_IMPLEMENTATION
+#include "kparser.h"
+
+#define _KLEXER_IMPLEMENTATION
+#include "klexer.h"
+
+#if defined(_WIN32)
+    #include <windows.h>
+    static double Now()
+    {
+        LARGE_INTEGER counter, frequency;
+        QueryPerformanceCounter(&counter);
+        QueryPerformanceFrequency(&frequency);
+        return (double)counter.QuadPart / (double)frequency.QuadPart;
+    }
+#else
+    #include <time.h>
+    static double Now()
+    {
+        struct timespec ts;
+        timespec_get(&ts, TIME_UTC);
+        return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+    }
+#endif
+
+typedef enum {
+    P_ShiftLeft,
+    P_ShiftRight,
+    P_LessEqual,
+    P_Equal,
+    P_Assign,
+    P_OpenBrace,
+    P_CloseBrace,
+    P_OpenBracket,
+    P_CloseBracket,
+    P_OpenCurly,
+    P_CloseCurly,
+    P_Plus,
+    P_Minus,
+    P_Multiply,
+    P_Divide,
+    P_Semicolon,
+    P_Comma,
+    P_LineComment,
+    P_BlockComment
+} BenchPunctuation;
+
+static punc_t punctuation[] = {
+    { "<<", P_ShiftLeft, 0 },
+    { ">>", P_ShiftRight, 0 },
+    { "<=", P_LessEqual, 0 },
+    { "==", P_Equal, 0 },
+    { "=", P_Assign, 0 },
+    { "(", P_OpenBrace, 0 },
+    { ")", P_CloseBrace, 0 },
+    { "[", P_OpenBracket, 0 },
+    { "]", P_CloseBracket, 0 },
+    { "{", P_OpenCurly, 0 },
+    { "}", P_CloseCurly, 0 },
+    { "+", P_Plus, 0 },
+    { "-", P_Minus, 0 },
+    { "*", P_Multiply, 0 },
+    { "/", P_Divide, 0 },
+    { ";", P_Semicolon, 0 },
+    { ",", P_Comma, 0 },
+    { "//", P_LineComment, 0 },
+    { "/*", P_BlockComment, 0 }
+};
+
+typedef enum {
+    PROFILE_OPERATORS,
+    PROFILE_IDENTIFIERS,
+    PROFILE_QUOTES,
+    PROFILE_COMMENTS,
+    PROFILE_COUNT
+} BenchProfile;
+
+static const char *profile_names[PROFILE_COUNT] = {
+    "operators", "identifiers", "quotes", "comments"
+};
+
+// xorshift, the inputs are the same on every run and platform
+static uint64_t bench_seed = 0x9e3779b97f4a7c15ull;
+static uint32_t Random(uint32_t n)
+{
+    bench_seed ^= bench_seed << 13;
+    bench_seed ^= bench_seed >> 7;
+    bench_seed ^= bench_seed << 17;
+    return (uint32_t)(bench_seed % n);
+}
+
+static void Identifier(char *out, intmax_t *at, int len)
+{
+    static const char first[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ_";
+    static const char rest[] = "abcdefghijklmnopqrstuvwxyz0123456789_";
+
+    out[(*at)++] = first[Random(sizeof(first) - 1)];
+    for (int i = 1; i < len; i++) {
+        out[(*at)++] = rest[Random(sizeof(rest) - 1)];
+    }
+}
+
+// size bytes of source shaped by the profile, density is the share of
+// tokens (in %) that are punctuation. The last step can start just under 
+// size, the longest is a block comment: "/* ", 31 words of up to 9 bytes and
+// a separator and " */\n" (317 bytes), then the NUL
+#define GENERATE_SLACK 320
+
+static char *Generate(BenchProfile profile, intmax_t size, int density)
+{
+    char *out = (char*) malloc(size + GENERATE_SLACK);
+    intmax_t at = 0;
+    int column = 0;
+
+    while (at < size) {
+        if (profile == PROFILE_COMMENTS && column == 0 && Random(100) < 50) {
+            if (Random(2)) {
+                memcpy(out + at, "// ", 3);
+                at += 3;
+                for (int words = 4 + Random(8); words > 0; words--) {
+                    Identifier(out, &at, 2 + Random(8));
+                    out[at++] = ' ';
+                }
+                out[at++] = '\n';
+            } else {
+                memcpy(out + at, "/* ", 3);
+                at += 3;
+                for (int words = 8 + Random(24); words > 0; words--) {
+                    Identifier(out, &at, 2 + Random(8));
+                    out[at++] = Random(8) ? ' ' : '\n';
+                }
+                memcpy(out + at, " */\n", 4);
+                at += 4;
+            }
+            continue;
+        }
+
+        if ((int)Random(100) < density) {
+            const punc_t *punc = &punctuation[Random(P_LineComment)]; // no comment openers
+            memcpy(out + at, punc->p, strlen(punc->p));
+            at += strlen(punc->p);
+        } else if (profile == PROFILE_QUOTES && Random(100) < 60) {
+            out[at++] = '"';
+            for (int len = 4 + Random(40); len > 0; len--) {
+                uint32_t r = Random(32);
+                if (r == 0) {
+                    out[at++] = '\\';
+                    out[at++] = '"';
+                } else {
+                    out[at++] = r < 6 ? ' ' : (char)('a' + r - 6);
+                }
+            }
+            out[at++] = '"';
+        } else if (Random(100) < 15) {
+            at += sprintf(out + at, "%u", Random(100000));
+        } else {
+            Identifier(out, &at, profile == PROFILE_IDENTIFIERS ? 4 + Random(16) : 1 + Random(6));
+        }
+
+        // operators run together, everything else is spaced out
+        if (profile != PROFILE_OPERATORS || Random(3) == 0) {
+            out[at++] = ' ';
+        }
+        if (++column >= 12) {
+            out[at++] = '\n';
+            column = 0;
+        }
+    }
+
+    out[at] = '\0';
+    return out;
+}
+
+typedef struct {
+    double   seconds;
+    intmax_t tokens;
+    size_t   allocations;
+    size_t   peak;
+} BenchResult;
+
+typedef enum {
+    CASE_INIT,
+    CASE_INIT_ZEROCOPY,
+    CASE_INIT_SOA,
+    CASE_INIT_PARALLEL,
+    CASE_RESET,
+    CASE_ITERATE,
+    CASE_STREAMING,
+    CASE_LEXER,
+    CASE_COUNT
+} BenchCase;
+
+static const char *case_names[CASE_COUNT] = {
+    "parser_init", "P_ZEROCOPY", "P_SOA", "parallel x4", "parser_reset", "get_token loop", "P_STREAMING", "lexer_init"
+};
+
+static intmax_t RunCase(BenchCase which, const char *buffer, intmax_t size, const punc_list_t *plist, double *seconds,
+                        kmem_stats_t *before)
+{
+    const int options = P_ACCEPT_DOUBLEQUOTES;
+    intmax_t tokens = 0;
+    double start = Now();
+
+    if (which == CASE_ITERATE) {
+        // only the loop is timed, over a parser built up front
+        parser_t *parser = parser_init_n(buffer, size, plist, options | P_ZEROCOPY);
+        start = Now();
+        for (token_t token = parser_get_token(parser); token.id != -2; token = parser_get_token(parser)) {
+            tokens++;
+        }
+        *seconds = Now() - start;
+        parser_destroy(parser);
+        return tokens;
+    }
+
+    if (which == CASE_RESET) {
+        // a parser reused for every message, warmed up by the first one
+        parser_t *parser = parser_init_n(buffer, size, plist, options);
+        kmem_reset_peak();
+        kmem_get_stats(before); // only the reset's allocations count
+        start = Now();
+        parser_reset(parser, buffer, size);
+        *seconds = Now() - start;
+        tokens = parser_token_count(parser);
+        parser_destroy(parser);
+        return tokens;
+    }
+
+    if (which == CASE_STREAMING) {
+        parser_t *parser = parser_init_n(buffer, size, plist, options | P_STREAMING);
+        for (token_t token = parser_get_token(parser); token.id != -2; token = parser_get_token(parser)) {
+            tokens++;
+        }
+        *seconds = Now() - start;
+        parser_destroy(parser);
+        return tokens;
+    }
+
+    if (which == CASE_LEXER) {
+        lexer_t *lexer = lexer_init(buffer, plist, options);
+        *seconds = Now() - start;
+        tokens = lexer->lexemes.count;
+        lexer_destroy(lexer);
+        return tokens;
+    }
+
+    parser_t *parser = nullptr;
+    switch (which) {
+        case CASE_INIT_ZEROCOPY: parser = parser_init_n(buffer, size, plist, options | P_ZEROCOPY); break;
+        case CASE_INIT_SOA:      parser = parser_init_n(buffer, size, plist, options | P_SOA); break;
+        case CASE_INIT_PARALLEL: parser = parser_init_parallel(buffer, size, plist, options | P_ZEROCOPY, 4); break;
+        default:                 parser = parser_init_n(buffer, size, plist, options); break;
+    }
+    *seconds = Now() - start;
+    tokens = parser_token_count(parser);
+    parser_destroy(parser);
+    return tokens;
+}
+
+static BenchResult Measure(BenchCase which, const char *buffer, intmax_t size, const punc_list_t *plist, int runs)
+{
+    BenchResult best = { .seconds = 1e30 };
+
+    for (int run = 0; run < runs; run++) {
+        kmem_stats_t before, after;
+        kmem_reset_peak();
+        kmem_get_stats(&before);
+
+        double seconds = 0;
+        intmax_t tokens = RunCase(which, buffer, size, plist, &seconds, &before);
+
+        kmem_get_stats(&after);
+        if (seconds < best.seconds) {
+            best.seconds = seconds;
+            best.tokens = tokens;
+            best.allocations = after.total_count - before.total_count;
+            best.peak = after.peak_bytes - before.live_bytes;
+        }
+    }
+
+    return best;
+}
+
+void BenchParser(intmax_t size, int density, int runs)
+{
+    punc_list_t *plist = punc_init();
+    for (int i = 0; i < (int)(sizeof(punctuation) / sizeof(punctuation[0])); i++) {
+        punc_add(plist, punctuation[i].p, punctuation[i].id);
+    }
+    punc_ignore(plist, P_LineComment, "\n");
+    punc_ignore(plist, P_BlockComment, "*/");
+    punc_compile(plist);
+
+    printf("%-12s %-15s %9s %9s %9s %13s %9s\n", "profile", "case", "MB/s", "Mtok/s", "ns/token", "allocs/token", "peak MB");
+    for (int profile = 0; profile < PROFILE_COUNT; profile++) {
+        int profile_density = density;
+        if (profile_density < 0) {
+            static const int defaults[PROFILE_COUNT] = { 70, 10, 20, 25 };
+            profile_density = defaults[profile];
+        }
+
+        char *buffer = Generate((BenchProfile)profile, size, profile_density);
+        intmax_t length = strlen(buffer);
+
+        for (int which = 0; which < CASE_COUNT; which++) {
+            BenchResult r = Measure((BenchCase)which, buffer, length, plist, runs);
+            double tokens = r.tokens > 0 ? (double)r.tokens : 1;
+            printf("%-12s %-15s %9.1f %9.2f %9.2f %13.6f %9.2f\n",
+                   profile_names[profile], case_names[which],
+                   length / r.seconds / 1e6, r.tokens / r.seconds / 1e6, r.seconds * 1e9 / tokens,
+                   r.allocations / tokens, r.peak / 1e6);
+        }
+        printf("\n");
+        free(buffer);
+    }
+
+    punc_destroy(plist);
+}
+
+#define BENCH_ALLOCATIONS (1 << 20)
+
+// keeps the compiler from folding malloc/free pairs away
+static void * volatile bench_sink;
+
+// alloc/free pairs and an allocate-everything-then-free batch, tracked by
+// kalloc and straight malloc/free
+void BenchMemory(int runs)
+{
+    void **blocks = (void**) malloc(sizeof(void*) * BENCH_ALLOCATIONS);
+    size_t *sizes = (size_t*) malloc(sizeof(size_t) * BENCH_ALLOCATIONS);
+    for (int i = 0; i < BENCH_ALLOCATIONS; i++) {
+        sizes[i] = 16 + Random(240);
+    }
+
+    printf("%-28s %12s %12s %9s\n", "kalloc", "Mops/s", "ns/op", "peak MB");
+    for (int tracked = 1; tracked >= 0; tracked--) {
+        double pairs = 1e30, batch = 1e30;
+        size_t peak = 0;
+
+        for (int run = 0; run < runs; run++) {
+            kmem_stats_t before, after;
+            kmem_reset_peak();
+            kmem_get_stats(&before);
+
+            double start = Now();
+            for (int i = 0; i < BENCH_ALLOCATIONS; i++) {
+                void *p = tracked ? __alloc(sizes[i]) : malloc(sizes[i]);
+                bench_sink = p;
+                if (tracked) {
+                    __free(p);
+                } else {
+                    free(p);
+                }
+            }
+            double mid = Now();
+            for (int i = 0; i < BENCH_ALLOCATIONS; i++) {
+                blocks[i] = tracked ? __alloc(sizes[i]) : malloc(sizes[i]);
+            }
+            for (int i = 0; i < BENCH_ALLOCATIONS; i++) {
+                if (tracked) {
+                    __free(blocks[i]);
+                } else {
+                    free(blocks[i]);
+                }
+            }
+            double end = Now();
+
+            kmem_get_stats(&after);
+            if (mid - start < pairs) pairs = mid - start;
+            if (end - mid < batch) batch = end - mid;
+            peak = after.peak_bytes - before.live_bytes;
+        }
+
+        const char *name = tracked ? "kmem_alloc/kmem_free" : "malloc/free";
+        printf("%-21s pairs %12.2f %12.2f %9s\n", name, BENCH_ALLOCATIONS / pairs / 1e6, pairs * 1e9 / BENCH_ALLOCATIONS, "-");
+        char peak_mb[32] = "-"; // malloc isn't tracked
+        if (tracked) {
+            snprintf(peak_mb, sizeof(peak_mb), "%.2f", peak / 1e6);
+        }
+        printf("%-21s batch %12.2f %12.2f %9s\n", name, 2 * BENCH_ALLOCATIONS / batch / 1e6, batch * 1e9 / (2 * BENCH_ALLOCATIONS), peak_mb);
+    }
+
+    free(sizes);
+    free(blocks);
+}
+
+int main(int argc, char* argv[])
+{
+    intmax_t size = (argc > 1 ? atoi(argv[1]) : 16) * (intmax_t)1024 * 1024;
+    int density = argc > 2 ? atoi(argv[2]) : -1; // the profile's own
+    int runs = argc > 3 ? atoi(argv[3]) : 3;
+
+    BenchParser(size, density, runs);
+    BenchMemory(runs);
+    return 0;
+}
@@ -21,12 +21,45 @@
 /// #define USE_KALLOC              // this will use memory tracking (not defining will use malloc/calloc/free)
 /// #define KALLOC_IMPLEMENTATION   // Define this in a single file
 /// #include "kalloc.h"
+///
+/// kparser:
+/// Define KALLOC_KPARSER and include kalloc.h before kparser.h to track the
+/// parser's allocations too (its _KMALLOC/_KREALLOC/_KFREE hooks).
+///
+/// Threads:
+/// Every thread tracks its allocations in its own shard, so tracked builds of
+/// multithreaded programs don't serialize on a global lock (link with -pthread).
+/// Freeing another thread's allocation is queued, the memory is released once
+/// the queue is drained (every KALLOC_REMOTE_BATCH frees, or by kmem_leaks and
+/// kmem_print_leaks which merge every shard). Define KALLOC_NO_THREADS for a
+/// single unsynchronized table.
+///
+/// Headers:
+/// Define KALLOC_HEADERS (before the implementation) to store the record in a
+/// header right before each block instead of a side table. Live blocks are
+/// linked into their shard's list, so kmem_free needs no lookup and there's no
+/// table to grow. Every pointer passed to kmem_free must then come from
+/// kmem_alloc/kmem_calloc/kmem_realloc/kmem_aligned_alloc.
+///
+/// Sampling:
+/// Define KALLOC_SAMPLE_RATE (e.g. (512 * 1024)) to only track about one
+/// allocation per that many bytes allocated, picked like a Poisson process
+/// over the bytes (heap-profiler style). Each sampled allocation stands for
+/// size / (1 - e^(-size / rate)) bytes, reports and kmem_get_stats show those 
+/// estimates. Frees of untracked pointers are filtered out before any lookup.
+///
+/// Stacks:
+/// Define KALLOC_STACKS to also record the call stack of every tracked
+/// allocation (up to KALLOC_STACK_DEPTH frames, walked through the frame
+/// pointers so build with -fno-omit-frame-pointer). Stacks are interned, a
+/// record only stores a 32-bit id, and kmem_print_leaks groups leaks by stack.
 
 #ifndef KALLOC_H
 #define KALLOC_H
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdio.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -34,24 +67,133 @@ extern "C" {
 
 void*   kmem_alloc(size_t bytes, const char *file, const char *func, size_t line);
 void*   kmem_calloc(size_t num_items, size_t bytes, const char *file, const char *func, size_t line);
+// The record follows the block and takes the new size and call site, stats 
+// count it as an allocation of the new size
+void*   kmem_realloc(void *ptr, size_t bytes, const char *file, const char *func, size_t line);
+// alignment is a power of two. Free with kmem_aligned_free, it's kmem_free 
+// except with MSVC (whose aligned blocks can't be realloc'd either)
+void*   kmem_aligned_alloc(size_t alignment, size_t bytes, const char *file, const char *func, size_t line);
+void    kmem_aligned_free(void *ptr);
 bool    kmem_leaks();
 void    kmem_print_leaks();
 void    kmem_free(void *ptr);
 
+// power-of-two size classes, class i counts sizes in [2^i, 2^(i+1)) 
+// (class 0 includes 0)
+#define KMEM_SIZE_CLASSES (sizeof(size_t) * 8)
+
+typedef struct {
+    size_t live_bytes;
+    size_t live_count;
+    size_t peak_bytes;      // with threads, within KALLOC_STATS_BATCH per thread
+    size_t total_bytes;     // everything ever allocated
+    size_t total_count;
+    size_t site_count;      // distinct call sites
+    size_t size_classes[KMEM_SIZE_CLASSES]; // allocations made per size class
+} kmem_stats_t;
+
+void    kmem_get_stats(kmem_stats_t *stats); // kmem_alloc/kmem_calloc only, pools and arenas aren't included
+void    kmem_reset_peak(); // peak_bytes starts over from the bytes live now
+
+typedef enum {
+    KMEM_DUMP_COLLAPSED,    // "frame;frame;site bytes" lines for flamegraph tools
+    KMEM_DUMP_PPROF         // pprof's legacy heap profile, needs KALLOC_STACKS
+} kmem_dump_format_t;
+
+// Write the live allocations to out without allocating, false if the format
+// isn't available in this build or writing failed
+bool    kmem_dump(FILE *out, kmem_dump_format_t format);
+
+// Fixed-size object pool, objects are carved from slabs of objs_per_slab 
+// and recycled through a free list. Live objects are reported per pool by 
+// kmem_print_leaks until the pool is destroyed
+typedef struct kpool_t kpool_t;
+
+kpool_t* kpool_create(size_t obj_size, size_t objs_per_slab);
+void*   kpool_alloc(kpool_t *pool, const char *file, const char *func, size_t line);
+void    kpool_free(kpool_t *pool, void *ptr);
+void    kpool_destroy(kpool_t *pool); // releases every slab, live objects included
+
+#define __pool_alloc(p)     kpool_alloc(p, __FILE__, __func__, __LINE__)
+#define __pool_free(p,x)    kpool_free(p, x)
+
+// Linear allocator, allocations are bumped out of blocks of block_size and 
+// released all at once by karena_reset/karena_free. Arenas aren't 
+// thread-safe, until karena_free kmem_print_leaks reports the memory in use
+// and its high-water mark
+typedef struct karena_block_t karena_block_t;
+
+typedef struct karena_t {
+    karena_block_t *blocks;     // current block first
+    karena_block_t *spare;      // blocks released by karena_reset, reused first
+    size_t block_size;
+    size_t used;                // bytes handed out
+    size_t peak;                // high-water mark of used
+    size_t reserved;            // bytes held in blocks (spare included)
+    struct karena_t *prev;
+    struct karena_t *next;
+} karena_t;
+
+typedef struct {
+    karena_block_t *block;
+    size_t offset;
+    size_t used;
+} karena_mark_t;
+
+void    karena_init(karena_t *arena, size_t block_size);
+void*   karena_alloc(karena_t *arena, size_t size, size_t align); // align is a power of two, 0 for 16
+karena_mark_t karena_mark(karena_t *arena);
+void    karena_reset(karena_t *arena, karena_mark_t mark); // release everything allocated after the mark
+void    karena_free(karena_t *arena);
+
+// Allocation hooks with the signatures of malloc/realloc/free, they allocate 
+// from the arena bound to the calling thread (or the heap when there's none),
+// e.g. to give kparser.h a per-request arena:
+//    #define _KMALLOC(x)     karena_hook_alloc(x)
+//    #define _KREALLOC(a,b)  karena_hook_realloc(a,b)
+//    #define _KFREE(x)       karena_hook_free(x)
+karena_t* karena_bind(karena_t *arena); // returns the previously bound arena
+void*   karena_hook_alloc(size_t size);
+void*   karena_hook_realloc(void *ptr, size_t size);
+void    karena_hook_free(void *ptr);
+
 #ifdef USE_KALLOC
     #define __alloc(x)      kmem_alloc(x, __FILE__, __func__, __LINE__)
     #define __calloc(x,y)   kmem_calloc(x, y, __FILE__, __func__, __LINE__)
+    #define __realloc(x,y)  kmem_realloc(x, y, __FILE__, __func__, __LINE__)
+    #define __aligned_alloc(a,x) kmem_aligned_alloc(a, x, __FILE__, __func__, __LINE__)
+    #define __aligned_free(x) kmem_aligned_free(x)
     #define __free(x)       kmem_free(x)
     #define __leaks()       kmem_leaks()
     #define __print_leaks() kmem_print_leaks()
 #else
     #define __alloc(x)      malloc(x)
     #define __calloc(x,y)   calloc(x,y)
+    #define __realloc(x,y)  realloc(x,y)
+    #if defined(_MSC_VER)
+        #define __aligned_alloc(a,x) _aligned_malloc(x, a)
+        #define __aligned_free(x) _aligned_free(x)
+    #else
+        #define __aligned_alloc(a,x) aligned_alloc(a, ((x) + (a) - 1) / (a) * (a))
+        #define __aligned_free(x) free(x)
+    #endif
     #define __free(x)       if(x) { free(x); }
     #define __leaks()       0
     #define __print_leaks() 0
 #endif
 
+// Route kparser.h's allocations through kalloc (including kalloc.h before 
+// kparser.h), unless it was already given other hooks
+#if defined(KALLOC_KPARSER) && !defined(_KMALLOC)
+    #define _KMALLOC(x)     __alloc(x)
+    #define _KREALLOC(a,b)  __realloc(a,b)
+    #ifdef USE_KALLOC
+        #define _KFREE(x)   kmem_free(x)
+    #else
+        #define _KFREE(x)   free(x)
+    #endif
+#endif
+
 #ifdef __cplusplus
 };
 #endif
@@ -60,148 +202,2437 @@ void    kmem_free(void *ptr);
 
 #ifdef KALLOC_IMPLEMENTATION
 
-void _kmem_append(void* ptr, size_t size, const char *file, const char *func, size_t line);
-char * _kmem_bytes(size_t size);
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef nullptr
+    #define nullptr (void*)NULL
+#endif // nullptr
+
+#if defined(__linux__)
+    #include <fcntl.h>
+    #include <unistd.h>
+#endif // __linux__
+#if defined(KALLOC_STACKS)
+    #if defined(_MSC_VER)
+        #include <windows.h>
+    #elif defined(__GLIBC__) || defined(__APPLE__)
+        #include <execinfo.h>
+        #define _KMEM_SYMBOLS
+    #endif
+#endif // KALLOC_STACKS
+#if !defined(KALLOC_NO_THREADS)
+    #if defined(_WIN32) && defined(_MSC_VER)
+        #include <windows.h>
+        #define _KMEM_THREADS_WIN32
+    #elif (defined(__unix__) || defined(__APPLE__)) && defined(__GNUC__)
+        #include <pthread.h>
+        #define _KMEM_THREADS_PTHREAD
+    #endif
+#endif // KALLOC_NO_THREADS
+
+#if defined(_KMEM_THREADS_WIN32)
+    #define _KMEM_TLS __declspec(thread)
+    #define _KMEM_LOAD(p) (*(p))
+    #define _KMEM_STORE(p,v) InterlockedExchange((p), (v))
+    #define _KMEM_XCHG(p,v) InterlockedExchange((p), (v))
+    #define _KMEM_CAS(p,o,v) (InterlockedCompareExchange((p), (v), (o)) == (o))
+    #define _KMEM_ADD(p,v) InterlockedExchangeAdd((p), (v))
+    #define _KMEM_LOAD64(p) InterlockedCompareExchange64((p), 0, 0)
+    #define _KMEM_ADD64(p,v) InterlockedExchangeAdd64((p), (v))
+    #define _KMEM_CAS64(p,o,v) (InterlockedCompareExchange64((p), (v), (o)) == (o))
+    #define _KMEM_XCHG_PTR(p,v) InterlockedExchangePointer((p), (v))
+    #define _KMEM_CAS_PTR(p,o,v) (InterlockedCompareExchangePointer((p), (v), (o)) == (o))
+    #define _KMEM_PAUSE() YieldProcessor()
+#elif defined(_KMEM_THREADS_PTHREAD)
+    #define _KMEM_TLS __thread
+    #define _KMEM_LOAD(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+    #define _KMEM_STORE(p,v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+    #define _KMEM_XCHG(p,v) __atomic_exchange_n((p), (v), __ATOMIC_ACQ_REL)
+    #define _KMEM_CAS(p,o,v) __extension__ ({ long _o = (o); \
+        __atomic_compare_exchange_n((p), &_o, (v), false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE); })
+    #define _KMEM_ADD(p,v) __atomic_fetch_add((p), (v), __ATOMIC_ACQ_REL)
+    #define _KMEM_LOAD64(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+    #define _KMEM_ADD64(p,v) __atomic_fetch_add((p), (v), __ATOMIC_ACQ_REL)
+    #define _KMEM_CAS64(p,o,v) __extension__ ({ int64_t _o = (o); \
+        __atomic_compare_exchange_n((p), &_o, (v), false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE); })
+    #define _KMEM_XCHG_PTR(p,v) __atomic_exchange_n((p), (v), __ATOMIC_ACQ_REL)
+    #define _KMEM_CAS_PTR(p,o,v) __extension__ ({ void *_o = (o); \
+        __atomic_compare_exchange_n((p), &_o, (v), false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE); })
+    #if defined(__x86_64__) || defined(__i386__)
+        #define _KMEM_PAUSE() __builtin_ia32_pause()
+    #else
+        #define _KMEM_PAUSE() ((void)0)
+    #endif
+#endif
+
+#if !defined(_KMEM_THREADS_WIN32) && !defined(_KMEM_THREADS_PTHREAD)
+    #define _KMEM_TLS
+    #define _KMEM_LOAD(p) (*(p))
+    #define _KMEM_CAS(p,o,v) (*(p) == (o) ? (*(p) = (v), true) : false)
+    #define _KMEM_CAS_PTR(p,o,v) (*(p) == (o) ? (*(p) = (v), true) : false)
+    #define _KMEM_ADD(p,v) ((*(p) += (v)) - (v))
+    #define _KMEM_LOAD64(p) (*(p))
+    #define _KMEM_ADD64(p,v) ((*(p) += (v)) - (v))
+    #define _KMEM_CAS64(p,o,v) (*(p) == (o) ? (*(p) = (v), true) : false)
+#endif // _KMEM_THREADS_WIN32 || _KMEM_THREADS_PTHREAD
+
+// freed slot in the allocation table, keeps the probe chains intact
+#define _KMEM_TOMBSTONE ((void*)(uintptr_t)1)
+
+// cross-thread frees queued before one of them drains the queue
+#ifndef KALLOC_REMOTE_BATCH
+    #define KALLOC_REMOTE_BATCH 64
+#endif // KALLOC_REMOTE_BATCH
+
+// bytes a shard allocates (or frees) before it updates the global live count
+// the peak is taken from
+#ifndef KALLOC_STATS_BATCH
+    #if defined(KALLOC_NO_THREADS)
+        #define KALLOC_STATS_BATCH 0
+    #else
+        #define KALLOC_STATS_BATCH (64 * 1024)
+    #endif
+#endif // KALLOC_STATS_BATCH
+
+#if !defined(KALLOC_HEADERS)
+void _kmem_append(void* ptr, size_t size, size_t weight, const char *file, const char *func, size_t line);
+#endif // KALLOC_HEADERS
+char * _kmem_bytes(size_t size, char *buffer, size_t length);
+
+// long enough for any _kmem_bytes output
+#define _KMEM_BYTES_LEN 32
 
 typedef struct {
-    void *ptr;
+    void *ptr;          // nullptr if the slot is empty, _KMEM_TOMBSTONE once freed
     size_t size;
-    bool freed;
     const char *file;
     const char *func;
     size_t line;
+    size_t weight;      // bytes it stands for, the size unless sampled
+#if defined(KALLOC_STACKS)
+    uint32_t stack;     // interned call stack, 0 if unknown
+#endif // KALLOC_STACKS
 } kmem_allocation_t;
 
-struct {
-    kmem_allocation_t *items;
-    size_t capacity;
+// allocations per call site, sites are never removed
+typedef struct {
+    const char *file;   // nullptr if the slot is empty
+    const char *func;
+    size_t line;
     size_t count;
-} kmem_allocation_state = {
-    .items = nullptr,
-    .count =  0,
-    .capacity = -1
+    size_t bytes;
+    size_t live_count;
+    size_t live_bytes;
+} kmem_site_t;
+
+#if defined(KALLOC_HEADERS)
+// Stored right before every block handed out, live blocks are linked into
+// their shard's list
+typedef struct kmem_header_t {
+    struct kmem_header_t *prev;
+    struct kmem_header_t *next;
+    struct kmem_header_t *remote;   // next in the owner's remote-free queue
+    struct kmem_shard_t *shard;     // owner, nullptr if untracked
+    void *base;                     // what malloc returned, the header itself unless aligned
+    kmem_allocation_t info;         // info.ptr is the block, checked on free
+} kmem_header_t;
+
+// keeps the block aligned like the one malloc returned
+#define _KMEM_HEADER_SIZE ((sizeof(kmem_header_t) + 15) & ~(size_t)15)
+#endif // KALLOC_HEADERS
+
+// Allocations made by one thread, an open-addressing (linear probing) hash 
+// table keyed on the pointer (or a list of block headers with 
+// KALLOC_HEADERS). Only the owning thread inserts into it, the lock is only 
+// ever contended while a remote free is drained or leaks are being reported
+typedef struct kmem_shard_t {
+#if defined(KALLOC_HEADERS)
+    kmem_header_t *blocks;          // most recent first
+    kmem_header_t * volatile remote; // blocks freed by other threads
+    volatile long remote_count;
+#else
+    kmem_allocation_t *items;
+    size_t capacity;    // power of two
+    size_t used;        // live allocations + tombstones
+#endif // KALLOC_HEADERS
+    size_t count;       // live allocations
+    kmem_site_t *sites; // open-addressing on (file, line)
+    size_t site_capacity;
+    size_t site_count;
+    size_t live_bytes;
+    size_t live_count;  // estimated when sampling, count is the records
+    size_t total_bytes;
+    size_t total_count;
+    int64_t pending;    // live byte delta not yet added to _kmem_live_bytes
+    size_t size_classes[KMEM_SIZE_CLASSES];
+    volatile long lock;
+    volatile long owned; // a thread is using it, cleared when that thread exits
+    struct kmem_shard_t *next;
+} kmem_shard_t;
+
+#if !defined(KALLOC_HEADERS)
+// A free of a pointer that isn't in the calling thread's shard. The actual
+// free() is deferred until the record is gone from its shard, otherwise the
+// address could be handed out again and tracked twice
+typedef struct kmem_remote_t {
+    struct kmem_remote_t *next;
+    void *ptr;
+    bool found;
+} kmem_remote_t;
+#endif // KALLOC_HEADERS
+
+// the first shard is static, a single-threaded program never allocates one
+kmem_shard_t kmem_allocation_state = {
+    .count = 0,
+    .lock = 0,
+    .owned = 0,
+    .next = nullptr
 };
 
-inline char * _kmem_bytes(size_t size)
+#if defined(_KMEM_THREADS_WIN32) || defined(_KMEM_THREADS_PTHREAD)
+// registry of every shard, shards are pushed and never unlinked
+static kmem_shard_t * volatile _kmem_shards = &kmem_allocation_state;
+#if !defined(KALLOC_HEADERS)
+// lock-free (Treiber) stack of pending cross-thread frees
+static kmem_remote_t * volatile _kmem_remote = nullptr;
+static volatile long _kmem_remote_count = 0;
+static volatile long _kmem_draining = 0;
+#endif // KALLOC_HEADERS
+static _KMEM_TLS kmem_shard_t *_kmem_shard = nullptr;
+
+#if defined(_KMEM_THREADS_WIN32)
+static DWORD _kmem_fls = FLS_OUT_OF_INDEXES;
+static INIT_ONCE _kmem_once = INIT_ONCE_STATIC_INIT;
+
+static void WINAPI _kmem_thread_exit(void *shard)
 {
-    char *buffer = malloc(128);
+    _KMEM_STORE(&((kmem_shard_t*)shard)->owned, 0);
+}
 
-    const char *sizes[] = { "B", "KB", "MB", "GB", "TB", "PB" };
-    double len = (double)size;
-    int order = 0;
+static BOOL CALLBACK _kmem_key_init(PINIT_ONCE once, void *param, void **ctx)
+{
+    (void)once; (void)param; (void)ctx;
+    _kmem_fls = FlsAlloc(_kmem_thread_exit);
+    return TRUE;
+}
+#else
+static pthread_key_t _kmem_key;
+static pthread_once_t _kmem_once = PTHREAD_ONCE_INIT;
 
-    while (len >= 1024 && order < (int)(sizeof(sizes) / sizeof(*sizes)) - 1) {
-        order++;
-        len /= 1024;
+static void _kmem_thread_exit(void *shard)
+{
+    _KMEM_STORE(&((kmem_shard_t*)shard)->owned, 0);
+}
+
+static void _kmem_key_init()
+{
+    pthread_key_create(&_kmem_key, _kmem_thread_exit);
+}
+#endif
+
+static inline void _kmem_spin_lock(volatile long *lock)
+{
+    while ( _KMEM_XCHG(lock, 1) ) {
+        while ( _KMEM_LOAD(lock) ) {
+            _KMEM_PAUSE();
+        }
     }
+}
+
+static inline void _kmem_spin_unlock(volatile long *lock)
+{
+    _KMEM_STORE(lock, 0);
+}
 
-    snprintf(buffer, 128, "%.2f %s", len, sizes[order]);
+static inline void _kmem_lock(kmem_shard_t *shard)
+{
+    _kmem_spin_lock(&shard->lock);
+}
 
-    return buffer;
+static inline void _kmem_unlock(kmem_shard_t *shard)
+{
+    _kmem_spin_unlock(&shard->lock);
 }
-inline void _kmem_append(void* ptr, size_t size, const char * file, const char * func, size_t line)
+
+// The calling thread's shard, adopting one left behind by a thread that has
+// exited (its live records come along) before allocating a new one
+static kmem_shard_t *_kmem_local()
 {
-    if ( kmem_allocation_state.capacity == -1 ) {
-        kmem_allocation_state.capacity = 256;
-        kmem_allocation_state.items = (void*) malloc(kmem_allocation_state.capacity * sizeof(void *));
+    if ( _kmem_shard ) {
+        return _kmem_shard;
     }
 
-    if ( kmem_allocation_state.capacity < kmem_allocation_state.count ) {
-        kmem_allocation_state.capacity *= 2;
-        kmem_allocation_state.items = realloc(kmem_allocation_state.items, kmem_allocation_state.capacity);
+    kmem_shard_t *shard = nullptr;
+    for ( kmem_shard_t *s = _KMEM_LOAD(&_kmem_shards); s; s = s->next ) {
+        if ( _KMEM_LOAD(&s->owned) == 0 && _KMEM_CAS(&s->owned, 0, 1) ) {
+            shard = s;
+            break;
+        }
     }
 
-    kmem_allocation_state.items[kmem_allocation_state.count++] = (kmem_allocation_t) {
-        .ptr = ptr,
-        .size = size,
-        .freed = false,
-        .file = file,
-        .line = line,
-        .func = func
+    if ( !shard ) {
+        shard = (kmem_shard_t*) calloc(1, sizeof(kmem_shard_t));
+        if ( !shard ) {
+            return nullptr;
+        }
+        shard->owned = 1;
+        do {
+            shard->next = _KMEM_LOAD(&_kmem_shards);
+        } while ( !_KMEM_CAS_PTR((void* volatile*)&_kmem_shards, shard->next, shard) );
+    }
 
-    };
+    // release the shard when the thread exits
+#if defined(_KMEM_THREADS_WIN32)
+    InitOnceExecuteOnce(&_kmem_once, _kmem_key_init, nullptr, nullptr);
+    if ( _kmem_fls != FLS_OUT_OF_INDEXES ) {
+        FlsSetValue(_kmem_fls, shard);
+    }
+#else
+    pthread_once(&_kmem_once, _kmem_key_init);
+    pthread_setspecific(_kmem_key, shard);
+#endif
+
+    _kmem_shard = shard;
+    return shard;
 }
+#else
+static inline void _kmem_spin_lock(volatile long *lock) { (void)lock; }
+static inline void _kmem_spin_unlock(volatile long *lock) { (void)lock; }
+static inline void _kmem_lock(kmem_shard_t *shard) { (void)shard; }
+static inline void _kmem_unlock(kmem_shard_t *shard) { (void)shard; }
+static inline kmem_shard_t *_kmem_local() { return &kmem_allocation_state; }
+#endif // _KMEM_THREADS_WIN32 || _KMEM_THREADS_PTHREAD
 
-inline void *kmem_alloc(size_t size, const char *file, const char *func, size_t line)
+#if defined(KALLOC_SAMPLE_RATE)
+// bytes left before the calling thread's next sample, and its generator
+static _KMEM_TLS int64_t _kmem_sample_left = -1;
+static _KMEM_TLS uint64_t _kmem_sample_rng = 0;
+
+// e^-x for x >= 0, close enough for sampling weights without libm
+static double _kmem_exp_neg(double x)
 {
-    void *ptr = malloc(size);
+    if ( x > 700.0 ) {
+        return 0.0;
+    }
 
-    if ( ptr ) {
-        _kmem_append(ptr, size, file, func, line);
+    int halvings = 0;
+    while ( x > 0.125 ) {
+        x *= 0.5;
+        halvings++;
+    }
 
-        return ptr;
+    double r = 1.0 - x + x * x / 2.0 - x * x * x / 6.0 + x * x * x * x / 24.0;
+    while ( halvings-- > 0 ) {
+        r *= r;
     }
+    return r;
+}
 
-    return nullptr;
+// Exponentially distributed distance to the next sample, with a mean of 
+// KALLOC_SAMPLE_RATE bytes
+static int64_t _kmem_sample_distance()
+{
+    if ( _kmem_sample_rng == 0 ) {
+        _kmem_sample_rng = (uint64_t)(uintptr_t)&_kmem_sample_rng ^ 0x9e3779b97f4a7c15ULL;
+    }
+
+    // xorshift64*, the top 26 bits as a uniform q in [1, 2^26]
+    _kmem_sample_rng ^= _kmem_sample_rng >> 12;
+    _kmem_sample_rng ^= _kmem_sample_rng << 25;
+    _kmem_sample_rng ^= _kmem_sample_rng >> 27;
+    uint64_t q = ((_kmem_sample_rng * 0x2545f4914f6cdd1dULL) >> 38) + 1;
+
+    // -ln(q / 2^26) = (26 - log2(q)) * ln(2), log2 of the mantissa from a 
+    // quadratic fit
+    int e = 0;
+    while ( (q >> (e + 1)) != 0 ) {
+        e++;
+    }
+    double m = (double)q / (double)((uint64_t)1 << e);
+    double log2q = e + (-0.34484843 * m + 2.02466578) * m - 1.67487759;
+    double distance = (26.0 - log2q) * 0.6931471805599453 * (double)KALLOC_SAMPLE_RATE;
+
+    return distance < 1.0 ? 1 : (int64_t)distance;
 }
 
-inline void *kmem_calloc(size_t num_items, size_t size, const char *file, const char *func, size_t line)
+// Whether the allocation is sampled, weight is the bytes it then stands for
+static inline bool _kmem_sample(size_t size, size_t *weight)
 {
-    void *ptr = calloc(num_items, size);
+    if ( _kmem_sample_left < 0 ) {
+        _kmem_sample_left = _kmem_sample_distance();
+    }
 
-    if ( ptr ) {
-        _kmem_append(ptr, size, file, func, line);
-        return ptr;
+    _kmem_sample_left -= (int64_t)(size ? size : 1);
+    if ( _kmem_sample_left >= 0 ) {
+        return false;
     }
-    return nullptr;
+    _kmem_sample_left = _kmem_sample_distance();
+
+    double p = 1.0 - _kmem_exp_neg((double)size / (double)KALLOC_SAMPLE_RATE);
+    *weight = p > 0.0 ? (size_t)((double)size / p) : (size_t)KALLOC_SAMPLE_RATE;
+    if ( *weight < size ) {
+        *weight = size;
+    }
+    return true;
+}
+#else
+static inline bool _kmem_sample(size_t size, size_t *weight)
+{
+    *weight = size;
+    return true;
 }
+#endif // KALLOC_SAMPLE_RATE
 
-inline void kmem_free(void *ptr)
+// allocations a record stands for
+static inline size_t _kmem_estimate(const kmem_allocation_t *item)
 {
-    if ( ptr ) {
-        for ( size_t i = 0; i < kmem_allocation_state.count; i++ ) {
-
-            if ( kmem_allocation_state.items[i].ptr == ptr && !kmem_allocation_state.items[i].freed ) {
-                kmem_allocation_state.items[i].freed = true;
-                kmem_allocation_state.items[i].ptr = nullptr;
-                kmem_allocation_state.items[i].file = "";
-                kmem_allocation_state.items[i].func = "";
-                kmem_allocation_state.items[i].line = 0;
-                kmem_allocation_state.count--;
-                break;
+    if ( item->size == 0 || item->weight <= item->size ) {
+        return 1;
+    }
+    return (item->weight + item->size / 2) / item->size;
+}
+
+#if defined(KALLOC_STACKS)
+#ifndef KALLOC_STACK_DEPTH
+    #define KALLOC_STACK_DEPTH 16
+#endif // KALLOC_STACK_DEPTH
+// distinct stacks kept, further ones are recorded as unknown (id 0)
+#ifndef KALLOC_STACK_TABLE
+    #define KALLOC_STACK_TABLE (1 << 16)
+#endif // KALLOC_STACK_TABLE
+
+#if defined(_MSC_VER)
+    #define _KMEM_NOINLINE __declspec(noinline)
+#else
+    #define _KMEM_NOINLINE __attribute__((noinline))
+#endif
+
+typedef struct {
+    uint32_t hash;
+    uint32_t depth;
+    void *frames[KALLOC_STACK_DEPTH];
+} kmem_stack_t;
+
+// Interned stacks, append-only so ids stay valid without a lock. A stack is
+// written to its entry before its id is published in the hash slots
+static kmem_stack_t * volatile _kmem_stacks = nullptr;
+static volatile long * volatile _kmem_stack_slots = nullptr; // 2x KALLOC_STACK_TABLE ids, 0 if empty
+static volatile long _kmem_stack_next = 1;
+
+static bool _kmem_stack_tables()
+{
+    if ( _KMEM_LOAD(&_kmem_stack_slots) ) {
+        return true;
+    }
+
+    kmem_stack_t *stacks = (kmem_stack_t*) calloc(KALLOC_STACK_TABLE, sizeof(kmem_stack_t));
+    volatile long *slots = (volatile long*) calloc(2 * KALLOC_STACK_TABLE, sizeof(long));
+    if ( !stacks || !slots ) {
+        free(stacks);
+        free((void*)slots);
+        return false;
+    }
+
+    // first one to get here wins, the stacks are published before the slots
+    if ( !_KMEM_CAS_PTR((void* volatile*)&_kmem_stacks, nullptr, stacks) ) {
+        free(stacks);
+    }
+    if ( !_KMEM_CAS_PTR((void* volatile*)&_kmem_stack_slots, nullptr, (void*)slots) ) {
+        free((void*)slots);
+    }
+    return true;
+}
+
+static uint32_t _kmem_intern_stack(void **frames, uint32_t depth)
+{
+    if ( depth == 0 || !_kmem_stack_tables() ) {
+        return 0;
+    }
+
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for ( uint32_t i = 0; i < depth; i++ ) {
+        h = (h ^ (uint64_t)(uintptr_t)frames[i]) * 0x100000001b3ULL;
+    }
+    uint32_t hash = (uint32_t)(h ^ (h >> 32));
+
+    kmem_stack_t *stacks = (kmem_stack_t*) _KMEM_LOAD(&_kmem_stacks);
+    volatile long *slots = (volatile long*) _KMEM_LOAD(&_kmem_stack_slots);
+    size_t mask = 2 * KALLOC_STACK_TABLE - 1;
+    long reserved = 0;
+
+    for ( size_t slot = hash & mask, probe = 0; probe <= mask; slot = (slot + 1) & mask, probe++ ) {
+        long id = _KMEM_LOAD(&slots[slot]);
+        if ( id == 0 ) {
+            // claim an entry once, it's wasted if another thread interns the 
+            // same stack first
+            if ( reserved == 0 ) {
+                if ( _KMEM_LOAD(&_kmem_stack_next) >= KALLOC_STACK_TABLE ) {
+                    return 0;
+                }
+                reserved = _KMEM_ADD(&_kmem_stack_next, 1);
+                if ( reserved >= KALLOC_STACK_TABLE ) {
+                    return 0;
+                }
+                stacks[reserved].hash = hash;
+                stacks[reserved].depth = depth;
+                memcpy(stacks[reserved].frames, frames, depth * sizeof(void*));
             }
+            if ( _KMEM_CAS(&slots[slot], 0, reserved) ) {
+                return (uint32_t)reserved;
+            }
+            id = _KMEM_LOAD(&slots[slot]);
         }
 
-        free(ptr);
+        kmem_stack_t *stack = &stacks[id];
+        if ( stack->hash == hash && stack->depth == depth && 
+             memcmp(stack->frames, frames, depth * sizeof(void*)) == 0 ) {
+            return (uint32_t)id;
+        }
     }
+
+    return 0;
 }
 
-inline void kmem_print_leaks()
+// The caller's stack through the frame pointers, starting in the function 
+// that called this one
+static _KMEM_NOINLINE uint32_t _kmem_capture()
 {
-    size_t count = 0;
-    size_t allocated = 0;
-    printf("\nMemory Leaks:\n");
+    void *frames[KALLOC_STACK_DEPTH];
+    uint32_t depth = 0;
+
+#if defined(_MSC_VER)
+    depth = RtlCaptureStackBackTrace(1, KALLOC_STACK_DEPTH, frames, nullptr);
+#elif defined(__GNUC__)
+    // each frame starts with the caller's frame pointer and the return 
+    // address, stop at anything that doesn't look like the next frame up
+    void **fp = (void**)__builtin_frame_address(0);
+    while ( fp && depth < KALLOC_STACK_DEPTH ) {
+        void *ret = fp[1];
+        if ( !ret ) {
+            break;
+        }
+        frames[depth++] = ret;
 
-    for ( size_t i = 0; i < kmem_allocation_state.count; i++ ) {
-        if ( !kmem_allocation_state.items[i].freed ) {
-            char * b = _kmem_bytes(kmem_allocation_state.items[i].size);
-            printf("- %s (%s on line %zu): Leak at 0x%zu (size %s))\n",
-                kmem_allocation_state.items[i].file,
-                kmem_allocation_state.items[i].func,
-                kmem_allocation_state.items[i].line,
-                (size_t)kmem_allocation_state.items[i].ptr,
-                b);
-            allocated += kmem_allocation_state.items[i].size;
-            count++;
-            free(b);
+        void **next = (void**)fp[0];
+        if ( next <= fp || (uintptr_t)next - (uintptr_t)fp > (1 << 20) ||
+             ((uintptr_t)next & (sizeof(void*) - 1)) != 0 ) {
+            break;
         }
+        fp = next;
     }
-    printf("\n--------------------------------------------------\n");
-    printf("Total allocations not freed: %zu\n", count);
-    char *b = _kmem_bytes(allocated);
-    printf("Total memory not freed: %s\n", b);
-    free(b);
-    printf("--------------------------------------------------\n");
+#endif
+
+    return _kmem_intern_stack(frames, depth);
 }
+#endif // KALLOC_STACKS
 
-inline bool kmem_leaks()
+// global live bytes and their high-water mark, updated every KALLOC_STATS_BATCH
+static volatile int64_t _kmem_live_bytes = 0;
+static volatile int64_t _kmem_peak_bytes = 0;
+
+static inline size_t _kmem_size_class(size_t size)
 {
-    if ( kmem_allocation_state.count > 0 ) {
-        return true;
+    size_t c = 0;
+    while ( size > 1 ) {
+        size >>= 1;
+        c++;
     }
+    return c;
+}
 
-    return false;
+static inline size_t _kmem_site_hash(const char *file, size_t line, size_t capacity)
+{
+    uint64_t h = (uint64_t)(uintptr_t)file ^ ((uint64_t)line * 0x9e3779b97f4a7c15ULL);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+
+    return (size_t)h & (capacity - 1);
 }
 
-#endif
+// The shard's record of a call site, added if create is set. nullptr if it 
+// isn't there or the table can't grow
+static kmem_site_t *_kmem_site(kmem_shard_t *shard, const char *file, const char *func, size_t line, bool create)
+{
+    if ( create && (shard->site_count + 1) * 2 > shard->site_capacity ) {
+        size_t capacity = shard->site_capacity ? shard->site_capacity * 2 : 64;
+        kmem_site_t *sites = (kmem_site_t*) calloc(capacity, sizeof(kmem_site_t));
+        if ( !sites ) {
+            return nullptr;
+        }
+
+        for ( size_t i = 0; i < shard->site_capacity; i++ ) {
+            if ( shard->sites[i].file ) {
+                size_t slot = _kmem_site_hash(shard->sites[i].file, shard->sites[i].line, capacity);
+                while ( sites[slot].file ) {
+                    slot = (slot + 1) & (capacity - 1);
+                }
+                sites[slot] = shard->sites[i];
+            }
+        }
+
+        free(shard->sites);
+        shard->sites = sites;
+        shard->site_capacity = capacity;
+    }
+
+    if ( shard->site_capacity == 0 ) {
+        return nullptr;
+    }
+
+    size_t mask = shard->site_capacity - 1;
+    size_t slot = _kmem_site_hash(file, line, shard->site_capacity);
+    for ( ; shard->sites[slot].file; slot = (slot + 1) & mask ) {
+        if ( shard->sites[slot].file == file && shard->sites[slot].line == line ) {
+            return &shard->sites[slot];
+        }
+    }
+
+    if ( !create ) {
+        return nullptr;
+    }
+
+    shard->site_count++;
+    shard->sites[slot] = (kmem_site_t) {
+        .file = file,
+        .func = func,
+        .line = line
+    };
+    return &shard->sites[slot];
+}
+
+static void _kmem_account(kmem_shard_t *shard, int64_t delta)
+{
+    shard->pending += delta;
+    if ( shard->pending > KALLOC_STATS_BATCH || shard->pending < -(int64_t)KALLOC_STATS_BATCH ) {
+        int64_t live = _KMEM_ADD64(&_kmem_live_bytes, shard->pending) + shard->pending;
+        shard->pending = 0;
+
+        int64_t peak = _KMEM_LOAD64(&_kmem_peak_bytes);
+        while ( live > peak && !_KMEM_CAS64(&_kmem_peak_bytes, peak, live) ) {
+            peak = _KMEM_LOAD64(&_kmem_peak_bytes);
+        }
+    }
+}
+
+// Count a new allocation, the caller holds the shard's lock
+static void _kmem_account_alloc(kmem_shard_t *shard, const kmem_allocation_t *item)
+{
+    size_t count = _kmem_estimate(item);
+
+    shard->live_bytes += item->weight;
+    shard->live_count += count;
+    shard->total_bytes += item->weight;
+    shard->total_count += count;
+    shard->size_classes[_kmem_size_class(item->size)] += count;
+
+    kmem_site_t *site = _kmem_site(shard, item->file, item->func, item->line, true);
+    if ( site ) {
+        site->count += count;
+        site->bytes += item->weight;
+        site->live_count += count;
+        site->live_bytes += item->weight;
+    }
+
+    _kmem_account(shard, (int64_t)item->weight);
+}
+
+// Count a free, the caller holds the lock of the shard the record was in
+static void _kmem_account_free(kmem_shard_t *shard, const kmem_allocation_t *item)
+{
+    size_t count = _kmem_estimate(item);
+
+    shard->live_bytes -= item->weight;
+    shard->live_count -= count;
+
+    kmem_site_t *site = _kmem_site(shard, item->file, item->func, item->line, false);
+    if ( site ) {
+        site->live_count -= count;
+        site->live_bytes -= item->weight;
+    }
+
+    _kmem_account(shard, -(int64_t)item->weight);
+}
+
+#if defined(KALLOC_HEADERS)
+// Unlink a block from its shard, the caller holds the shard's lock
+static void _kmem_unlink(kmem_shard_t *shard, kmem_header_t *header)
+{
+    if ( header->prev ) {
+        header->prev->next = header->next;
+    } else {
+        shard->blocks = header->next;
+    }
+    if ( header->next ) {
+        header->next->prev = header->prev;
+    }
+    shard->count--;
+    _kmem_account_free(shard, &header->info);
+}
+
+#if defined(_KMEM_THREADS_WIN32) || defined(_KMEM_THREADS_PTHREAD)
+// Free the blocks other threads queued on the shard, the caller holds its lock
+static void _kmem_drain_shard(kmem_shard_t *shard)
+{
+    if ( !_KMEM_LOAD(&shard->remote) ) {
+        return;
+    }
+
+    kmem_header_t *header = (kmem_header_t*) _KMEM_XCHG_PTR((void* volatile*)&shard->remote, nullptr);
+    long count = 0;
+    while ( header ) {
+        kmem_header_t *next = header->remote;
+        _kmem_unlink(shard, header);
+        free(header->base);
+        header = next;
+        count++;
+    }
+    _KMEM_ADD(&shard->remote_count, -count);
+}
+#else
+static inline void _kmem_drain_shard(kmem_shard_t *shard) { (void)shard; }
+#endif // _KMEM_THREADS_WIN32 || _KMEM_THREADS_PTHREAD
+
+// Fill in the header and link it into the calling thread's shard, the 
+// caller sets header->base
+static void *_kmem_link(kmem_header_t *header, size_t size, const char *file, const char *func, size_t line)
+{
+    void *ptr = (char*)header + _KMEM_HEADER_SIZE;
+    size_t weight = 0;
+    kmem_shard_t *shard = _kmem_sample(size, &weight) ? _kmem_local() : nullptr;
+
+    header->info = (kmem_allocation_t) {
+        .ptr = ptr,
+        .size = size,
+        .file = file,
+        .line = line,
+        .func = func,
+        .weight = weight
+    };
+#if defined(KALLOC_STACKS)
+    header->info.stack = shard ? _kmem_capture() : 0;
+#endif // KALLOC_STACKS
+    header->prev = nullptr;
+    header->next = nullptr;
+    header->remote = nullptr;
+    header->shard = shard;
+
+    if ( !shard ) {
+        return ptr; // not sampled or out of memory, the allocation just isn't tracked
+    }
+
+    _kmem_lock(shard);
+    _kmem_drain_shard(shard);
+    header->next = shard->blocks;
+    if ( shard->blocks ) {
+        shard->blocks->prev = header;
+    }
+    shard->blocks = header;
+    shard->count++;
+    _kmem_account_alloc(shard, &header->info);
+    _kmem_unlock(shard);
+
+    return ptr;
+}
+#else
+static inline size_t _kmem_hash(const void *ptr, size_t capacity)
+{
+    uint64_t h = (uint64_t)(uintptr_t)ptr;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+
+    return (size_t)h & (capacity - 1);
+}
+
+// Rehash into a table that is at most a quarter full, dropping the tombstones
+static bool _kmem_rehash(kmem_shard_t *shard)
+{
+    size_t capacity = 256;
+    while ( capacity < (shard->count + 1) * 4 ) {
+        capacity *= 2;
+    }
+
+    kmem_allocation_t *items = (kmem_allocation_t*) calloc(capacity, sizeof(kmem_allocation_t));
+    if ( !items ) {
+        return false;
+    }
+
+    for ( size_t i = 0; i < shard->capacity; i++ ) {
+        kmem_allocation_t *item = &shard->items[i];
+        if ( item->ptr == nullptr || item->ptr == _KMEM_TOMBSTONE ) {
+            continue;
+        }
+
+        size_t slot = _kmem_hash(item->ptr, capacity);
+        while ( items[slot].ptr != nullptr ) {
+            slot = (slot + 1) & (capacity - 1);
+        }
+        items[slot] = *item;
+    }
+
+    free(shard->items);
+    shard->items = items;
+    shard->capacity = capacity;
+    shard->used = shard->count;
+
+    return true;
+}
+
+static kmem_allocation_t *_kmem_find(kmem_shard_t *shard, const void *ptr)
+{
+    if ( shard->capacity == 0 ) {
+        return nullptr;
+    }
+
+    size_t mask = shard->capacity - 1;
+    for ( size_t slot = _kmem_hash(ptr, shard->capacity); 
+          shard->items[slot].ptr != nullptr; slot = (slot + 1) & mask ) {
+        if ( shard->items[slot].ptr == ptr ) {
+            return &shard->items[slot];
+        }
+    }
+
+    return nullptr;
+}
+
+#if defined(KALLOC_SAMPLE_RATE)
+// Counting Bloom filter over the tracked pointers, a zero counter means 
+// the pointer definitely isn't tracked and kmem_free skips the lookup
+#define _KMEM_FILTER_SIZE (1 << 14)
+static volatile long _kmem_filter[_KMEM_FILTER_SIZE];
+
+static inline void _kmem_filter_slots(const void *ptr, size_t *a, size_t *b)
+{
+    uint64_t h = (uint64_t)(uintptr_t)ptr * 0x9e3779b97f4a7c15ULL;
+    *a = (size_t)(h >> 50);
+    *b = (size_t)(h >> 36) & (_KMEM_FILTER_SIZE - 1);
+}
 
+static inline void _kmem_filter_add(const void *ptr, long delta)
+{
+    size_t a, b;
+    _kmem_filter_slots(ptr, &a, &b);
+    (void)_KMEM_ADD(&_kmem_filter[a], delta);
+    (void)_KMEM_ADD(&_kmem_filter[b], delta);
+}
+
+static inline bool _kmem_filter_has(const void *ptr)
+{
+    size_t a, b;
+    _kmem_filter_slots(ptr, &a, &b);
+    return _KMEM_LOAD(&_kmem_filter[a]) != 0 && _KMEM_LOAD(&_kmem_filter[b]) != 0;
+}
+#endif // KALLOC_SAMPLE_RATE
+
+// Turn a record into a tombstone, the caller holds the shard's lock
+static void _kmem_drop(kmem_shard_t *shard, kmem_allocation_t *item)
+{
+    _kmem_account_free(shard, item);
+#if defined(KALLOC_SAMPLE_RATE)
+    _kmem_filter_add(item->ptr, -1);
+#endif // KALLOC_SAMPLE_RATE
+    item->ptr = _KMEM_TOMBSTONE;
+    item->file = "";
+    item->func = "";
+    item->line = 0;
+    shard->count--;
+}
+
+// Drop the record of ptr from the shard, false if it isn't there
+static bool _kmem_remove(kmem_shard_t *shard, const void *ptr)
+{
+    kmem_allocation_t *item = _kmem_find(shard, ptr);
+    if ( !item ) {
+        return false;
+    }
+
+    _kmem_drop(shard, item);
+    return true;
+}
+
+// A free slot for ptr, nullptr if the table can't grow. The caller holds 
+// the shard's lock and fills the slot in
+static inline kmem_allocation_t *_kmem_claim(kmem_shard_t *shard, const void *ptr)
+{
+    // keep the table at most 3/4 full (tombstones included)
+    if ( (shard->used + 1) * 4 > shard->capacity * 3 ) {
+        if ( !_kmem_rehash(shard) ) {
+            return nullptr;
+        }
+    }
+
+    // a live pointer can't be in the table twice, so the first free slot will do
+    size_t mask = shard->capacity - 1;
+    size_t slot = _kmem_hash(ptr, shard->capacity);
+    while ( shard->items[slot].ptr != nullptr && 
+            shard->items[slot].ptr != _KMEM_TOMBSTONE ) {
+        slot = (slot + 1) & mask;
+    }
+
+    if ( shard->items[slot].ptr == nullptr ) {
+        shard->used++;
+    }
+    shard->count++;
+
+    return &shard->items[slot];
+}
+
+// The record of ptr, looked up in the calling thread's shard first. It's 
+// returned with its shard locked, nullptr (and nothing locked) if untracked
+static kmem_allocation_t *_kmem_find_locked(const void *ptr, kmem_shard_t **owner)
+{
+    kmem_shard_t *local = _kmem_local();
+    if ( local ) {
+        _kmem_lock(local);
+        kmem_allocation_t *item = _kmem_find(local, ptr);
+        if ( item ) {
+            *owner = local;
+            return item;
+        }
+        _kmem_unlock(local);
+    }
+
+#if defined(_KMEM_THREADS_WIN32) || defined(_KMEM_THREADS_PTHREAD)
+    for ( kmem_shard_t *shard = _KMEM_LOAD(&_kmem_shards); shard; shard = shard->next ) {
+        if ( shard == local ) {
+            continue;
+        }
+        _kmem_lock(shard);
+        kmem_allocation_t *item = _kmem_find(shard, ptr);
+        if ( item ) {
+            *owner = shard;
+            return item;
+        }
+        _kmem_unlock(shard);
+    }
+#endif // _KMEM_THREADS_WIN32 || _KMEM_THREADS_PTHREAD
+
+    return nullptr;
+}
+
+#if defined(_KMEM_THREADS_WIN32) || defined(_KMEM_THREADS_PTHREAD)
+// Apply the queued cross-thread frees, one lock per shard. With wait set
+// (reports) this waits for a drain already in progress, otherwise that 
+// drain will pick up anything queued after it
+static void _kmem_drain(bool wait)
+{
+    while ( _KMEM_XCHG(&_kmem_draining, 1) ) {
+        if ( !wait ) {
+            return;
+        }
+        _KMEM_PAUSE();
+    }
+
+    kmem_remote_t *list = (kmem_remote_t*) _KMEM_XCHG_PTR((void* volatile*)&_kmem_remote, nullptr);
+    long count = 0;
+    for ( kmem_remote_t *r = list; r; r = r->next ) {
+        count++;
+    }
+    _KMEM_ADD(&_kmem_remote_count, -count);
+
+    if ( list ) {
+        for ( kmem_shard_t *shard = _KMEM_LOAD(&_kmem_shards); shard; shard = shard->next ) {
+            _kmem_lock(shard);
+            for ( kmem_remote_t *r = list; r; r = r->next ) {
+                if ( !r->found ) {
+                    r->found = _kmem_remove(shard, r->ptr);
+                }
+            }
+            _kmem_unlock(shard);
+        }
+    }
+
+    _KMEM_STORE(&_kmem_draining, 0);
+
+    // untracked pointers are freed all the same
+    while ( list ) {
+        kmem_remote_t *next = list->next;
+        free(list->ptr);
+        free(list);
+        list = next;
+    }
+}
+
+// ptr wasn't allocated by this thread, hand it to the remote queue
+static void _kmem_free_remote(void *ptr)
+{
+    kmem_remote_t *remote = (kmem_remote_t*) malloc(sizeof(kmem_remote_t));
+    if ( !remote ) {
+        // nowhere to queue it, look for it under each shard's lock instead
+        for ( kmem_shard_t *shard = _KMEM_LOAD(&_kmem_shards); shard; shard = shard->next ) {
+            _kmem_lock(shard);
+            bool found = _kmem_remove(shard, ptr);
+            _kmem_unlock(shard);
+            if ( found ) {
+                break;
+            }
+        }
+        free(ptr);
+        return;
+    }
+
+    remote->ptr = ptr;
+    remote->found = false;
+    do {
+        remote->next = _KMEM_LOAD(&_kmem_remote);
+    } while ( !_KMEM_CAS_PTR((void* volatile*)&_kmem_remote, remote->next, remote) );
+
+    if ( _KMEM_ADD(&_kmem_remote_count, 1) + 1 >= KALLOC_REMOTE_BATCH ) {
+        _kmem_drain(false);
+    }
+}
+#endif // _KMEM_THREADS_WIN32 || _KMEM_THREADS_PTHREAD
+#endif // KALLOC_HEADERS
+
+// Human readable size written into buffer, no allocation so reports can 
+// call it per entry
+inline char * _kmem_bytes(size_t size, char *buffer, size_t length)
+{
+    const char *sizes[] = { "B", "KB", "MB", "GB", "TB", "PB" };
+    double len = (double)size;
+    int order = 0;
+
+    while (len >= 1024 && order < (int)(sizeof(sizes) / sizeof(*sizes)) - 1) {
+        order++;
+        len /= 1024;
+    }
+
+    snprintf(buffer, length, "%.2f %s", len, sizes[order]);
+
+    return buffer;
+}
+#if defined(KALLOC_HEADERS)
+inline void *kmem_alloc(size_t size, const char *file, const char *func, size_t line)
+{
+    if ( size > SIZE_MAX - _KMEM_HEADER_SIZE ) {
+        return nullptr;
+    }
+
+    kmem_header_t *header = (kmem_header_t*) malloc(_KMEM_HEADER_SIZE + size);
+    if ( header ) {
+        header->base = header;
+        return _kmem_link(header, size, file, func, line);
+    }
+
+    return nullptr;
+}
+
+inline void *kmem_calloc(size_t num_items, size_t size, const char *file, const char *func, size_t line)
+{
+    if ( size && num_items > (SIZE_MAX - _KMEM_HEADER_SIZE) / size ) {
+        return nullptr;
+    }
+
+    kmem_header_t *header = (kmem_header_t*) calloc(1, _KMEM_HEADER_SIZE + num_items * size);
+    if ( header ) {
+        header->base = header;
+        return _kmem_link(header, num_items * size, file, func, line);
+    }
+    return nullptr;
+}
+
+inline void kmem_free(void *ptr)
+{
+    if ( ptr ) {
+        kmem_header_t *header = (kmem_header_t*)((char*)ptr - _KMEM_HEADER_SIZE);
+        if ( header->info.ptr != ptr ) {
+            free(ptr); // not a block from kmem_alloc
+            return;
+        }
+
+        kmem_shard_t *shard = header->shard;
+        if ( shard ) {
+#if defined(_KMEM_THREADS_WIN32) || defined(_KMEM_THREADS_PTHREAD)
+            // another thread's block, queue it on its shard
+            if ( shard != _kmem_shard ) {
+                do {
+                    header->remote = _KMEM_LOAD(&shard->remote);
+                } while ( !_KMEM_CAS_PTR((void* volatile*)&shard->remote, header->remote, header) );
+
+                // don't wait on an idle owner forever
+                if ( _KMEM_ADD(&shard->remote_count, 1) + 1 >= KALLOC_REMOTE_BATCH ) {
+                    _kmem_lock(shard);
+                    _kmem_drain_shard(shard);
+                    _kmem_unlock(shard);
+                }
+                return;
+            }
+#endif
+            _kmem_lock(shard);
+            _kmem_drain_shard(shard);
+            _kmem_unlink(shard, header);
+            _kmem_unlock(shard);
+        }
+
+        free(header->base);
+    }
+}
+
+inline void *kmem_realloc(void *ptr, size_t size, const char *file, const char *func, size_t line)
+{
+    if ( !ptr ) {
+        return kmem_alloc(size, file, func, line);
+    }
+    if ( size == 0 ) {
+        kmem_free(ptr);
+        return nullptr;
+    }
+
+    kmem_header_t *header = (kmem_header_t*)((char*)ptr - _KMEM_HEADER_SIZE);
+    if ( header->info.ptr != ptr ) {
+        return realloc(ptr, size); // not a block from kmem_alloc
+    }
+    if ( size > SIZE_MAX - _KMEM_HEADER_SIZE ) {
+        return nullptr;
+    }
+
+    // the header can't move off an aligned block's base, copy it instead 
+    // (as with realloc, the new block is only aligned like malloc's)
+    if ( header->base != header ) {
+        void *moved = kmem_alloc(size, file, func, line);
+        if ( moved ) {
+            memcpy(moved, ptr, header->info.size < size ? header->info.size : size);
+            kmem_free(ptr);
+        }
+        return moved;
+    }
+
+    kmem_shard_t *shard = header->shard;
+    if ( !shard ) {
+        // not sampled, the new size gets its chance like an allocation
+        kmem_header_t *moved = (kmem_header_t*) realloc(header, _KMEM_HEADER_SIZE + size);
+        if ( !moved ) {
+            return nullptr;
+        }
+        moved->base = moved;
+        return _kmem_link(moved, size, file, func, line);
+    }
+
+    // sampled again like an allocation, so a block doesn't get more chances 
+    // to be tracked the more it's resized
+    size_t weight = 0;
+    bool sampled = _kmem_sample(size, &weight);
+
+    // the record stays where it is in its shard's list, only the links 
+    // to it are fixed if the block moved
+    _kmem_lock(shard);
+    _kmem_drain_shard(shard);
+    kmem_header_t *moved = (kmem_header_t*) realloc(header, _KMEM_HEADER_SIZE + size);
+    if ( !moved ) {
+        _kmem_unlock(shard);
+        return nullptr;
+    }
+    if ( moved != header ) {
+        moved->base = moved;
+        if ( moved->prev ) {
+            moved->prev->next = moved;
+        } else {
+            shard->blocks = moved;
+        }
+        if ( moved->next ) {
+            moved->next->prev = moved;
+        }
+    }
+
+    if ( sampled ) {
+        _kmem_account_free(shard, &moved->info);
+    } else {
+        _kmem_unlink(shard, moved);
+        moved->prev = nullptr;
+        moved->next = nullptr;
+        moved->shard = nullptr;
+    }
+    moved->info.ptr = (char*)moved + _KMEM_HEADER_SIZE;
+    moved->info.size = size;
+    moved->info.file = file;
+    moved->info.func = func;
+    moved->info.line = line;
+    moved->info.weight = weight;
+    if ( sampled ) {
+#if defined(KALLOC_STACKS)
+        moved->info.stack = _kmem_capture();
+#endif // KALLOC_STACKS
+        _kmem_account_alloc(shard, &moved->info);
+    }
+    _kmem_unlock(shard);
+
+    return moved->info.ptr;
+}
+
+inline void *kmem_aligned_alloc(size_t alignment, size_t size, const char *file, const char *func, size_t line)
+{
+    if ( alignment == 0 || (alignment & (alignment - 1)) != 0 ) {
+        return nullptr;
+    }
+    if ( alignment <= 16 ) {
+        return kmem_alloc(size, file, func, line); // headers keep malloc's alignment
+    }
+    if ( size > SIZE_MAX - _KMEM_HEADER_SIZE - alignment ) {
+        return nullptr;
+    }
+
+    // the header goes right before the first aligned address past it
+    char *base = (char*) malloc(_KMEM_HEADER_SIZE + alignment + size);
+    if ( !base ) {
+        return nullptr;
+    }
+    uintptr_t ptr = ((uintptr_t)base + _KMEM_HEADER_SIZE + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    kmem_header_t *header = (kmem_header_t*)(ptr - _KMEM_HEADER_SIZE);
+    header->base = base;
+
+    return _kmem_link(header, size, file, func, line);
+}
+
+inline void kmem_aligned_free(void *ptr)
+{
+    kmem_free(ptr);
+}
+#else
+inline void _kmem_append(void* ptr, size_t size, size_t weight, const char * file, const char * func, size_t line)
+{
+    kmem_shard_t *shard = _kmem_local();
+    if ( !shard ) {
+        return; // out of memory, the allocation just isn't tracked
+    }
+#if defined(KALLOC_STACKS)
+    uint32_t stack = _kmem_capture();
+#endif // KALLOC_STACKS
+
+    _kmem_lock(shard);
+
+    kmem_allocation_t *item = _kmem_claim(shard, ptr);
+    if ( !item ) {
+        _kmem_unlock(shard);
+        return;
+    }
+
+    *item = (kmem_allocation_t) {
+        .ptr = ptr,
+        .size = size,
+        .file = file,
+        .line = line,
+        .func = func,
+        .weight = weight
+    };
+#if defined(KALLOC_STACKS)
+    item->stack = stack;
+#endif // KALLOC_STACKS
+    _kmem_account_alloc(shard, item);
+#if defined(KALLOC_SAMPLE_RATE)
+    _kmem_filter_add(ptr, 1);
+#endif // KALLOC_SAMPLE_RATE
+
+    _kmem_unlock(shard);
+}
+
+inline void *kmem_alloc(size_t size, const char *file, const char *func, size_t line)
+{
+    void *ptr = malloc(size);
+
+    if ( ptr ) {
+        size_t weight = 0;
+        if ( _kmem_sample(size, &weight) ) {
+            _kmem_append(ptr, size, weight, file, func, line);
+        }
+
+        return ptr;
+    }
+
+    return nullptr;
+}
+
+inline void *kmem_calloc(size_t num_items, size_t size, const char *file, const char *func, size_t line)
+{
+    void *ptr = calloc(num_items, size);
+
+    if ( ptr ) {
+        size_t weight = 0;
+        if ( _kmem_sample(num_items * size, &weight) ) {
+            _kmem_append(ptr, num_items * size, weight, file, func, line);
+        }
+        return ptr;
+    }
+    return nullptr;
+}
+
+inline void kmem_free(void *ptr)
+{
+    if ( ptr ) {
+#if defined(KALLOC_SAMPLE_RATE)
+        if ( !_kmem_filter_has(ptr) ) {
+            free(ptr); // never sampled
+            return;
+        }
+#endif // KALLOC_SAMPLE_RATE
+        kmem_shard_t *shard = _kmem_local();
+        if ( shard ) {
+            _kmem_lock(shard);
+            bool found = _kmem_remove(shard, ptr);
+            _kmem_unlock(shard);
+
+#if defined(_KMEM_THREADS_WIN32) || defined(_KMEM_THREADS_PTHREAD)
+            if ( !found ) {
+                _kmem_free_remote(ptr);
+                return;
+            }
+#else
+            (void)found;
+#endif
+        }
+
+        free(ptr);
+    }
+}
+
+inline void *kmem_realloc(void *ptr, size_t size, const char *file, const char *func, size_t line)
+{
+    if ( !ptr ) {
+        return kmem_alloc(size, file, func, line);
+    }
+    if ( size == 0 ) {
+        kmem_free(ptr);
+        return nullptr;
+    }
+#if defined(KALLOC_SAMPLE_RATE)
+    if ( !_kmem_filter_has(ptr) ) {
+        // not sampled, the new size gets its chance like an allocation
+        void *moved = realloc(ptr, size);
+        size_t weight = 0;
+        if ( moved && _kmem_sample(size, &weight) ) {
+            _kmem_append(moved, size, weight, file, func, line);
+        }
+        return moved;
+    }
+#endif // KALLOC_SAMPLE_RATE
+
+    kmem_shard_t *shard = nullptr;
+    kmem_allocation_t *item = _kmem_find_locked(ptr, &shard);
+    if ( !item ) {
+        return realloc(ptr, size);
+    }
+
+    // sampled again like an allocation, so a block doesn't get more chances 
+    // to be tracked the more it's resized
+    size_t weight = 0;
+    bool sampled = _kmem_sample(size, &weight);
+
+    // under the lock, so a report never sees the record of a freed block
+    void *moved = realloc(ptr, size);
+    if ( !moved ) {
+        _kmem_unlock(shard);
+        return nullptr;
+    }
+
+    if ( sampled && moved == item->ptr ) {
+        _kmem_account_free(shard, item);
+    } else {
+        _kmem_drop(shard, item);
+        if ( !sampled ) {
+            _kmem_unlock(shard);
+            return moved;
+        }
+
+        // rehashed under the new pointer, in the same shard
+        item = _kmem_claim(shard, moved);
+        if ( !item ) {
+            _kmem_unlock(shard);
+            return moved; // out of memory, the block just isn't tracked anymore
+        }
+#if defined(KALLOC_SAMPLE_RATE)
+        _kmem_filter_add(moved, 1);
+#endif // KALLOC_SAMPLE_RATE
+    }
+
+    *item = (kmem_allocation_t) {
+        .ptr = moved,
+        .size = size,
+        .file = file,
+        .line = line,
+        .func = func,
+        .weight = weight
+    };
+#if defined(KALLOC_STACKS)
+    item->stack = _kmem_capture();
+#endif // KALLOC_STACKS
+    _kmem_account_alloc(shard, item);
+    _kmem_unlock(shard);
+
+    return moved;
+}
+
+inline void *kmem_aligned_alloc(size_t alignment, size_t size, const char *file, const char *func, size_t line)
+{
+    if ( alignment == 0 || (alignment & (alignment - 1)) != 0 ) {
+        return nullptr;
+    }
+    if ( alignment < sizeof(void*) ) {
+        alignment = sizeof(void*);
+    }
+    if ( size > SIZE_MAX - alignment ) {
+        return nullptr;
+    }
+
+#if defined(_MSC_VER)
+    void *ptr = _aligned_malloc(size ? size : 1, alignment);
+#else
+    // C11 wants the size to be a multiple of the alignment
+    size_t rounded = (size + alignment - 1) & ~(alignment - 1);
+    void *ptr = aligned_alloc(alignment, rounded ? rounded : alignment);
+#endif
+
+    if ( ptr ) {
+        size_t weight = 0;
+        if ( _kmem_sample(size, &weight) ) {
+            _kmem_append(ptr, size, weight, file, func, line);
+        }
+        return ptr;
+    }
+    return nullptr;
+}
+
+inline void kmem_aligned_free(void *ptr)
+{
+#if defined(_MSC_VER)
+    // _aligned_malloc blocks can't go through free(), so no remote queue
+    if ( ptr ) {
+        bool tracked = true;
+#if defined(KALLOC_SAMPLE_RATE)
+        tracked = _kmem_filter_has(ptr);
+#endif // KALLOC_SAMPLE_RATE
+        kmem_shard_t *shard = nullptr;
+        if ( tracked && _kmem_find_locked(ptr, &shard) ) {
+            _kmem_remove(shard, ptr);
+            _kmem_unlock(shard);
+        }
+        _aligned_free(ptr);
+    }
+#else
+    kmem_free(ptr);
+#endif
+}
+#endif // KALLOC_HEADERS
+
+typedef struct {
+    const char *file;   // nullptr while the slot is free
+    const char *func;
+    size_t line;
+} kpool_site_t;
+
+typedef struct {
+    char *objects;      // objs_per_slab slots, followed by their sites
+    kpool_site_t *sites;
+} kpool_slab_t;
+
+struct kpool_t {
+    size_t obj_size;
+    size_t stride;          // obj_size rounded up, keeps every slot 16-byte aligned
+    size_t objs_per_slab;
+    void *free_list;        // linked through the free slots
+    kpool_slab_t *slabs;    // sorted by address for kpool_free
+    size_t slab_count;
+    size_t slab_capacity;
+    size_t count;           // live objects
+    volatile long lock;
+    struct kpool_t *prev;
+    struct kpool_t *next;
+};
+
+// every pool that hasn't been destroyed, for the leak reports
+static kpool_t *_kpool_pools = nullptr;
+static volatile long _kpool_lock = 0;
+
+inline kpool_t *kpool_create(size_t obj_size, size_t objs_per_slab)
+{
+    if ( obj_size == 0 || objs_per_slab == 0 ) {
+        return nullptr;
+    }
+
+    size_t stride = obj_size < sizeof(void*) ? sizeof(void*) : obj_size;
+    stride = (stride + 15) & ~(size_t)15;
+    if ( stride < obj_size || objs_per_slab > SIZE_MAX / (stride + sizeof(kpool_site_t)) ) {
+        return nullptr;
+    }
+
+    kpool_t *pool = (kpool_t*) calloc(1, sizeof(kpool_t));
+    if ( !pool ) {
+        return nullptr;
+    }
+    pool->obj_size = obj_size;
+    pool->stride = stride;
+    pool->objs_per_slab = objs_per_slab;
+
+    _kmem_spin_lock(&_kpool_lock);
+    pool->next = _kpool_pools;
+    if ( _kpool_pools ) {
+        _kpool_pools->prev = pool;
+    }
+    _kpool_pools = pool;
+    _kmem_spin_unlock(&_kpool_lock);
+
+    return pool;
+}
+
+// Add a slab and thread its slots onto the free list, the caller holds the 
+// pool's lock
+static bool _kpool_grow(kpool_t *pool)
+{
+    if ( pool->slab_count == pool->slab_capacity ) {
+        size_t capacity = pool->slab_capacity ? pool->slab_capacity * 2 : 8;
+        kpool_slab_t *slabs = (kpool_slab_t*) realloc(pool->slabs, capacity * sizeof(kpool_slab_t));
+        if ( !slabs ) {
+            return false;
+        }
+        pool->slabs = slabs;
+        pool->slab_capacity = capacity;
+    }
+
+    size_t bytes = pool->stride * pool->objs_per_slab;
+    char *objects = (char*) malloc(bytes + pool->objs_per_slab * sizeof(kpool_site_t));
+    if ( !objects ) {
+        return false;
+    }
+
+    kpool_slab_t slab = {
+        .objects = objects,
+        .sites = (kpool_site_t*)(objects + bytes)
+    };
+
+    // keep the slabs sorted, the slab count only grows so this is rare
+    size_t at = pool->slab_count;
+    while ( at > 0 && pool->slabs[at - 1].objects > objects ) {
+        at--;
+    }
+    memmove(&pool->slabs[at + 1], &pool->slabs[at], (pool->slab_count - at) * sizeof(kpool_slab_t));
+    pool->slabs[at] = slab;
+    pool->slab_count++;
+
+    // pushed back to front, so the slab is handed out in address order
+    for ( size_t i = pool->objs_per_slab; i-- > 0; ) {
+        void *slot = objects + i * pool->stride;
+        *(void**)slot = pool->free_list;
+        pool->free_list = slot;
+        slab.sites[i].file = nullptr;
+    }
+
+    return true;
+}
+
+// The slab holding ptr and the slot's index in it, nullptr if it isn't 
+// a slot of this pool
+static kpool_slab_t *_kpool_find(kpool_t *pool, const void *ptr, size_t *index)
+{
+    const char *p = (const char*)ptr;
+    size_t lo = 0;
+    size_t hi = pool->slab_count;
+
+    // last slab starting at or before ptr
+    while ( lo < hi ) {
+        size_t mid = lo + (hi - lo) / 2;
+        if ( pool->slabs[mid].objects <= p ) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if ( lo == 0 ) {
+        return nullptr;
+    }
+
+    kpool_slab_t *slab = &pool->slabs[lo - 1];
+    size_t offset = (size_t)(p - slab->objects);
+    if ( offset >= pool->stride * pool->objs_per_slab || offset % pool->stride != 0 ) {
+        return nullptr;
+    }
+
+    *index = offset / pool->stride;
+    return slab;
+}
+
+inline void *kpool_alloc(kpool_t *pool, const char *file, const char *func, size_t line)
+{
+    if ( !pool ) {
+        return nullptr;
+    }
+
+    _kmem_spin_lock(&pool->lock);
+    if ( !pool->free_list && !_kpool_grow(pool) ) {
+        _kmem_spin_unlock(&pool->lock);
+        return nullptr;
+    }
+
+    void *ptr = pool->free_list;
+    pool->free_list = *(void**)ptr;
+
+    size_t index = 0;
+    kpool_slab_t *slab = _kpool_find(pool, ptr, &index);
+    slab->sites[index] = (kpool_site_t) {
+        .file = file ? file : "",
+        .func = func ? func : "",
+        .line = line
+    };
+    pool->count++;
+    _kmem_spin_unlock(&pool->lock);
+
+    return ptr;
+}
+
+inline void kpool_free(kpool_t *pool, void *ptr)
+{
+    if ( !pool || !ptr ) {
+        return;
+    }
+
+    _kmem_spin_lock(&pool->lock);
+
+    // anything that isn't a live slot of this pool is ignored
+    size_t index = 0;
+    kpool_slab_t *slab = _kpool_find(pool, ptr, &index);
+    if ( slab && slab->sites[index].file ) {
+        slab->sites[index].file = nullptr;
+        *(void**)ptr = pool->free_list;
+        pool->free_list = ptr;
+        pool->count--;
+    }
+
+    _kmem_spin_unlock(&pool->lock);
+}
+
+inline void kpool_destroy(kpool_t *pool)
+{
+    if ( !pool ) {
+        return;
+    }
+
+    _kmem_spin_lock(&_kpool_lock);
+    if ( pool->prev ) {
+        pool->prev->next = pool->next;
+    } else {
+        _kpool_pools = pool->next;
+    }
+    if ( pool->next ) {
+        pool->next->prev = pool->prev;
+    }
+    _kmem_spin_unlock(&_kpool_lock);
+
+    for ( size_t i = 0; i < pool->slab_count; i++ ) {
+        free(pool->slabs[i].objects);
+    }
+    free(pool->slabs);
+    free(pool);
+}
+
+struct karena_block_t {
+    karena_block_t *next;   // older block
+    size_t size;            // usable bytes
+    size_t offset;          // bytes used
+};
+
+// keeps the block's data aligned like the one malloc returned
+#define _KARENA_BLOCK_SIZE ((sizeof(karena_block_t) + 15) & ~(size_t)15)
+#define _KARENA_DATA(b) ((char*)(b) + _KARENA_BLOCK_SIZE)
+
+// every arena that hasn't been freed, for the leak reports
+static karena_t *_karena_arenas = nullptr;
+static volatile long _karena_lock = 0;
+
+inline void karena_init(karena_t *arena, size_t block_size)
+{
+    *arena = (karena_t) {
+        .blocks = nullptr,
+        .spare = nullptr,
+        .block_size = block_size ? block_size : 64 * 1024,
+        .used = 0,
+        .peak = 0,
+        .reserved = 0,
+        .prev = nullptr,
+        .next = nullptr
+    };
+
+    _kmem_spin_lock(&_karena_lock);
+    arena->next = _karena_arenas;
+    if ( _karena_arenas ) {
+        _karena_arenas->prev = arena;
+    }
+    _karena_arenas = arena;
+    _kmem_spin_unlock(&_karena_lock);
+}
+
+// A block with room for size bytes at the given alignment, a spare one if 
+// it's big enough
+static karena_block_t *_karena_block(karena_t *arena, size_t size, size_t align)
+{
+    if ( size > SIZE_MAX - align - _KARENA_BLOCK_SIZE ) {
+        return nullptr;
+    }
+    size_t needed = size + align;
+
+    for ( karena_block_t **spare = &arena->spare; *spare; spare = &(*spare)->next ) {
+        if ( (*spare)->size >= needed ) {
+            karena_block_t *block = *spare;
+            *spare = block->next;
+            return block;
+        }
+    }
+
+    size_t bytes = needed > arena->block_size ? needed : arena->block_size;
+    karena_block_t *block = (karena_block_t*) malloc(_KARENA_BLOCK_SIZE + bytes);
+    if ( !block ) {
+        return nullptr;
+    }
+    block->size = bytes;
+    arena->reserved += bytes;
+
+    return block;
+}
+
+inline void *karena_alloc(karena_t *arena, size_t size, size_t align)
+{
+    if ( align == 0 ) {
+        align = 16;
+    }
+
+    karena_block_t *block = arena->blocks;
+    size_t start = 0;
+    if ( block ) {
+        uintptr_t data = (uintptr_t)_KARENA_DATA(block);
+        start = (size_t)(((data + block->offset + align - 1) & ~(uintptr_t)(align - 1)) - data);
+    }
+
+    if ( !block || start > block->size || size > block->size - start ) {
+        block = _karena_block(arena, size, align);
+        if ( !block ) {
+            return nullptr;
+        }
+        block->offset = 0;
+        block->next = arena->blocks;
+        arena->blocks = block;
+
+        uintptr_t data = (uintptr_t)_KARENA_DATA(block);
+        start = (size_t)(((data + align - 1) & ~(uintptr_t)(align - 1)) - data);
+    }
+
+    arena->used += start + size - block->offset;
+    if ( arena->used > arena->peak ) {
+        arena->peak = arena->used;
+    }
+    block->offset = start + size;
+
+    return _KARENA_DATA(block) + start;
+}
+
+inline karena_mark_t karena_mark(karena_t *arena)
+{
+    return (karena_mark_t) {
+        .block = arena->blocks,
+        .offset = arena->blocks ? arena->blocks->offset : 0,
+        .used = arena->used
+    };
+}
+
+inline void karena_reset(karena_t *arena, karena_mark_t mark)
+{
+    // blocks started after the mark are kept for reuse
+    while ( arena->blocks && arena->blocks != mark.block ) {
+        karena_block_t *block = arena->blocks;
+        arena->blocks = block->next;
+        block->next = arena->spare;
+        arena->spare = block;
+    }
+
+    if ( arena->blocks ) {
+        arena->blocks->offset = mark.offset;
+    }
+    arena->used = arena->blocks ? mark.used : 0;
+}
+
+inline void karena_free(karena_t *arena)
+{
+    _kmem_spin_lock(&_karena_lock);
+    if ( arena->prev ) {
+        arena->prev->next = arena->next;
+    } else if ( _karena_arenas == arena ) {
+        _karena_arenas = arena->next;
+    }
+    if ( arena->next ) {
+        arena->next->prev = arena->prev;
+    }
+    _kmem_spin_unlock(&_karena_lock);
+
+    karena_block_t *lists[] = { arena->blocks, arena->spare };
+    for ( size_t i = 0; i < sizeof(lists) / sizeof(*lists); i++ ) {
+        while ( lists[i] ) {
+            karena_block_t *next = lists[i]->next;
+            free(lists[i]);
+            lists[i] = next;
+        }
+    }
+
+    arena->blocks = nullptr;
+    arena->spare = nullptr;
+    arena->used = 0;
+    arena->reserved = 0;
+    arena->prev = nullptr;
+    arena->next = nullptr;
+}
+
+// Stored before every hook allocation so realloc knows the size and free 
+// knows whether the memory came from an arena
+typedef struct {
+    size_t size;
+    karena_t *arena;    // nullptr for the heap
+} karena_hook_t;
+
+#define _KARENA_HOOK_SIZE ((sizeof(karena_hook_t) + 15) & ~(size_t)15)
+// arena bytes a hook allocation of n takes, whole 16-byte units so the next 
+// one starts right at its end and freeing them in reverse hands all of them back
+#define _KARENA_HOOK_UNITS(n) (((n) + 15) & ~(size_t)15)
+
+static _KMEM_TLS karena_t *_karena_bound = nullptr;
+
+inline karena_t *karena_bind(karena_t *arena)
+{
+    karena_t *previous = _karena_bound;
+    _karena_bound = arena;
+    return previous;
+}
+
+static void *_karena_hook_alloc(karena_t *arena, size_t size)
+{
+    if ( size > SIZE_MAX - _KARENA_HOOK_SIZE - 15 ) {
+        return nullptr;
+    }
+
+    karena_hook_t *hook = arena ? (karena_hook_t*) karena_alloc(arena, _KARENA_HOOK_SIZE + _KARENA_HOOK_UNITS(size), 16)
+                                : (karena_hook_t*) malloc(_KARENA_HOOK_SIZE + size);
+    if ( !hook ) {
+        return nullptr;
+    }
+    hook->size = size;
+    hook->arena = arena;
+
+    return (char*)hook + _KARENA_HOOK_SIZE;
+}
+
+// is ptr the most recent allocation of its arena
+static bool _karena_hook_last(const karena_hook_t *hook)
+{
+    karena_block_t *block = hook->arena->blocks;
+    return block && (const char*)hook + _KARENA_HOOK_SIZE + _KARENA_HOOK_UNITS(hook->size) == 
+                    _KARENA_DATA(block) + block->offset;
+}
+
+inline void *karena_hook_alloc(size_t size)
+{
+    return _karena_hook_alloc(_karena_bound, size);
+}
+
+inline void *karena_hook_realloc(void *ptr, size_t size)
+{
+    if ( !ptr ) {
+        return karena_hook_alloc(size);
+    }
+
+    karena_hook_t *hook = (karena_hook_t*)((char*)ptr - _KARENA_HOOK_SIZE);
+    if ( !hook->arena ) {
+        if ( size > SIZE_MAX - _KARENA_HOOK_SIZE ) {
+            return nullptr;
+        }
+        hook = (karena_hook_t*) realloc(hook, _KARENA_HOOK_SIZE + size);
+        if ( !hook ) {
+            return nullptr;
+        }
+        hook->size = size;
+        return (char*)hook + _KARENA_HOOK_SIZE;
+    }
+
+    // the last allocation grows (or shrinks) in place
+    karena_block_t *block = hook->arena->blocks;
+    if ( _karena_hook_last(hook) && size <= SIZE_MAX - 15 && 
+         _KARENA_HOOK_UNITS(size) <= block->size - ((char*)ptr - _KARENA_DATA(block)) ) {
+        block->offset = (size_t)((char*)ptr - _KARENA_DATA(block)) + _KARENA_HOOK_UNITS(size);
+        hook->arena->used = hook->arena->used - _KARENA_HOOK_UNITS(hook->size) + _KARENA_HOOK_UNITS(size);
+        if ( hook->arena->used > hook->arena->peak ) {
+            hook->arena->peak = hook->arena->used;
+        }
+        hook->size = size;
+        return ptr;
+    }
+
+    if ( size <= hook->size ) {
+        return ptr;
+    }
+
+    void *moved = _karena_hook_alloc(hook->arena, size);
+    if ( moved ) {
+        memcpy(moved, ptr, hook->size);
+    }
+    return moved;
+}
+
+inline void karena_hook_free(void *ptr)
+{
+    if ( !ptr ) {
+        return;
+    }
+
+    karena_hook_t *hook = (karena_hook_t*)((char*)ptr - _KARENA_HOOK_SIZE);
+    if ( !hook->arena ) {
+        free(hook);
+        return;
+    }
+
+    // arena memory goes with the arena, the last allocation can be handed back
+    if ( _karena_hook_last(hook) ) {
+        karena_block_t *block = hook->arena->blocks;
+        size_t offset = (size_t)((char*)hook - _KARENA_DATA(block));
+        hook->arena->used -= block->offset - offset;
+        block->offset = offset;
+    }
+}
+
+// Calls fn for every shard, each one locked while fn runs
+static void _kmem_each_shard(void (*fn)(kmem_shard_t *, void *), void *ctx)
+{
+#if defined(_KMEM_THREADS_WIN32) || defined(_KMEM_THREADS_PTHREAD)
+#if !defined(KALLOC_HEADERS)
+    _kmem_drain(true);
+#endif // KALLOC_HEADERS
+    for ( kmem_shard_t *shard = _KMEM_LOAD(&_kmem_shards); shard; shard = shard->next ) {
+        _kmem_lock(shard);
+#if defined(KALLOC_HEADERS)
+        _kmem_drain_shard(shard);
+#endif // KALLOC_HEADERS
+        fn(shard, ctx);
+        _kmem_unlock(shard);
+    }
+#else
+    fn(&kmem_allocation_state, ctx);
+#endif
+}
+
+typedef struct {
+    size_t count;
+    size_t allocated;
+} kmem_leak_totals_t;
+
+static void _kmem_print_item(const kmem_allocation_t *item, kmem_leak_totals_t *totals)
+{
+    char b[_KMEM_BYTES_LEN];
+    _kmem_bytes(item->size, b, sizeof(b));
+#if defined(KALLOC_SAMPLE_RATE)
+    char w[_KMEM_BYTES_LEN];
+    _kmem_bytes(item->weight, w, sizeof(w));
+    printf("- %s (%s on line %zu): Leak at %p (size %s, ~%zu allocations / %s estimated))\n",
+        item->file,
+        item->func,
+        item->line,
+        item->ptr,
+        b,
+        _kmem_estimate(item),
+        w);
+#else
+    printf("- %s (%s on line %zu): Leak at %p (size %s))\n",
+        item->file,
+        item->func,
+        item->line,
+        item->ptr,
+        b);
+#endif // KALLOC_SAMPLE_RATE
+#if defined(KALLOC_STACKS)
+    if ( item->stack ) {
+        printf("    stack %u\n", item->stack);
+    }
+#endif // KALLOC_STACKS
+    totals->allocated += item->weight;
+    totals->count += _kmem_estimate(item);
+}
+
+#if defined(KALLOC_STACKS)
+typedef struct {
+    size_t *count;      // per stack id
+    size_t *bytes;
+    size_t size;
+} kmem_stack_totals_t;
+
+static void _kmem_stack_add(const kmem_allocation_t *item, kmem_stack_totals_t *totals)
+{
+    if ( item->stack < totals->size ) {
+        totals->count[item->stack] += _kmem_estimate(item);
+        totals->bytes[item->stack] += item->weight;
+    }
+}
+
+static void _kmem_collect_stacks(kmem_shard_t *shard, void *ctx)
+{
+#if defined(KALLOC_HEADERS)
+    for ( kmem_header_t *header = shard->blocks; header; header = header->next ) {
+        _kmem_stack_add(&header->info, (kmem_stack_totals_t*)ctx);
+    }
+#else
+    for ( size_t i = 0; i < shard->capacity; i++ ) {
+        kmem_allocation_t *item = &shard->items[i];
+        if ( item->ptr != nullptr && item->ptr != _KMEM_TOMBSTONE ) {
+            _kmem_stack_add(item, (kmem_stack_totals_t*)ctx);
+        }
+    }
+#endif // KALLOC_HEADERS
+}
+
+static kmem_stack_totals_t *_kmem_sort_totals = nullptr;
+
+// most bytes first
+static int _kmem_stack_cmp(const void *a, const void *b)
+{
+    size_t x = _kmem_sort_totals->bytes[*(const uint32_t*)a];
+    size_t y = _kmem_sort_totals->bytes[*(const uint32_t*)b];
+    return x < y ? 1 : (x > y ? -1 : 0);
+}
+
+static void _kmem_print_stacks()
+{
+    long next = _KMEM_LOAD(&_kmem_stack_next);
+    kmem_stack_totals_t totals = {
+        .count = (size_t*) calloc((size_t)next, sizeof(size_t)),
+        .bytes = (size_t*) calloc((size_t)next, sizeof(size_t)),
+        .size = next > KALLOC_STACK_TABLE ? KALLOC_STACK_TABLE : (size_t)next
+    };
+    uint32_t *ids = (uint32_t*) malloc((size_t)next * sizeof(uint32_t));
+    if ( !totals.count || !totals.bytes || !ids ) {
+        free(totals.count);
+        free(totals.bytes);
+        free(ids);
+        return;
+    }
+
+    _kmem_each_shard(_kmem_collect_stacks, &totals);
+
+    size_t count = 0;
+    for ( size_t i = 0; i < totals.size; i++ ) {
+        if ( totals.count[i] ) {
+            ids[count++] = (uint32_t)i;
+        }
+    }
+
+    // the report isn't reentrant anyway, qsort just has no context argument
+    _kmem_sort_totals = &totals;
+    qsort(ids, count, sizeof(uint32_t), _kmem_stack_cmp);
+    _kmem_sort_totals = nullptr;
+
+    if ( count ) {
+        printf("\nLeaks by stack:\n");
+    }
+    kmem_stack_t *stacks = (kmem_stack_t*) _KMEM_LOAD(&_kmem_stacks);
+    for ( size_t i = 0; i < count; i++ ) {
+        uint32_t id = ids[i];
+        char b[_KMEM_BYTES_LEN];
+        _kmem_bytes(totals.bytes[id], b, sizeof(b));
+        printf("- stack %u: %zu not freed (%s)\n", id, totals.count[id], b);
+
+        if ( id == 0 || !stacks ) {
+            printf("    (unknown)\n");
+            continue;
+        }
+
+        kmem_stack_t *stack = &stacks[id];
+#if defined(_KMEM_SYMBOLS)
+        char **symbols = backtrace_symbols(stack->frames, (int)stack->depth);
+#endif
+        for ( uint32_t f = 0; f < stack->depth; f++ ) {
+#if defined(_KMEM_SYMBOLS)
+            if ( symbols ) {
+                printf("    #%u %s\n", f, symbols[f]);
+                continue;
+            }
+#endif
+            printf("    #%u %p\n", f, stack->frames[f]);
+        }
+#if defined(_KMEM_SYMBOLS)
+        free(symbols);
+#endif
+    }
+
+    free(totals.count);
+    free(totals.bytes);
+    free(ids);
+}
+#endif // KALLOC_STACKS
+
+static void _kmem_print_shard(kmem_shard_t *shard, void *ctx)
+{
+#if defined(KALLOC_HEADERS)
+    for ( kmem_header_t *header = shard->blocks; header; header = header->next ) {
+        _kmem_print_item(&header->info, (kmem_leak_totals_t*)ctx);
+    }
+#else
+    for ( size_t i = 0; i < shard->capacity; i++ ) {
+        kmem_allocation_t *item = &shard->items[i];
+        if ( item->ptr != nullptr && item->ptr != _KMEM_TOMBSTONE ) {
+            _kmem_print_item(item, (kmem_leak_totals_t*)ctx);
+        }
+    }
+#endif // KALLOC_HEADERS
+}
+
+static void _kmem_count_shard(kmem_shard_t *shard, void *ctx)
+{
+    ((kmem_leak_totals_t*)ctx)->count += shard->count;
+}
+
+// Sites of every shard merged into one table (a shard that isn't linked 
+// anywhere), a site used by several threads shows up once
+static void _kmem_merge_sites(kmem_shard_t *shard, void *ctx)
+{
+    kmem_shard_t *merged = (kmem_shard_t*)ctx;
+
+    for ( size_t i = 0; i < shard->site_capacity; i++ ) {
+        kmem_site_t *from = &shard->sites[i];
+        if ( !from->file ) {
+            continue;
+        }
+
+        kmem_site_t *site = _kmem_site(merged, from->file, from->func, from->line, true);
+        if ( site ) {
+            site->count += from->count;
+            site->bytes += from->bytes;
+            site->live_count += from->live_count;
+            site->live_bytes += from->live_bytes;
+        }
+    }
+}
+
+static void _kmem_sum_stats(kmem_shard_t *shard, void *ctx)
+{
+    kmem_stats_t *stats = (kmem_stats_t*)ctx;
+
+    stats->live_bytes += shard->live_bytes;
+    stats->live_count += shard->live_count;
+    stats->total_bytes += shard->total_bytes;
+    stats->total_count += shard->total_count;
+    for ( size_t i = 0; i < KMEM_SIZE_CLASSES; i++ ) {
+        stats->size_classes[i] += shard->size_classes[i];
+    }
+}
+
+inline void kmem_get_stats(kmem_stats_t *stats)
+{
+    memset(stats, 0, sizeof(kmem_stats_t));
+    _kmem_each_shard(_kmem_sum_stats, stats);
+
+    kmem_shard_t merged = { .count = 0 };
+    _kmem_each_shard(_kmem_merge_sites, &merged);
+    stats->site_count = merged.site_count;
+    free(merged.sites);
+
+    int64_t peak = _KMEM_LOAD64(&_kmem_peak_bytes);
+    stats->peak_bytes = (size_t)peak > stats->live_bytes ? (size_t)peak : stats->live_bytes;
+}
+
+inline void kmem_reset_peak()
+{
+    int64_t live = _KMEM_LOAD64(&_kmem_live_bytes);
+    int64_t peak = _KMEM_LOAD64(&_kmem_peak_bytes);
+    while ( !_KMEM_CAS64(&_kmem_peak_bytes, peak, live) ) {
+        peak = _KMEM_LOAD64(&_kmem_peak_bytes);
+    }
+}
+
+// most allocations first
+static int _kmem_site_cmp(const void *a, const void *b)
+{
+    const kmem_site_t *x = (const kmem_site_t*)a;
+    const kmem_site_t *y = (const kmem_site_t*)b;
+
+    if ( x->count != y->count ) {
+        return x->count < y->count ? 1 : -1;
+    }
+    return x->bytes < y->bytes ? 1 : (x->bytes > y->bytes ? -1 : 0);
+}
+
+static void _kmem_print_sites()
+{
+    kmem_shard_t merged = { .count = 0 };
+    _kmem_each_shard(_kmem_merge_sites, &merged);
+
+    size_t count = 0;
+    for ( size_t i = 0; i < merged.site_capacity; i++ ) {
+        if ( merged.sites[i].file ) {
+            merged.sites[count++] = merged.sites[i];
+        }
+    }
+    if ( count == 0 ) {
+        free(merged.sites);
+        return;
+    }
+    qsort(merged.sites, count, sizeof(kmem_site_t), _kmem_site_cmp);
+
+    printf("\nAllocations by call site:\n");
+    for ( size_t i = 0; i < count; i++ ) {
+        kmem_site_t *site = &merged.sites[i];
+        char bytes[_KMEM_BYTES_LEN];
+        _kmem_bytes(site->bytes, bytes, sizeof(bytes));
+        char live[_KMEM_BYTES_LEN];
+        _kmem_bytes(site->live_bytes, live, sizeof(live));
+        printf("- %s (%s on line %zu): %zu allocations (%s), %zu not freed (%s)\n",
+            site->file,
+            site->func,
+            site->line,
+            site->count,
+            bytes,
+            site->live_count,
+            live);
+    }
+    free(merged.sites);
+}
+
+// Calls fn for every pool, each one locked while fn runs
+static void _kpool_each(void (*fn)(kpool_t *, void *), void *ctx)
+{
+    _kmem_spin_lock(&_kpool_lock);
+    for ( kpool_t *pool = _kpool_pools; pool; pool = pool->next ) {
+        _kmem_spin_lock(&pool->lock);
+        fn(pool, ctx);
+        _kmem_spin_unlock(&pool->lock);
+    }
+    _kmem_spin_unlock(&_kpool_lock);
+}
+
+static void _kpool_print(kpool_t *pool, void *ctx)
+{
+    if ( pool->count == 0 ) {
+        return;
+    }
+
+    char b[_KMEM_BYTES_LEN];
+    _kmem_bytes(pool->obj_size, b, sizeof(b));
+    printf("Pool %p (%s objects, %zu live):\n", (void*)pool, b, pool->count);
+
+    for ( size_t s = 0; s < pool->slab_count; s++ ) {
+        kpool_slab_t *slab = &pool->slabs[s];
+        for ( size_t i = 0; i < pool->objs_per_slab; i++ ) {
+            if ( slab->sites[i].file ) {
+                kmem_allocation_t item = {
+                    .ptr = slab->objects + i * pool->stride,
+                    .size = pool->obj_size,
+                    .file = slab->sites[i].file,
+                    .func = slab->sites[i].func,
+                    .line = slab->sites[i].line,
+                    .weight = pool->obj_size
+                };
+                _kmem_print_item(&item, (kmem_leak_totals_t*)ctx);
+            }
+        }
+    }
+}
+
+static void _kpool_count(kpool_t *pool, void *ctx)
+{
+    ((kmem_leak_totals_t*)ctx)->count += pool->count;
+}
+
+// Arenas are reported as a whole, an arena that hasn't been freed still 
+// holds its blocks
+static void _karena_report(bool print, kmem_leak_totals_t *totals)
+{
+    _kmem_spin_lock(&_karena_lock);
+    for ( karena_t *arena = _karena_arenas; arena; arena = arena->next ) {
+        if ( arena->reserved == 0 ) {
+            continue;
+        }
+
+        if ( print ) {
+            char used[_KMEM_BYTES_LEN];
+            _kmem_bytes(arena->used, used, sizeof(used));
+            char peak[_KMEM_BYTES_LEN];
+            _kmem_bytes(arena->peak, peak, sizeof(peak));
+            char reserved[_KMEM_BYTES_LEN];
+            _kmem_bytes(arena->reserved, reserved, sizeof(reserved));
+            printf("- Arena %p: %s in use (peak %s, %s reserved)\n", (void*)arena, used, peak, reserved);
+        }
+        totals->allocated += arena->reserved;
+        totals->count++;
+    }
+    _kmem_spin_unlock(&_karena_lock);
+}
+
+typedef struct {
+    FILE *out;
+    kmem_dump_format_t format;
+    size_t count;
+    size_t bytes;
+    size_t total_count;
+    size_t total_bytes;
+} kmem_dump_t;
+
+#if defined(KALLOC_STACKS)
+static void _kmem_dump_item(const kmem_allocation_t *item, kmem_dump_t *dump)
+{
+    kmem_stack_t *stacks = (kmem_stack_t*) _KMEM_LOAD(&_kmem_stacks);
+    kmem_stack_t *stack = item->stack && stacks ? &stacks[item->stack] : nullptr;
+    uint32_t depth = stack ? stack->depth : 0;
+
+    if ( dump->format == KMEM_DUMP_PPROF ) {
+        size_t count = _kmem_estimate(item);
+        fprintf(dump->out, "%zu: %zu [%zu: %zu] @", count, item->weight, count, item->weight);
+        for ( uint32_t f = 0; f < depth; f++ ) {
+            fprintf(dump->out, " %p", stack->frames[f]);
+        }
+        fprintf(dump->out, "\n");
+        return;
+    }
+
+    // collapsed stacks go root first, the call site is the leaf
+    for ( uint32_t f = depth; f-- > 0; ) {
+        fprintf(dump->out, "%p;", stack->frames[f]);
+    }
+    fprintf(dump->out, "%s (%s:%zu) %zu\n", item->func, item->file, item->line, item->weight);
+}
+#endif // KALLOC_STACKS
+
+static void _kmem_dump_shard(kmem_shard_t *shard, void *ctx)
+{
+    kmem_dump_t *dump = (kmem_dump_t*)ctx;
+
+#if !defined(KALLOC_STACKS)
+    // without stacks the site totals say the same in fewer lines
+    for ( size_t i = 0; i < shard->site_capacity; i++ ) {
+        kmem_site_t *site = &shard->sites[i];
+        if ( site->file && site->live_count ) {
+            fprintf(dump->out, "%s (%s:%zu) %zu\n", site->func, site->file, site->line, site->live_bytes);
+        }
+    }
+#elif defined(KALLOC_HEADERS)
+    for ( kmem_header_t *header = shard->blocks; header; header = header->next ) {
+        _kmem_dump_item(&header->info, dump);
+    }
+#else
+    for ( size_t i = 0; i < shard->capacity; i++ ) {
+        kmem_allocation_t *item = &shard->items[i];
+        if ( item->ptr != nullptr && item->ptr != _KMEM_TOMBSTONE ) {
+            _kmem_dump_item(item, dump);
+        }
+    }
+#endif // KALLOC_STACKS
+}
+
+static void _kmem_dump_totals(kmem_shard_t *shard, void *ctx)
+{
+    kmem_dump_t *dump = (kmem_dump_t*)ctx;
+
+    dump->count += shard->live_count;
+    dump->bytes += shard->live_bytes;
+    dump->total_count += shard->total_count;
+    dump->total_bytes += shard->total_bytes;
+}
+
+// pool objects and arenas, under their own roots
+static void _kpool_dump(kpool_t *pool, void *ctx)
+{
+    kmem_dump_t *dump = (kmem_dump_t*)ctx;
+
+    for ( size_t s = 0; s < pool->slab_count; s++ ) {
+        kpool_slab_t *slab = &pool->slabs[s];
+        for ( size_t i = 0; i < pool->objs_per_slab; i++ ) {
+            if ( slab->sites[i].file ) {
+                fprintf(dump->out, "kpool %p;%s (%s:%zu) %zu\n", (void*)pool, 
+                    slab->sites[i].func, slab->sites[i].file, slab->sites[i].line, pool->obj_size);
+            }
+        }
+    }
+}
+
+inline bool kmem_dump(FILE *out, kmem_dump_format_t format)
+{
+#if !defined(KALLOC_STACKS)
+    if ( format == KMEM_DUMP_PPROF ) {
+        return false; // pprof needs addresses to attribute anything
+    }
+#endif // KALLOC_STACKS
+
+    kmem_dump_t dump = {
+        .out = out,
+        .format = format
+    };
+
+    if ( format == KMEM_DUMP_PPROF ) {
+        // the values are already scaled when sampling, so no heap_v2 rate
+        _kmem_each_shard(_kmem_dump_totals, &dump);
+        fprintf(out, "heap profile: %zu: %zu [%zu: %zu] @ heapprofile\n",
+            dump.count, dump.bytes, dump.total_count, dump.total_bytes);
+    }
+
+    _kmem_each_shard(_kmem_dump_shard, &dump);
+
+    if ( format == KMEM_DUMP_COLLAPSED ) {
+        _kpool_each(_kpool_dump, &dump);
+
+        _kmem_spin_lock(&_karena_lock);
+        for ( karena_t *arena = _karena_arenas; arena; arena = arena->next ) {
+            if ( arena->used ) {
+                fprintf(out, "karena %p %zu\n", (void*)arena, arena->used);
+            }
+        }
+        _kmem_spin_unlock(&_karena_lock);
+    }
+
+#if defined(__linux__)
+    // lets pprof symbolize the addresses
+    if ( format == KMEM_DUMP_PPROF ) {
+        fprintf(out, "\nMAPPED_LIBRARIES:\n");
+        // not through stdio, fopen would allocate the FILE and its buffer
+        int maps = open("/proc/self/maps", O_RDONLY);
+        if ( maps >= 0 ) {
+            char line[512];
+            ssize_t n = 0;
+            while ( (n = read(maps, line, sizeof(line))) > 0 ) {
+                fwrite(line, 1, (size_t)n, out);
+            }
+            close(maps);
+        }
+    }
+#endif // __linux__
+
+    return fflush(out) == 0 && !ferror(out);
+}
+
+inline void kmem_print_leaks()
+{
+    kmem_leak_totals_t totals = { 0, 0 };
+    printf("\nMemory Leaks:\n");
+#if defined(KALLOC_SAMPLE_RATE)
+    printf("(sampled about every %zu bytes, totals are estimates)\n", (size_t)KALLOC_SAMPLE_RATE);
+#endif // KALLOC_SAMPLE_RATE
+
+    _kmem_each_shard(_kmem_print_shard, &totals);
+    _kpool_each(_kpool_print, &totals);
+    _karena_report(true, &totals);
+    _kmem_print_sites();
+#if defined(KALLOC_STACKS)
+    _kmem_print_stacks();
+#endif // KALLOC_STACKS
+
+    printf("\n--------------------------------------------------\n");
+    printf("Total allocations not freed: %zu\n", totals.count);
+    char b[_KMEM_BYTES_LEN];
+    _kmem_bytes(totals.allocated, b, sizeof(b));
+    printf("Total memory not freed: %s\n", b);
+    printf("--------------------------------------------------\n");
+}
+
+inline bool kmem_leaks()
+{
+    kmem_leak_totals_t totals = { 0, 0 };
+    _kmem_each_shard(_kmem_count_shard, &totals);
+    _kpool_each(_kpool_count, &totals);
+    _karena_report(false, &totals);
+
+    if ( totals.count > 0 ) {
+        return true;
+    }
+
+    return false;
+}
+
+#endif
@@ -22,14 +22,15 @@ Objectives:
 --------------------------------------------------------------------------------
 
 
-[-] we need to identify file scopes
-    Lexer_DefineScript(const char *identifier);
-    Lexer_DefineScope(Lexer_Script *script, const char *scope);
-[-] we want to define some abritrary grammar that a script(s) should obey
-    Lexer_ExpectMatch(p_open_brace, p_close_brace, "Found open bracket with no closing bracket");
-[-] we want to define what crap is (comments) so ignore
-    Lexer_DefineIgnore(p_singleline_comment, P_Newline);
-    Lexer_DefineIgnore(p_multiline_comment_open, p_multiline_comment_close);
+[+] we need to identify file scopes
+    lexer_parse_scripts(scripts, count, punctuation, symbols, options, nthreads);
+    lexer_parse_scope(script->lexer, "scope");
+[+] we want to define some abritrary grammar that a script(s) should obey
+    lexer_declare_rule(lexer, open_brace, close_brace, "Found open bracket with no closing bracket");
+[+] we want to define what crap is (comments) so ignore
+    punc_ignore(punctuation, p_singleline_comment, "\n");
+    punc_ignore(punctuation, p_multiline_comment_open, "*" "/");
+    the scanner skips straight to the close, the comment is never tokenized
 [-] we need to define atomics
     Lexer_DefineAtomic(?)
     Lexer_DefineVariable(?)
@@ -42,6 +43,10 @@ Objectives:
 
 [+] we need to define error/stack tracing
     Lexer_SetTracer(void (*cb)(const char *msg, const char *file, maxint_t line, maxint_t offset));
+[+] we need to classify tokens (digits, alphanumerics, strings, punctuation)
+    lexer_init runs every token through a table-driven DFA in one pass
+[+] we need to identify variables without comparing strings
+    identifiers are interned into 32-bit symbols while lexing
 */
 
 #ifndef _KLEXER_H_
@@ -58,21 +63,66 @@ extern "C" {
 #define LEXER_UNKNOWN           (1<<0) // Simply, unknown
 #define LEXER_DIGIT             (1<<1) // A number based representation
 #define LEXER_ALPHANUMERIC      (1<<2) // An alphanumerical representation
+#define LEXER_STRING            (1<<3) // A quoted slice (quotes included)
+#define LEXER_PUNCTUATION       (1<<4) // One of the punc_list_t entries
 
+// A classified token, a view (offset, len) into the lexer's buffer
 typedef struct {
-    char            *name;
-    token_list_t    *variables;    
+    int32_t          id;     // punc_t id, -1 if not punctuation
+    uint32_t         kind;   // LEXER_* class
+    uint32_t         offset;
+    uint32_t         len;
+    uint32_t         line;
+    uint32_t         symbol; // interned LEXER_ALPHANUMERIC text, 0 otherwise
+} lexeme_t;
+
+typedef struct {
+    lexeme_t        *items;
+    intmax_t         capacity;
+    intmax_t         count;
+} lexeme_list_t;
+
+typedef struct {
+    uint32_t         hash;
+    uint32_t         len;
+    intmax_t         offset; // in the symtab_t pool
+} symbol_t;
+
+// Interned strings, equal text always gets the same 32-bit id (0 is never 
+// a symbol)
+typedef struct {
+    symbol_t        *items;     // by id, items[0] is unused
+    intmax_t         capacity;
+    intmax_t         count;
+    uint32_t        *slots;     // open addressing on the hash, 0 if empty
+    intmax_t         slot_capacity;
+    char            *pool;      // the text of every symbol, NUL-terminated
+    intmax_t         pool_size;
+    intmax_t         pool_capacity;
+} symtab_t;
+
+// The variables of a scope, a hash set of symbols with the index of the 
+// lexeme each one first appears at
+typedef struct {
+    uint32_t         name;       // symbol, 0 for the global scope
+    int32_t          start;      // lexeme opening the scope, -1 for the global scope
+    uint32_t        *variables;  // open addressing, 0 if empty
+    int32_t         *first;      // lexeme of each slot in variables
+    intmax_t         capacity;
+    intmax_t         count;
 } scope_t;
 
 typedef struct {
-    scope_t         *items;
+    scope_t        **items;
     intmax_t         capacity;
     intmax_t         count;
 } scopt_list_t;
 
+// matched by punctuation id, see lexer_declare_rule
 typedef struct {
     token_t          start_match;
     token_t          end_match;
+    const char      *error;
 } rule_t;
 
 typedef struct {
@@ -81,27 +131,101 @@ typedef struct {
     intmax_t         count;
 } rule_list_t;
 
-typedef struct {
-    char            *filename;
-    scopt_list_t     scopes;
-} script_t;
-
 typedef void (*tracer_t)(const char *msg, const char *file, const char *scope, intmax_t line, intmax_t offset);
 typedef struct {
     tracer_t         tracer;
+    const char      *filename;        // of the script, passed to the tracer
     scope_t          global_scope;
-    parser_t        *parser;
+    parser_t        *parser;          // nullptr if the lexer came from lexer_load
+    const char      *buffer;          // the source the lexemes are views of
+    const punc_list_t *punctuation;
+    int              options;
+    lexeme_list_t    lexemes;
+    uint8_t          byte_class[256]; // DFA input class of every byte
+    rule_list_t      rules;
+    int32_t         *jumps;           // matching lexeme of every lexeme (-1 if none), built on demand
+    symtab_t        *symbols;
+    int              shared_symbols;  // symbols belongs to lexer_parse_scripts' caller
+    scopt_list_t     scopes;          // parsed by lexer_parse_scope
+    void            *cache;           // lexer_load file the arrays point into
+    intmax_t         cache_size;
 } lexer_t;
 
-lexer_t *lexer_init(const char *buffer);
+// A source file, its scopes are parsed with lexer_parse_scope(script->lexer, ...)
+typedef struct {
+    const char      *filename;
+    const char      *buffer;   // NUL-terminated source, or nullptr to read filename
+    lexer_t         *lexer;    // set by lexer_parse_script, nullptr if it failed
+} script_t;
+
+//
+// Symbols
+//
+symtab_t *symtab_init();
+void     symtab_destroy(symtab_t *symtab);
+// the id of the text, added if it isn't there yet (0 if out of memory)
+uint32_t symtab_intern(symtab_t *symtab, const char *text, intmax_t len);
+// the id of the text, 0 if it was never interned
+uint32_t symtab_find(const symtab_t *symtab, const char *text, intmax_t len);
+// NUL-terminated text of the symbol, nullptr if there's no such id
+const char *symtab_name(const symtab_t *symtab, uint32_t id);
+
+// the lexeme a symbol first appears at in the scope, -1 if it doesn't
+intmax_t scope_find(const scope_t *scope, uint32_t symbol);
+
+
+// Tokenize the buffer (streaming, P_STREAMING is implied) and classify every 
+// token into lexer->lexemes. The buffer must outlive the lexer and be 
+// smaller than 4GB
+lexer_t *lexer_init(const char *buffer, const punc_list_t *punctuation, int options);
 void     lexer_destroy(lexer_t *lexer);
+// pointer to the lexeme in the buffer (not NUL-terminated)
+const char *lexer_lexeme_text(const lexer_t *lexer, const lexeme_t *lexeme);
 // Necessary to output any parsing/lexing errors
 void     lexer_set_tracer(lexer_t *lexer, tracer_t tracer);
-void     lexer_declare_rule(token_t start, token_t end, const char *error);
+// start and end (compared by id, so punctuation) must pair up, error is 
+// traced for every one left unmatched
+void     lexer_declare_rule(lexer_t *lexer, token_t start, token_t end, const char *error);
+// the lexeme matching the one at index by the declared rules, its end for 
+// a start and the other way around, -1 if there's none. Skipping a whole 
+// block is lexer_match(lexer, start) + 1
+intmax_t lexer_match(lexer_t *lexer, intmax_t index);
+
+
+// symbol of the text in the lexer's table, 0 if it never appeared
+uint32_t lexer_symbol(const lexer_t *lexer, const char *text);
 
+// Token cache, a position-independent file of the lexemes, symbols and the
+// scopes parsed so far (not the rules, declare them again). It's keyed by 
+// the source, punctuation and options, lexer_load fails if any differ
+uint64_t lexer_hash(const char *buffer, intmax_t size);
+uint64_t lexer_punctuation_hash(const punc_list_t *punctuation);
+// 0 if the file couldn't be written
+int      lexer_save(const lexer_t *lexer, const char *path);
+// Map a lexer_save file back, the lexemes, symbols and scopes are used in
+// place (the symbols are the table it was saved with). The buffer must be 
+// the source it was saved from and outlive the lexer. nullptr if the file
+// is missing, of another version, stale or corrupt. The file is mmapped on unix-likes,
+// define _KLEXER_NO_MMAP to read it into memory instead
+lexer_t *lexer_load(const char *path, const char *buffer, const punc_list_t *punctuation, int options);
 
-// Mainly used internally when parsing
-void     lexer_parse_script(const char *identifier);
+// Lex a script (its buffer, or the file if there's none) into script->lexer
+// with its own symbol table. 0 on failure
+int      lexer_parse_script(script_t *script, const punc_list_t *punctuation, int options);
+// Lex the scripts on up to nthreads threads, an idle thread takes the next 
+// script that isn't claimed yet. The punctuation and symbols are shared: 
+// symbols is only read while lexing, the new identifiers of each script are
+// merged into it afterwards in script order (ids don't depend on nthreads).
+// The lexers then keep using symbols, it must outlive them. Threads are 
+// pthreads (link with -pthread) or win32 threads, define _KLEXER_NO_THREADS
+// to lex on the calling thread. Returns the number of scripts lexed, the
+// ones that failed (unreadable, out of memory) are left with a nullptr lexer
+intmax_t lexer_parse_scripts(script_t *scripts, intmax_t count, const punc_list_t *punctuation, 
+                             symtab_t *symbols, int options, int nthreads);
+// The scope opened by the first declared rule start right after the
+// identifier scope (e.g. "name { ... }"), or the global scope (everything
+// outside of rules) if scope is nullptr. Variables are the identifiers 
+// directly inside it, nested blocks are skipped. nullptr if not found
 scope_t *lexer_parse_scope(lexer_t *lexer, const char *scope);
 
 #ifdef __cplusplus
@@ -113,37 +237,1320 @@ scope_t *lexer_parse_scope(lexer_t *lexer, const char *scope);
 
 #ifdef _KLEXER_IMPLEMENTATION
 
-lexer_t *lexer_init(const char *buffer)
+#include <stdio.h>
+// lexer_load maps the cache file, like kparser's parser_init_file
+#if !defined(_KLEXER_NO_MMAP) && !defined(_KPARSER_NO_MMAP) && (defined(__unix__) || defined(__APPLE__))
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+    #define _L_MMAP
+#endif // _KLEXER_NO_MMAP
+
+// lexer_parse_scripts threads, the same switch as kparser's
+#if !defined(_KLEXER_NO_THREADS) && !defined(_KPARSER_NO_THREADS)
+    #if defined(_WIN32)
+        #include <windows.h>
+        #define _L_THREADS_WIN32
+    #elif defined(__unix__) || defined(__APPLE__)
+        #include <pthread.h>
+        #define _L_THREADS_PTHREAD
+    #endif
+#endif // _KLEXER_NO_THREADS
+
+// DFA input classes, see _lexer_init_classes
+enum {
+    _L_C_OTHER,
+    _L_C_ZERO,      // 0
+    _L_C_DIGIT,     // 1-9
+    _L_C_HEX,       // a-f A-F but e/E
+    _L_C_E,         // e E
+    _L_C_X,         // x X
+    _L_C_ALPHA,     // any other letter, _ and bytes >= 0x80
+    _L_C_DOT,
+    _L_C_QUOTE,
+    _L_CLASSES
+};
+
+// DFA states, a token's class is picked from the state its last byte ends in
+enum {
+    _L_S_START,
+    _L_S_DEAD,      // can't be anything but LEXER_UNKNOWN anymore
+    _L_S_IDENT,
+    _L_S_ZERO,      // 0
+    _L_S_INT,       // 12
+    _L_S_HEX_X,     // 0x
+    _L_S_HEX,       // 0x1f
+    _L_S_DOT,       // 12.
+    _L_S_FRAC,      // 12.5
+    _L_S_EXP_E,     // 12e
+    _L_S_EXP,       // 12e3
+    _L_S_STRING,    // anything opened by a quote
+    _L_STATES
+};
+
+// transitions[state * _L_CLASSES + class]
+static const uint8_t _lexer_transitions[_L_STATES * _L_CLASSES] = {
+    //              OTHER        ZERO         DIGIT        HEX          E            X            ALPHA        DOT          QUOTE
+    /* START  */    _L_S_DEAD,   _L_S_ZERO,   _L_S_INT,    _L_S_IDENT,  _L_S_IDENT,  _L_S_IDENT,  _L_S_IDENT,  _L_S_DEAD,   _L_S_STRING,
+    /* DEAD   */    _L_S_DEAD,   _L_S_DEAD,   _L_S_DEAD,   _L_S_DEAD,   _L_S_DEAD,   _L_S_DEAD,   _L_S_DEAD,   _L_S_DEAD,   _L_S_DEAD,
+    /* IDENT  */    _L_S_DEAD,   _L_S_IDENT,  _L_S_IDENT,  _L_S_IDENT,  _L_S_IDENT,  _L_S_IDENT,  _L_S_IDENT,  _L_S_DEAD,   _L_S_DEAD,
+    /* ZERO   */    _L_S_DEAD,   _L_S_INT,    _L_S_INT,    _L_S_DEAD,   _L_S_EXP_E,  _L_S_HEX_X,  _L_S_DEAD,   _L_S_DOT,    _L_S_DEAD,
+    /* INT    */    _L_S_DEAD,   _L_S_INT,    _L_S_INT,    _L_S_DEAD,   _L_S_EXP_E,  _L_S_DEAD,   _L_S_DEAD,   _L_S_DOT,    _L_S_DEAD,
+    /* HEX_X  */    _L_S_DEAD,   _L_S_HEX,    _L_S_HEX,    _L_S_HEX,    _L_S_HEX,    _L_S_DEAD,   _L_S_DEAD,   _L_S_DEAD,   _L_S_DEAD,
+    /* HEX    */    _L_S_DEAD,   _L_S_HEX,    _L_S_HEX,    _L_S_HEX,    _L_S_HEX,    _L_S_DEAD,   _L_S_DEAD,   _L_S_DEAD,   _L_S_DEAD,
+    /* DOT    */    _L_S_DEAD,   _L_S_FRAC,   _L_S_FRAC,   _L_S_DEAD,   _L_S_DEAD,   _L_S_DEAD,   _L_S_DEAD,   _L_S_DEAD,   _L_S_DEAD,
+    /* FRAC   */    _L_S_DEAD,   _L_S_FRAC,   _L_S_FRAC,   _L_S_DEAD,   _L_S_EXP_E,  _L_S_DEAD,   _L_S_DEAD,   _L_S_DEAD,   _L_S_DEAD,
+    /* EXP_E  */    _L_S_DEAD,   _L_S_EXP,    _L_S_EXP,    _L_S_DEAD,   _L_S_DEAD,   _L_S_DEAD,   _L_S_DEAD,   _L_S_DEAD,   _L_S_DEAD,
+    /* EXP    */    _L_S_DEAD,   _L_S_EXP,    _L_S_EXP,    _L_S_DEAD,   _L_S_DEAD,   _L_S_DEAD,   _L_S_DEAD,   _L_S_DEAD,   _L_S_DEAD,
+    /* STRING */    _L_S_STRING, _L_S_STRING, _L_S_STRING, _L_S_STRING, _L_S_STRING, _L_S_STRING, _L_S_STRING, _L_S_STRING, _L_S_STRING,
+};
+
+// LEXER_* class of a token ending in each state
+static const uint32_t _lexer_accept[_L_STATES] = {
+    LEXER_UNKNOWN,      // START (empty token)
+    LEXER_UNKNOWN,      // DEAD
+    LEXER_ALPHANUMERIC, // IDENT
+    LEXER_DIGIT,        // ZERO
+    LEXER_DIGIT,        // INT
+    LEXER_UNKNOWN,      // HEX_X
+    LEXER_DIGIT,        // HEX
+    LEXER_DIGIT,        // DOT
+    LEXER_DIGIT,        // FRAC
+    LEXER_UNKNOWN,      // EXP_E
+    LEXER_DIGIT,        // EXP
+    LEXER_STRING,       // STRING
+};
+
+static void _lexer_init_classes(lexer_t *lexer, int options)
 {
-    return nullptr;
+    uint8_t *c = lexer->byte_class;
+    memset(c, _L_C_OTHER, 256);
+
+    for (int i = 'a'; i <= 'z'; i++) {
+        c[i] = c[i - 'a' + 'A'] = _L_C_ALPHA;
+    }
+    for (int i = 0x80; i < 256; i++) {
+        c[i] = _L_C_ALPHA; // UTF-8 identifiers
+    }
+    for (int i = 'a'; i <= 'f'; i++) {
+        c[i] = c[i - 'a' + 'A'] = _L_C_HEX;
+    }
+    for (int i = '1'; i <= '9'; i++) {
+        c[i] = _L_C_DIGIT;
+    }
+    c['0'] = _L_C_ZERO;
+    c['e'] = c['E'] = _L_C_E;
+    c['x'] = c['X'] = _L_C_X;
+    c['_'] = _L_C_ALPHA;
+    c['.'] = _L_C_DOT;
+
+    // only tokens the parser scanned as quoted start with a quote
+    if (options & P_ACCEPT_DOUBLEQUOTES) c['"'] = _L_C_QUOTE;
+    if (options & P_ACCEPT_SINGLEQUOTES) c['\''] = _L_C_QUOTE;
+}
+
+// run the token through the DFA, one table lookup per byte
+static inline uint32_t _lexer_classify(const lexer_t *lexer, const char *text, intmax_t len)
+{
+    const uint8_t *c = lexer->byte_class;
+    uint32_t state = _L_S_START;
+
+    for (intmax_t i = 0; i < len && state != _L_S_DEAD; i++) {
+        state = _lexer_transitions[state * _L_CLASSES + c[(uint8_t)text[i]]];
+    }
+
+    return _lexer_accept[state];
+}
+
+static inline uint32_t _symtab_hash(const char *text, intmax_t len)
+{
+    uint32_t h = 2166136261u;
+    for (intmax_t i = 0; i < len; i++) {
+        h = (h ^ (uint8_t)text[i]) * 16777619u;
+    }
+    return h;
+}
+
+symtab_t *symtab_init()
+{
+    symtab_t *symtab = (symtab_t*) _KMALLOC(sizeof(symtab_t));
+    if (symtab) {
+        memset(symtab, 0, sizeof(symtab_t));
+    }
+    return symtab;
+}
+
+void symtab_destroy(symtab_t *symtab)
+{
+    if (symtab) {
+        if (symtab->items) _KFREE(symtab->items);
+        if (symtab->slots) _KFREE(symtab->slots);
+        if (symtab->pool) _KFREE(symtab->pool);
+        _KFREE(symtab);
+    }
+}
+
+// the slot holding the text, or the empty slot it would go in
+static inline intmax_t _symtab_slot(const symtab_t *symtab, const char *text, intmax_t len, uint32_t hash)
+{
+    intmax_t mask = symtab->slot_capacity - 1;
+    for (intmax_t slot = hash & mask; ; slot = (slot + 1) & mask) {
+        uint32_t id = symtab->slots[slot];
+        if (id == 0) {
+            return slot;
+        }
+
+        const symbol_t *symbol = &symtab->items[id];
+        if (symbol->hash == hash && symbol->len == (uint32_t)len &&
+            memcmp(symtab->pool + symbol->offset, text, len) == 0) {
+            return slot;
+        }
+    }
+}
+
+// keep the slots at most half full, rehashed from the stored hashes
+static int _symtab_grow(symtab_t *symtab)
+{
+    intmax_t capacity = symtab->slot_capacity ? symtab->slot_capacity * 2 : 256;
+    uint32_t *slots = (uint32_t*) _KMALLOC(sizeof(uint32_t) * capacity);
+    if (!slots) {
+        return 0;
+    }
+    memset(slots, 0, sizeof(uint32_t) * capacity);
+
+    for (intmax_t id = 1; id < symtab->count; id++) {
+        intmax_t slot = symtab->items[id].hash & (capacity - 1);
+        while (slots[slot]) {
+            slot = (slot + 1) & (capacity - 1);
+        }
+        slots[slot] = (uint32_t)id;
+    }
+
+    if (symtab->slots) {
+        _KFREE(symtab->slots);
+    }
+    symtab->slots = slots;
+    symtab->slot_capacity = capacity;
+    return 1;
+}
+
+uint32_t symtab_intern(symtab_t *symtab, const char *text, intmax_t len)
+{
+    _KASSERT(symtab && (text || len == 0));
+
+    if (symtab->count == 0) {
+        symtab->count = 1; // id 0 is reserved
+    }
+    if (symtab->count * 2 >= symtab->slot_capacity && !_symtab_grow(symtab)) {
+        return 0;
+    }
+
+    uint32_t hash = _symtab_hash(text, len);
+    intmax_t slot = _symtab_slot(symtab, text, len, hash);
+    if (symtab->slots[slot]) {
+        return symtab->slots[slot];
+    }
+
+    if (symtab->count >= symtab->capacity) {
+        intmax_t capacity = symtab->capacity ? symtab->capacity * 2 : 256;
+        symbol_t *items = (symbol_t*) _KREALLOC(symtab->items, sizeof(symbol_t) * capacity);
+        if (!items) {
+            return 0;
+        }
+        symtab->items = items;
+        symtab->capacity = capacity;
+    }
+    if (symtab->pool_size + len + 1 > symtab->pool_capacity) {
+        intmax_t capacity = symtab->pool_capacity ? symtab->pool_capacity * 2 : 4096;
+        while (capacity < symtab->pool_size + len + 1) {
+            capacity *= 2;
+        }
+        char *pool = (char*) _KREALLOC(symtab->pool, capacity);
+        if (!pool) {
+            return 0;
+        }
+        symtab->pool = pool;
+        symtab->pool_capacity = capacity;
+    }
+
+    uint32_t id = (uint32_t)symtab->count++;
+    symtab->items[id] = (symbol_t) {
+        .hash = hash,
+        .len = (uint32_t)len,
+        .offset = symtab->pool_size
+    };
+    memcpy(symtab->pool + symtab->pool_size, text, len);
+    symtab->pool[symtab->pool_size + len] = '\0';
+    symtab->pool_size += len + 1;
+    symtab->slots[slot] = id;
+
+    return id;
+}
+
+uint32_t symtab_find(const symtab_t *symtab, const char *text, intmax_t len)
+{
+    _KASSERT(symtab && (text || len == 0));
+
+    if (symtab->slot_capacity == 0) {
+        return 0;
+    }
+    return symtab->slots[_symtab_slot(symtab, text, len, _symtab_hash(text, len))];
+}
+
+const char *symtab_name(const symtab_t *symtab, uint32_t id)
+{
+    _KASSERT(symtab);
+
+    if (id == 0 || id >= symtab->count) {
+        return nullptr;
+    }
+    return symtab->pool + symtab->items[id].offset;
+}
+
+static int _lexer_push(lexeme_list_t *list, const lexeme_t *lexeme)
+{
+    if (list->count >= list->capacity) {
+        intmax_t capacity = list->capacity ? list->capacity * 2 : 64;
+        lexeme_t *items = (lexeme_t*) _KREALLOC(list->items, sizeof(lexeme_t) * capacity);
+        if (!items) {
+            return 0;
+        }
+        list->items = items;
+        list->capacity = capacity;
+    }
+
+    list->items[list->count++] = *lexeme;
+    return 1;
+}
+
+// symbols interned in the lexer's own table while lexer_parse_scripts runs
+#define _L_LOCAL_SYMBOL 0x80000000u
+
+// Classify every token of the parser (P_STREAMING), identifiers found in 
+// shared take its id, the rest go in the lexer's own table
+static lexer_t *_lexer_create(parser_t *parser, int options, const symtab_t *shared)
+{
+    _KASSERT(parser->buffer_size <= (intmax_t)UINT32_MAX);
+
+    lexer_t *lexer = (lexer_t*) _KMALLOC(sizeof(lexer_t));
+    if (!lexer) {
+        parser_destroy(parser);
+        return nullptr;
+    }
+    memset(lexer, 0, sizeof(lexer_t));
+    _lexer_init_classes(lexer, options);
+    lexer->parser = parser;
+    lexer->buffer = parser->buffer;
+    lexer->punctuation = parser->punctuation;
+    lexer->options = options;
+
+    lexer->symbols = symtab_init();
+    if (!lexer->symbols) {
+        lexer_destroy(lexer);
+        return nullptr;
+    }
+
+    // about one token per 6 bytes of source is a common ratio
+    intmax_t hint = parser->buffer_size / 6 + 16;
+    lexer->lexemes.items = (lexeme_t*) _KMALLOC(sizeof(lexeme_t) * hint);
+    lexer->lexemes.capacity = lexer->lexemes.items ? hint : 0;
+
+    const char *buffer = parser->buffer;
+    token_t token = parser_get_token(parser);
+    while (token.id != -2) {
+        lexeme_t lexeme = {
+            .id = token.id,
+            .offset = (uint32_t)token.offset,
+            .len = (uint32_t)token.len,
+            .line = (uint32_t)token.line
+        };
+
+        if (token.id >= 0) {
+            lexeme.kind = LEXER_PUNCTUATION;
+        } else {
+            lexeme.kind = _lexer_classify(lexer, buffer + token.offset, token.len);
+            if (lexeme.kind == LEXER_ALPHANUMERIC) {
+                const char *text = buffer + token.offset;
+                lexeme.symbol = shared ? symtab_find(shared, text, token.len) : 0;
+                if (!lexeme.symbol) {
+                    lexeme.symbol = symtab_intern(lexer->symbols, text, token.len);
+                    if (!lexeme.symbol) {
+                        lexer_destroy(lexer); // out of memory
+                        return nullptr;
+                    }
+                    if (shared) lexeme.symbol |= _L_LOCAL_SYMBOL;
+                }
+            }
+        }
+
+        if (!_lexer_push(&lexer->lexemes, &lexeme)) {
+            lexer_destroy(lexer);
+            return nullptr;
+        }
+        token = parser_get_token(parser);
+    }
+
+    return lexer;
+}
+
+lexer_t *lexer_init(const char *buffer, const punc_list_t *punctuation, int options)
+{
+    _KASSERT(buffer);
+    _KASSERT(punctuation);
+
+    // only the lexemes are kept, the parser doesn't need to store tokens
+    parser_t *parser = parser_init_n(buffer, strlen(buffer), punctuation, options | P_STREAMING);
+    if (!parser) {
+        return nullptr;
+    }
+    return _lexer_create(parser, options, nullptr);
+}
+
+static void _scope_free(scope_t *scope)
+{
+    if (scope->variables) _KFREE(scope->variables);
+    if (scope->first) _KFREE(scope->first);
+}
+
+// arrays lexer_load points into the cache aren't ours to free
+static inline int _lexer_cached(const lexer_t *lexer, const void *ptr)
+{
+    const char *at = (const char*)ptr;
+    return lexer->cache && at >= (const char*)lexer->cache && at < (const char*)lexer->cache + lexer->cache_size;
+}
+
+static void _lexer_scope_free(lexer_t *lexer, scope_t *scope)
+{
+    if (!_lexer_cached(lexer, scope->variables)) {
+        _scope_free(scope);
+    }
 }
 
 void lexer_destroy(lexer_t *lexer)
 {
     if (lexer) {
+        if (lexer->parser) {
+            parser_destroy(lexer->parser);
+        }
+        if (lexer->lexemes.items && !_lexer_cached(lexer, lexer->lexemes.items)) {
+            _KFREE(lexer->lexemes.items);
+        }
+        if (lexer->rules.items) {
+            _KFREE(lexer->rules.items);
+        }
+        if (lexer->jumps) {
+            _KFREE(lexer->jumps);
+        }
+        for (intmax_t i = 0; i < lexer->scopes.count; i++) {
+            _lexer_scope_free(lexer, lexer->scopes.items[i]);
+            _KFREE(lexer->scopes.items[i]);
+        }
+        if (lexer->scopes.items) {
+            _KFREE(lexer->scopes.items);
+        }
+        _lexer_scope_free(lexer, &lexer->global_scope);
+        if (lexer->cache) {
+            if (lexer->symbols) _KFREE(lexer->symbols); // the arrays are in the cache
+#if defined(_L_MMAP)
+            munmap(lexer->cache, lexer->cache_size);
+#else
+            _KFREE(lexer->cache);
+#endif
+        } else if (!lexer->shared_symbols) {
+            symtab_destroy(lexer->symbols);
+        }
         _KFREE(lexer);
     }
 }
 
+const char *lexer_lexeme_text(const lexer_t *lexer, const lexeme_t *lexeme)
+{
+    _KASSERT(lexer && lexeme);
+    return lexer->buffer + lexeme->offset;
+}
+
 void lexer_set_tracer(lexer_t *lexer, tracer_t tracer)
 {
     _KASSERT(lexer);
     lexer->tracer = tracer;
 }
 
-void lexer_declare_rule(token_t start, token_t end, const char *error)
+void lexer_declare_rule(lexer_t *lexer, token_t start, token_t end, const char *error)
+{
+    _KASSERT(lexer);
+
+    rule_list_t *rules = &lexer->rules;
+    if (rules->count >= rules->capacity) {
+        intmax_t capacity = rules->capacity ? rules->capacity * 2 : 8;
+        rule_t *items = (rule_t*) _KREALLOC(rules->items, sizeof(rule_t) * capacity);
+        if (!items) {
+            return;
+        }
+        rules->items = items;
+        rules->capacity = capacity;
+    }
+
+    rules->items[rules->count++] = (rule_t) {
+        .start_match = start,
+        .end_match = end,
+        .error = error
+    };
+
+    // the index is rebuilt with the new rule the next time it's needed
+    if (lexer->jumps) {
+        _KFREE(lexer->jumps);
+        lexer->jumps = nullptr;
+    }
+}
+
+static void _lexer_trace(lexer_t *lexer, const char *msg, const lexeme_t *lexeme)
 {
-    
+    if (lexer->tracer) {
+        lexer->tracer(msg, lexer->filename, nullptr, lexeme->line, lexeme->offset);
+    }
 }
 
-void lexer_parse_script(const char *identifier)
+// the rule a lexeme starts (*end = 0) or ends (*end = 1), -1 if none
+static inline intmax_t _lexer_rule(const lexer_t *lexer, const lexeme_t *lexeme, int *end)
 {
+    if (lexeme->kind != LEXER_PUNCTUATION) {
+        return -1;
+    }
+
+    for (intmax_t r = 0; r < lexer->rules.count; r++) {
+        const rule_t *rule = &lexer->rules.items[r];
+        if (lexeme->id == rule->start_match.id) {
+            *end = 0;
+            return r;
+        }
+        if (lexeme->id == rule->end_match.id) {
+            *end = 1;
+            return r;
+        }
+    }
 
+    return -1;
 }
 
-scope_t *lexer_parse_scope(lexer_t *lexer, const char *scope)
+// One pass over the lexemes with a stack of the open starts, every start 
+// and end gets the index of its counterpart. An end closes the innermost 
+// start of its rule, the starts it skips over are left unmatched
+static int _lexer_build_jumps(lexer_t *lexer)
+{
+    intmax_t count = lexer->lexemes.count;
+    int32_t *jumps = (int32_t*) _KMALLOC(sizeof(int32_t) * (count ? count : 1));
+    if (!jumps) {
+        return 0;
+    }
+
+    int32_t *stack = nullptr;
+    intmax_t depth = 0;
+    intmax_t capacity = 0;
+
+    for (intmax_t i = 0; i < count; i++) {
+        jumps[i] = -1;
+
+        const lexeme_t *lexeme = &lexer->lexemes.items[i];
+        int end = 0;
+        intmax_t r = _lexer_rule(lexer, lexeme, &end);
+        if (r < 0) {
+            continue;
+        }
+
+        if (!end) {
+            if (depth >= capacity) {
+                intmax_t grown = capacity ? capacity * 2 : 64;
+                int32_t *items = (int32_t*) _KREALLOC(stack, sizeof(int32_t) * grown);
+                if (!items) {
+                    _KFREE(jumps);
+                    if (stack) _KFREE(stack);
+                    return 0;
+                }
+                stack = items;
+                capacity = grown;
+            }
+            stack[depth++] = (int32_t)i;
+            continue;
+        }
+
+        // innermost open start of the same rule
+        intmax_t top = depth - 1;
+        int dummy;
+        while (top >= 0 && _lexer_rule(lexer, &lexer->lexemes.items[stack[top]], &dummy) != r) {
+            top--;
+        }
+        if (top < 0) {
+            _lexer_trace(lexer, lexer->rules.items[r].error, lexeme);
+            continue;
+        }
+
+        while (depth - 1 > top) {
+            const lexeme_t *open = &lexer->lexemes.items[stack[--depth]];
+            _lexer_trace(lexer, lexer->rules.items[_lexer_rule(lexer, open, &dummy)].error, open);
+        }
+        depth--;
+        jumps[stack[depth]] = (int32_t)i;
+        jumps[i] = stack[depth];
+    }
+
+    // starts that were never closed
+    int dummy;
+    while (depth > 0) {
+        const lexeme_t *open = &lexer->lexemes.items[stack[--depth]];
+        _lexer_trace(lexer, lexer->rules.items[_lexer_rule(lexer, open, &dummy)].error, open);
+    }
+
+    if (stack) {
+        _KFREE(stack);
+    }
+    lexer->jumps = jumps;
+    return 1;
+}
+
+intmax_t lexer_match(lexer_t *lexer, intmax_t index)
+{
+    _KASSERT(lexer);
+
+    if (index < 0 || index >= lexer->lexemes.count) {
+        return -1;
+    }
+    if (!lexer->jumps && !_lexer_build_jumps(lexer)) {
+        return -1;
+    }
+
+    return lexer->jumps[index];
+}
+
+static int _lexer_parse_script(script_t *script, const punc_list_t *punctuation, int options, 
+                               const symtab_t *shared)
+{
+    _KASSERT(script && punctuation);
+    _KASSERT(script->buffer || script->filename);
+
+    parser_t *parser = script->buffer 
+        ? parser_init_n(script->buffer, strlen(script->buffer), punctuation, options | P_STREAMING)
+        : parser_init_file(script->filename, punctuation, options | P_STREAMING);
+
+    script->lexer = parser ? _lexer_create(parser, options, shared) : nullptr;
+    if (script->lexer) {
+        script->lexer->filename = script->filename;
+    }
+    return script->lexer != nullptr;
+}
+
+int lexer_parse_script(script_t *script, const punc_list_t *punctuation, int options)
+{
+    return _lexer_parse_script(script, punctuation, options, nullptr);
+}
+
+// intern the symbols only this lexer has into the shared table and switch
+// its lexemes over to the shared ids
+static int _lexer_merge_symbols(lexer_t *lexer, symtab_t *symbols)
+{
+    symtab_t *local = lexer->symbols;
+    uint32_t *remap = (uint32_t*) _KMALLOC(sizeof(uint32_t) * (local->count ? local->count : 1));
+    if (!remap) {
+        return 0;
+    }
+
+    // local ids are in order of appearance, like interning straight into symbols
+    for (intmax_t id = 1; id < local->count; id++) {
+        const symbol_t *symbol = &local->items[id];
+        remap[id] = symtab_intern(symbols, local->pool + symbol->offset, symbol->len);
+        if (!remap[id]) {
+            _KFREE(remap);
+            return 0;
+        }
+    }
+
+    for (intmax_t i = 0; i < lexer->lexemes.count; i++) {
+        uint32_t *symbol = &lexer->lexemes.items[i].symbol;
+        if (*symbol & _L_LOCAL_SYMBOL) {
+            *symbol = remap[*symbol & ~_L_LOCAL_SYMBOL];
+        }
+    }
+
+    _KFREE(remap);
+    symtab_destroy(local);
+    lexer->symbols = symbols;
+    lexer->shared_symbols = 1;
+    return 1;
+}
+
+#if defined(_L_THREADS_WIN32)
+    #define _L_CLAIM(p) (InterlockedExchangeAdd64((volatile LONG64*)(p), 1))
+#elif defined(_L_THREADS_PTHREAD)
+    #define _L_CLAIM(p) (__atomic_fetch_add((p), 1, __ATOMIC_RELAXED))
+#else
+    #define _L_CLAIM(p) ((*(p))++) // only the calling thread claims scripts
+#endif
+
+typedef struct {
+    script_t            *scripts;
+    int64_t              count;
+    int64_t              next;       // first script no thread has claimed
+    const punc_list_t   *punctuation;
+    const symtab_t      *symbols;    // read-only until every thread is done
+    int                  options;
+} _lexer_batch_t;
+
+static void _lexer_batch_run(_lexer_batch_t *batch)
+{
+    for (;;) {
+        int64_t i = _L_CLAIM(&batch->next);
+        if (i >= batch->count) {
+            break;
+        }
+        _lexer_parse_script(&batch->scripts[i], batch->punctuation, batch->options, batch->symbols);
+    }
+}
+
+#if defined(_L_THREADS_WIN32)
+static DWORD WINAPI _lexer_batch_thread(LPVOID arg)
+{
+    _lexer_batch_run((_lexer_batch_t*)arg);
+    return 0;
+}
+#elif defined(_L_THREADS_PTHREAD)
+static void *_lexer_batch_thread(void *arg)
 {
+    _lexer_batch_run((_lexer_batch_t*)arg);
     return nullptr;
 }
+#endif
+
+intmax_t lexer_parse_scripts(script_t *scripts, intmax_t count, const punc_list_t *punctuation, 
+                             symtab_t *symbols, int options, int nthreads)
+{
+    _KASSERT(scripts || count == 0);
+    _KASSERT(punctuation && symbols);
+
+    _lexer_batch_t batch = {
+        .scripts = scripts,
+        .count = count,
+        .next = 0,
+        .punctuation = punctuation,
+        .symbols = symbols,
+        .options = options
+    };
+
+    if (nthreads > count) {
+        nthreads = (int)count;
+    }
+    if (nthreads > P_PARALLEL_MAX_THREADS) {
+        nthreads = P_PARALLEL_MAX_THREADS;
+    }
+
+#if defined(_L_THREADS_WIN32)
+    HANDLE threads[P_PARALLEL_MAX_THREADS];
+#elif defined(_L_THREADS_PTHREAD)
+    pthread_t threads[P_PARALLEL_MAX_THREADS];
+#endif
+    int spawned[P_PARALLEL_MAX_THREADS] = { 0 };
+
+#if defined(_L_THREADS_WIN32) || defined(_L_THREADS_PTHREAD)
+    for (int t = 1; t < nthreads; t++) {
+    #if defined(_L_THREADS_WIN32)
+        threads[t] = CreateThread(NULL, 0, _lexer_batch_thread, &batch, 0, NULL);
+        spawned[t] = threads[t] != NULL;
+    #else
+        spawned[t] = pthread_create(&threads[t], NULL, _lexer_batch_thread, &batch) == 0;
+    #endif
+    }
+#endif
+    _lexer_batch_run(&batch); // and whatever a thread that failed to start would have
+
+    for (int t = 1; t < nthreads; t++) {
+        if (spawned[t]) {
+#if defined(_L_THREADS_WIN32)
+            WaitForSingleObject(threads[t], INFINITE);
+            CloseHandle(threads[t]);
+#elif defined(_L_THREADS_PTHREAD)
+            pthread_join(threads[t], NULL);
+#endif
+        }
+    }
+
+    intmax_t lexed = 0;
+    for (intmax_t i = 0; i < count; i++) {
+        lexer_t *lexer = scripts[i].lexer;
+        if (lexer && !_lexer_merge_symbols(lexer, symbols)) {
+            lexer_destroy(lexer);
+            scripts[i].lexer = nullptr;
+        }
+        lexed += scripts[i].lexer != nullptr;
+    }
+    return lexed;
+}
+
+static inline intmax_t _scope_slot(const scope_t *scope, uint32_t symbol)
+{
+    intmax_t mask = scope->capacity - 1;
+    intmax_t slot = (intmax_t)((symbol * 2654435761u) & mask);
+    while (scope->variables[slot] && scope->variables[slot] != symbol) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+// keep the first lexeme a symbol appears at, at most half full
+static int _scope_add(scope_t *scope, uint32_t symbol, intmax_t lexeme)
+{
+    if ((scope->count + 1) * 2 > scope->capacity) {
+        scope_t grown = *scope;
+        grown.capacity = scope->capacity ? scope->capacity * 2 : 16;
+        grown.count = 0;
+        grown.variables = (uint32_t*) _KMALLOC(sizeof(uint32_t) * grown.capacity);
+        grown.first = (int32_t*) _KMALLOC(sizeof(int32_t) * grown.capacity);
+        if (!grown.variables || !grown.first) {
+            _scope_free(&grown);
+            return 0;
+        }
+        memset(grown.variables, 0, sizeof(uint32_t) * grown.capacity);
+
+        for (intmax_t i = 0; i < scope->capacity; i++) {
+            if (scope->variables[i]) {
+                intmax_t slot = _scope_slot(&grown, scope->variables[i]);
+                grown.variables[slot] = scope->variables[i];
+                grown.first[slot] = scope->first[i];
+                grown.count++;
+            }
+        }
+        _scope_free(scope);
+        *scope = grown;
+    }
+
+    intmax_t slot = _scope_slot(scope, symbol);
+    if (!scope->variables[slot]) {
+        scope->variables[slot] = symbol;
+        scope->first[slot] = (int32_t)lexeme;
+        scope->count++;
+    }
+    return 1;
+}
+
+intmax_t scope_find(const scope_t *scope, uint32_t symbol)
+{
+    _KASSERT(scope);
+
+    if (symbol == 0 || scope->count == 0) {
+        return -1;
+    }
+
+    intmax_t slot = _scope_slot(scope, symbol);
+    return scope->variables[slot] ? scope->first[slot] : -1;
+}
+
+uint32_t lexer_symbol(const lexer_t *lexer, const char *text)
+{
+    _KASSERT(lexer && text);
+    return symtab_find(lexer->symbols, text, strlen(text));
+}
+
+// the identifiers in [start, end), blocks of declared rules are jumped over
+static int _lexer_fill_scope(lexer_t *lexer, scope_t *scope, intmax_t start, intmax_t end)
+{
+    for (intmax_t i = start; i < end; i++) {
+        intmax_t match = lexer_match(lexer, i);
+        if (match > i) {
+            i = match;
+            continue;
+        }
+
+        uint32_t symbol = lexer->lexemes.items[i].symbol;
+        if (symbol && !_scope_add(scope, symbol, i)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+scope_t *lexer_parse_scope(lexer_t *lexer, const char *scope)
+{
+    _KASSERT(lexer);
+
+    if (!scope) {
+        scope_t *global = &lexer->global_scope;
+        if (global->start != -1) { // not parsed yet
+            if (!_lexer_fill_scope(lexer, global, 0, lexer->lexemes.count)) {
+                // drop what was filled in, the next call starts over
+                _scope_free(global);
+                global->variables = nullptr;
+                global->first = nullptr;
+                global->capacity = 0;
+                global->count = 0;
+                return nullptr;
+            }
+            global->start = -1;
+        }
+        return global;
+    }
+
+    uint32_t name = lexer_symbol(lexer, scope);
+    if (!name) {
+        return nullptr;
+    }
+    for (intmax_t i = 0; i < lexer->scopes.count; i++) {
+        if (lexer->scopes.items[i]->name == name) {
+            return lexer->scopes.items[i];
+        }
+    }
+
+    // the name followed by a start, symbols compare as integers
+    intmax_t start = -1;
+    intmax_t end = -1;
+    for (intmax_t i = 0; i + 1 < lexer->lexemes.count; i++) {
+        if (lexer->lexemes.items[i].symbol == name) {
+            end = lexer_match(lexer, i + 1);
+            if (end > i + 1) {
+                start = i + 1;
+                break;
+            }
+        }
+    }
+    if (start < 0) {
+        return nullptr;
+    }
+
+    scopt_list_t *scopes = &lexer->scopes;
+    if (scopes->count >= scopes->capacity) {
+        intmax_t capacity = scopes->capacity ? scopes->capacity * 2 : 8;
+        scope_t **items = (scope_t**) _KREALLOC(scopes->items, sizeof(scope_t*) * capacity);
+        if (!items) {
+            return nullptr;
+        }
+        scopes->items = items;
+        scopes->capacity = capacity;
+    }
+
+    scope_t *parsed = (scope_t*) _KMALLOC(sizeof(scope_t));
+    if (!parsed) {
+        return nullptr;
+    }
+    memset(parsed, 0, sizeof(scope_t));
+    parsed->name = name;
+    parsed->start = (int32_t)start;
+    if (!_lexer_fill_scope(lexer, parsed, start + 1, end)) {
+        _scope_free(parsed);
+        _KFREE(parsed);
+        return nullptr;
+    }
+
+    scopes->items[scopes->count++] = parsed;
+    return parsed;
+}
+
+uint64_t lexer_hash(const char *buffer, intmax_t size)
+{
+    _KASSERT(buffer || size == 0);
+
+    // 8 bytes a step, a cache key rather than anything cryptographic
+    uint64_t h = 0x9e3779b97f4a7c15ull ^ (uint64_t)size;
+    intmax_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, buffer + i, 8);
+        h = (h ^ word) * 0xff51afd7ed558ccdull;
+        h ^= h >> 32;
+    }
+    for (; i < size; i++) {
+        h = (h ^ (uint8_t)buffer[i]) * 0x100000001b3ull;
+    }
+
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+uint64_t lexer_punctuation_hash(const punc_list_t *punctuation)
+{
+    _KASSERT(punctuation);
+
+    uint64_t h = lexer_hash(nullptr, 0);
+    for (intmax_t k = 0; k < punctuation->count; k++) {
+        const punc_t *punc = &punctuation->items[k];
+        h = (h ^ lexer_hash(punc->p, punc->len)) * 0x100000001b3ull;
+        h = (h ^ (uint32_t)punc->id) * 0x100000001b3ull;
+    }
+    for (intmax_t r = 0; r < punctuation->ignore_count; r++) {
+        const punc_ignore_t *ignore = &punctuation->ignores[r];
+        h = (h ^ lexer_hash(ignore->close, ignore->close_len)) * 0x100000001b3ull;
+        h = (h ^ (uint32_t)ignore->id) * 0x100000001b3ull;
+    }
+    return h;
+}
+
+#define _L_CACHE_VERSION 1
+#define _L_CACHE_ENDIAN  0x01020304u
+#define _L_CACHE_LAYOUT  ((uint32_t)(sizeof(lexeme_t) | sizeof(symbol_t) << 8))
+#define _L_CACHE_ALIGN(x) (((x) + 7) & ~(uint64_t)7)
+
+// lexer_save file header, every section is at an 8-byte aligned offset 
+// from the start of the file
+typedef struct {
+    char         magic[4];          // "KLXC"
+    uint32_t     version;           // _L_CACHE_VERSION
+    uint32_t     endian;            // _L_CACHE_ENDIAN as the writer stored it
+    uint32_t     layout;            // _L_CACHE_LAYOUT
+    uint64_t     content_hash;      // lexer_hash of the source
+    uint64_t     punctuation_hash;
+    uint64_t     options;
+    uint64_t     size;              // of the source
+    uint64_t     lexemes, lexeme_count;
+    uint64_t     symbols, symbol_count;
+    uint64_t     slots, slot_capacity;
+    uint64_t     pool, pool_size;
+    uint64_t     scopes, scope_count;
+} _lexer_cache_t;
+
+typedef struct {
+    uint32_t     name;
+    int32_t      start;             // -1 for the global scope
+    uint64_t     variables;         // uint32_t[capacity]
+    uint64_t     first;             // int32_t[capacity]
+    uint64_t     capacity;
+    uint64_t     count;
+} _lexer_cache_scope_t;
+
+static inline intmax_t _lexer_size(const lexer_t *lexer)
+{
+    return lexer->parser ? lexer->parser->buffer_size : (intmax_t)strlen(lexer->buffer);
+}
+
+// write the section at the next aligned offset, 0 on failure
+static int _lexer_cache_write(FILE *file, uint64_t *at, const void *data, uint64_t bytes)
+{
+    static const char padding[8] = { 0 };
+
+    uint64_t aligned = _L_CACHE_ALIGN(*at);
+    if (aligned > *at && fwrite(padding, 1, aligned - *at, file) != aligned - *at) {
+        return 0;
+    }
+    if (bytes && fwrite(data, 1, bytes, file) != bytes) {
+        return 0;
+    }
+    *at = aligned + bytes;
+    return 1;
+}
+
+int lexer_save(const lexer_t *lexer, const char *path)
+{
+    _KASSERT(lexer && path);
+    _KASSERT(lexer->punctuation);
+
+    // the global scope goes first if it was parsed
+    const scope_t **list = (const scope_t**) _KMALLOC(sizeof(scope_t*) * (1 + lexer->scopes.count));
+    if (!list) {
+        return 0;
+    }
+    intmax_t scope_count = 0;
+    if (lexer->global_scope.start == -1) {
+        list[scope_count++] = &lexer->global_scope;
+    }
+    for (intmax_t i = 0; i < lexer->scopes.count; i++) {
+        list[scope_count++] = lexer->scopes.items[i];
+    }
+
+    const symtab_t *symbols = lexer->symbols;
+    intmax_t size = _lexer_size(lexer);
+    _lexer_cache_t header = {
+        .magic = { 'K', 'L', 'X', 'C' },
+        .version = _L_CACHE_VERSION,
+        .endian = _L_CACHE_ENDIAN,
+        .layout = _L_CACHE_LAYOUT,
+        .content_hash = lexer_hash(lexer->buffer, size),
+        .punctuation_hash = lexer_punctuation_hash(lexer->punctuation),
+        .options = (uint64_t)lexer->options,
+        .size = (uint64_t)size,
+        .lexeme_count = (uint64_t)lexer->lexemes.count,
+        .symbol_count = (uint64_t)symbols->count,
+        .slot_capacity = (uint64_t)symbols->slot_capacity,
+        .pool_size = (uint64_t)symbols->pool_size,
+        .scope_count = (uint64_t)scope_count
+    };
+
+    // lay the sections out first, the header points at them
+    uint64_t at = _L_CACHE_ALIGN(sizeof(_lexer_cache_t));
+    header.lexemes = at;
+    at = _L_CACHE_ALIGN(at + header.lexeme_count * sizeof(lexeme_t));
+    header.symbols = at;
+    at = _L_CACHE_ALIGN(at + header.symbol_count * sizeof(symbol_t));
+    header.slots = at;
+    at = _L_CACHE_ALIGN(at + header.slot_capacity * sizeof(uint32_t));
+    header.pool = at;
+    at = _L_CACHE_ALIGN(at + header.pool_size);
+    header.scopes = at;
+    at = _L_CACHE_ALIGN(at + header.scope_count * sizeof(_lexer_cache_scope_t));
+
+    FILE *file = fopen(path, "wb");
+    uint64_t written = 0;
+    int ok = file != nullptr;
+    ok = ok && _lexer_cache_write(file, &written, &header, sizeof(header));
+    ok = ok && _lexer_cache_write(file, &written, lexer->lexemes.items, header.lexeme_count * sizeof(lexeme_t));
+    ok = ok && _lexer_cache_write(file, &written, symbols->items, header.symbol_count * sizeof(symbol_t));
+    ok = ok && _lexer_cache_write(file, &written, symbols->slots, header.slot_capacity * sizeof(uint32_t));
+    ok = ok && _lexer_cache_write(file, &written, symbols->pool, header.pool_size);
+
+    // the scope records, then the hash sets they point at
+    for (intmax_t i = 0; ok && i < scope_count; i++) {
+        _lexer_cache_scope_t record = {
+            .name = list[i]->name,
+            .start = list[i]->start,
+            .variables = at,
+            .first = _L_CACHE_ALIGN(at + list[i]->capacity * sizeof(uint32_t)),
+            .capacity = (uint64_t)list[i]->capacity,
+            .count = (uint64_t)list[i]->count
+        };
+        at = _L_CACHE_ALIGN(record.first + list[i]->capacity * sizeof(int32_t));
+        ok = _lexer_cache_write(file, &written, &record, sizeof(record));
+    }
+    for (intmax_t i = 0; ok && i < scope_count; i++) {
+        ok = _lexer_cache_write(file, &written, list[i]->variables, list[i]->capacity * sizeof(uint32_t)) &&
+             _lexer_cache_write(file, &written, list[i]->first, list[i]->capacity * sizeof(int32_t));
+    }
+
+    if (file && fclose(file) != 0) {
+        ok = 0;
+    }
+    if (file && !ok) {
+        remove(path); // never leave a truncated cache behind
+    }
+    _KFREE(list);
+    return ok;
+}
+
+// count items of bytes each fit in the file at offset
+static inline int _lexer_cache_fits(uint64_t size, uint64_t offset, uint64_t count, uint64_t bytes)
+{
+    return offset % 8 == 0 && offset <= size && count <= (size - offset) / bytes;
+}
+
+static int _lexer_cache_valid(const _lexer_cache_t *h, uint64_t size)
+{
+    if (size < sizeof(_lexer_cache_t) || memcmp(h->magic, "KLXC", 4) != 0 ||
+        h->version != _L_CACHE_VERSION || h->endian != _L_CACHE_ENDIAN || h->layout != _L_CACHE_LAYOUT) {
+        return 0;
+    }
+
+    return _lexer_cache_fits(size, h->lexemes, h->lexeme_count, sizeof(lexeme_t)) &&
+           _lexer_cache_fits(size, h->symbols, h->symbol_count, sizeof(symbol_t)) &&
+           _lexer_cache_fits(size, h->slots, h->slot_capacity, sizeof(uint32_t)) &&
+           _lexer_cache_fits(size, h->pool, h->pool_size, 1) &&
+           _lexer_cache_fits(size, h->scopes, h->scope_count, sizeof(_lexer_cache_scope_t)) &&
+           (h->slot_capacity & (h->slot_capacity - 1)) == 0 &&
+           h->lexeme_count <= UINT32_MAX && h->symbol_count <= UINT32_MAX;
+}
+
+// Every index the loaded arrays are used with has to stay in range, a cache
+// that was truncated or tampered with is rejected rather than trusted. The
+// sections are known to fit the file
+static int _lexer_cache_consistent(const _lexer_cache_t *h, const char *base)
+{
+    const symbol_t *symbols = (const symbol_t*)(base + h->symbols);
+    const uint32_t *slots = (const uint32_t*)(base + h->slots);
+    const char *pool = base + h->pool;
+    const lexeme_t *lexemes = (const lexeme_t*)(base + h->lexemes);
+
+    // NUL-terminated text inside the pool (id 0 is unused)
+    for (uint64_t id = 1; id < h->symbol_count; id++) {
+        if (symbols[id].offset < 0 || (uint64_t)symbols[id].offset >= h->pool_size ||
+            symbols[id].len >= h->pool_size - (uint64_t)symbols[id].offset ||
+            pool[symbols[id].offset + symbols[id].len] != '\0') {
+            return 0;
+        }
+    }
+
+    // the probes need an empty slot to stop at
+    uint64_t filled = 0;
+    for (uint64_t slot = 0; slot < h->slot_capacity; slot++) {
+        if (slots[slot] >= h->symbol_count) {
+            return 0;
+        }
+        filled += slots[slot] != 0;
+    }
+    if (h->slot_capacity && filled >= h->slot_capacity) {
+        return 0;
+    }
+
+    for (uint64_t i = 0; i < h->lexeme_count; i++) {
+        if ((lexemes[i].symbol && lexemes[i].symbol >= h->symbol_count) ||
+            (uint64_t)lexemes[i].offset + lexemes[i].len > h->size) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// the same for a scope record and its hash set
+static int _lexer_cache_scope_consistent(const _lexer_cache_t *h, const char *base, uint64_t size,
+                                          const _lexer_cache_scope_t *record)
+{
+    if (!_lexer_cache_fits(size, record->variables, record->capacity, sizeof(uint32_t)) ||
+        !_lexer_cache_fits(size, record->first, record->capacity, sizeof(int32_t)) ||
+        (record->capacity & (record->capacity - 1)) != 0 ||
+        record->name >= (h->symbol_count ? h->symbol_count : 1) ||
+        record->start < -1 || (int64_t)record->start >= (int64_t)h->lexeme_count) {
+        return 0;
+    }
+
+    const uint32_t *variables = (const uint32_t*)(base + record->variables);
+    const int32_t *first = (const int32_t*)(base + record->first);
+    uint64_t filled = 0;
+    for (uint64_t slot = 0; slot < record->capacity; slot++) {
+        if (!variables[slot]) {
+            continue;
+        }
+        if (variables[slot] >= h->symbol_count || first[slot] < 0 || (uint64_t)first[slot] >= h->lexeme_count) {
+            return 0;
+        }
+        filled++;
+    }
+
+    // scope_find probes whenever count isn't 0
+    return record->count == filled && (record->capacity == 0 || filled < record->capacity);
+}
+
+static void _lexer_cache_release(void *cache, uint64_t size)
+{
+#if defined(_L_MMAP)
+    munmap(cache, size);
+#else
+    (void)size;
+    _KFREE(cache);
+#endif
+}
+
+lexer_t *lexer_load(const char *path, const char *buffer, const punc_list_t *punctuation, int options)
+{
+    _KASSERT(path && buffer && punctuation);
+
+    void *cache = nullptr;
+    uint64_t cache_size = 0;
+#if defined(_L_MMAP)
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return nullptr;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < sizeof(_lexer_cache_t)) {
+        close(fd);
+        return nullptr;
+    }
+    cache_size = (uint64_t)st.st_size;
+    cache = mmap(NULL, cache_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // the mapping stays valid
+    if (cache == MAP_FAILED) {
+        return nullptr;
+    }
+#else
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        return nullptr;
+    }
+    intmax_t size = -1;
+    if (fseek(file, 0, SEEK_END) == 0) {
+        size = ftell(file);
+        rewind(file);
+    }
+    cache = size >= (intmax_t)sizeof(_lexer_cache_t) ? _KMALLOC(size) : nullptr;
+    if (!cache || (intmax_t)fread(cache, 1, size, file) != size) {
+        if (cache) _KFREE(cache);
+        fclose(file);
+        return nullptr;
+    }
+    fclose(file);
+    cache_size = (uint64_t)size;
+#endif // _L_MMAP
+
+    // stale or foreign, the caller lexes it again
+    const _lexer_cache_t *h = (const _lexer_cache_t*)cache;
+    intmax_t length = strlen(buffer);
+    if (!_lexer_cache_valid(h, cache_size) || h->options != (uint64_t)options || h->size != (uint64_t)length ||
+        h->punctuation_hash != lexer_punctuation_hash(punctuation) || h->content_hash != lexer_hash(buffer, length) ||
+        !_lexer_cache_consistent(h, (const char*)cache)) {
+        _lexer_cache_release(cache, cache_size);
+        return nullptr;
+    }
+
+    lexer_t *lexer = (lexer_t*) _KMALLOC(sizeof(lexer_t));
+    if (!lexer) {
+        _lexer_cache_release(cache, cache_size);
+        return nullptr;
+    }
+    memset(lexer, 0, sizeof(lexer_t));
+    lexer->cache = cache;
+    lexer->cache_size = (intmax_t)cache_size;
+
+    char *base = (char*)cache;
+    _lexer_init_classes(lexer, options);
+    lexer->buffer = buffer;
+    lexer->punctuation = punctuation;
+    lexer->options = options;
+    lexer->lexemes.items = (lexeme_t*)(base + h->lexemes);
+    lexer->lexemes.count = lexer->lexemes.capacity = (intmax_t)h->lexeme_count;
+
+    // read-only, nothing is interned after lexing
+    lexer->symbols = (symtab_t*) _KMALLOC(sizeof(symtab_t));
+    if (!lexer->symbols) {
+        lexer_destroy(lexer);
+        return nullptr;
+    }
+    *lexer->symbols = (symtab_t) {
+        .items = (symbol_t*)(base + h->symbols),
+        .capacity = (intmax_t)h->symbol_count,
+        .count = (intmax_t)h->symbol_count,
+        .slots = (uint32_t*)(base + h->slots),
+        .slot_capacity = (intmax_t)h->slot_capacity,
+        .pool = base + h->pool,
+        .pool_size = (intmax_t)h->pool_size,
+        .pool_capacity = (intmax_t)h->pool_size
+    };
+
+    const _lexer_cache_scope_t *records = (const _lexer_cache_scope_t*)(base + h->scopes);
+    int global = 0;
+    for (uint64_t i = 0; i < h->scope_count; i++) {
+        const _lexer_cache_scope_t *record = &records[i];
+        if (!_lexer_cache_scope_consistent(h, base, cache_size, record) || (record->start == -1 && global++)) {
+            lexer_destroy(lexer);
+            return nullptr;
+        }
+
+        scope_t scope = {
+            .name = record->name,
+            .start = record->start,
+            .variables = record->capacity ? (uint32_t*)(base + record->variables) : nullptr,
+            .first = record->capacity ? (int32_t*)(base + record->first) : nullptr,
+            .capacity = (intmax_t)record->capacity,
+            .count = (intmax_t)record->count
+        };
+        if (scope.start == -1) {
+            lexer->global_scope = scope;
+            continue;
+        }
+
+        scopt_list_t *scopes = &lexer->scopes;
+        if (scopes->count >= scopes->capacity) {
+            intmax_t capacity = scopes->capacity ? scopes->capacity * 2 : 8;
+            scope_t **items = (scope_t**) _KREALLOC(scopes->items, sizeof(scope_t*) * capacity);
+            if (!items) {
+                lexer_destroy(lexer);
+                return nullptr;
+            }
+            scopes->items = items;
+            scopes->capacity = capacity;
+        }
+        scope_t *cached = (scope_t*) _KMALLOC(sizeof(scope_t));
+        if (!cached) {
+            lexer_destroy(lexer);
+            return nullptr;
+        }
+        *cached = scope;
+        scopes->items[scopes->count++] = cached;
+    }
+
+    return lexer;
+}
 
 #endif // _KLEXER_IMPLEMENTATION
\ No newline at end of file
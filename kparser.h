@@ -34,19 +34,77 @@ Allocations:
     Allocations happen when:
         - punc_t list (sizeof(punc_t) + initial 
           16x sizeof(punc_t))
-        - initializing the parser_t (sizeof parser_t)
-        - each token (sizeof(token_t) + string length)
+        - punc_compile (one punc_node_t per distinct punctuation prefix)
+        - initializing the parser_t (sizeof parser_t, plus sizeof 
+          parser_stats_t with _KPARSER_STATS)
+        - parser_init_file without mmap (the file size)
+        - parser_feed (a copy of all the input fed so far)
+        - growing the token array (sizeof(token_t) per token), unless the 
+          parser was created with P_SOA (12 bytes per token). It starts out
+          sized for a token every P_TOKEN_HINT bytes of the buffer
+        - token text, unless the parser was created with P_ZEROCOPY. It is 
+          carved from blocks sized from the buffer length (growing up to 
+          P_ARENA_MAX_BLOCK) and all of it is freed at once in parser_destroy
 
 If you want to provide your own assert/malloc/free define before including:
     _KASSERT
     _KMALLOC 
         -> then define _KMALLOC, _KREALLOC and _KFREE for each mem op
+        -> or define KALLOC_KPARSER and include kalloc.h first to track them
+
+SIMD:
+    Whitespace, identifier and quote runs are scanned 32 (AVX2) or 16 (SSSE3, 
+    NEON on aarch64) bytes at a time, picked from the compiler flags 
+    (e.g. -mavx2 or -march=native). Anything else, or defining 
+    _KPARSER_NO_SIMD, uses the scalar lookup table.
+
+Files:
+    parser_init_file uses mmap on unix-likes, define _KPARSER_NO_MMAP to
+    always read the file into memory instead.
+
+Threads:
+    parser_init_parallel uses pthreads (link with -pthread) or win32 threads,
+    define _KPARSER_NO_THREADS to always parse on the calling thread.
+
+Stats:
+    Define _KPARSER_STATS along with _KPARSER_IMPLEMENTATION to count what
+    the scanner does per parser (parser_get_stats) and report phases to a
+    parser_set_phase_callback callback. Without it no counting code is
+    compiled in and parser_get_stats returns 0.
 
 ================================================================================
 
 Changelog
 
 v0.1.1 - Initial public release.
+v0.2.0 - P_ZEROCOPY option, tokens are (offset, len) views into the buffer
+         and parser_token_text/copy/dup access the text on demand.
+       - P_STREAMING option, tokens are scanned on demand with a
+         P_LOOKAHEAD ring for parser_unget_token.
+       - Quoted tokens include their quotes and honour \ escapes, newlines
+         are no longer counted twice and parser_peek_token returns the
+         token parser_get_token would return next.
+       - punc_compile, first-byte table + trie for longest-match
+         punctuation lookups.
+       - SIMD (AVX2/SSSE3/NEON) scanning of whitespace, identifier and
+         quote runs.
+       - parser_init_n for buffers that aren't NUL-terminated.
+       - parser_init_file, mmaps the file (or reads it) and releases it in
+         parser_destroy.
+       - parser_init_feed/parser_feed/parser_finish for input that arrives
+         in chunks.
+       - parser_init_parallel, tokenizes slices of the buffer on threads.
+       - P_SOA option, structure-of-arrays token storage with
+         parser_token_count/parser_token_at/parser_token_ids accessors.
+       - Token text is carved from a per-parser arena and freed in one go.
+       - punc_ignore, regions (comments) skipped straight to their close
+         without being tokenized.
+       - parser_update, incremental rescan of an edited buffer.
+       - _KPARSER_STATS, scanner counters (parser_get_stats) and phase
+         callbacks (parser_set_phase_callback).
+       - parser_reset, tokenizes a new buffer reusing the parser's token
+         array and text arena. The token array starts sized from the buffer
+         length (P_TOKEN_HINT).
 
 ================================================================================
 */
@@ -72,6 +130,33 @@ v0.1.1 - Initial public release.
     #define _KFREE(x) free(x)
 #endif // _KMALLOC
 
+// smallest slice of the buffer parser_init_parallel gives a thread
+#ifndef P_PARALLEL_MIN_CHUNK
+    #define P_PARALLEL_MIN_CHUNK (64 * 1024)
+#endif // P_PARALLEL_MIN_CHUNK
+#define P_PARALLEL_MAX_THREADS 64
+
+// largest block the token text arena allocates at a time
+#ifndef P_ARENA_MAX_BLOCK
+    #define P_ARENA_MAX_BLOCK (64 * 1024 * 1024)
+#endif // P_ARENA_MAX_BLOCK
+
+// bytes of buffer per token the token array is first sized for, a guess
+// too high costs reallocs and one too low memory
+#ifndef P_TOKEN_HINT
+    #define P_TOKEN_HINT 8
+#endif // P_TOKEN_HINT
+
+// how many tokens P_STREAMING keeps around for parser_unget_token
+#ifndef P_LOOKAHEAD
+    #define P_LOOKAHEAD 16
+#endif // P_LOOKAHEAD
+
+// punc_t ids _KPARSER_STATS counts tokens for one by one
+#ifndef P_STATS_IDS
+    #define P_STATS_IDS 256
+#endif // P_STATS_IDS
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -82,10 +167,41 @@ typedef struct {
     int         len; 
 } punc_t;
 
+// byte set, bits for scalar lookups and nibble tables for the SIMD scanner
+typedef struct {
+    uint8_t      bits[32];
+    uint8_t      lo[2][16]; // lo[c >= 0x80][c & 15] has bit ((c >> 4) & 7) set
+} punc_class_t;
+
+// region punc_ignore drops, from a punc_t with the id to the close string
+typedef struct {
+    int          id;
+    const char  *close;
+    int          close_len;
+} punc_ignore_t;
+
+// punc_compile trie node
+typedef struct {
+    int32_t      child;   // first child, -1 if none
+    int32_t      sibling; // next node with the same parent, -1 if none
+    int32_t      punc;    // index of the punc_t ending here, -1 if none
+    char         c;
+} punc_node_t;
+
 typedef struct {
     punc_t      *items;
     intmax_t     capacity;
     intmax_t     count;
+    int          max_len;    // longest punc_t
+    // filled by punc_compile, nodes is nullptr when not compiled
+    punc_node_t *nodes;
+    intmax_t     node_capacity;
+    intmax_t     node_count;
+    int32_t      first[256]; // root node for each first byte, -1 if none
+    punc_class_t stops;      // whitespace + first byte of every punc_t
+    punc_ignore_t *ignores;
+    intmax_t     ignore_count;
+    punc_class_t ignore_starts; // first byte of every punc_t opening an ignored region
 } punc_list_t;
 
 typedef struct {
@@ -102,20 +218,101 @@ typedef struct {
     intmax_t     count;
 } token_list_t;
 
+// block of token text, see _parser_arena_alloc
+typedef struct parser_arena_block_t {
+    struct parser_arena_block_t *next;
+    intmax_t     size;
+    intmax_t     used;
+} parser_arena_block_t;
+
+// P_SOA token storage, lines are kept as runs since most tokens share a line
+typedef struct {
+    int32_t     *ids;
+    uint32_t    *offsets;
+    uint32_t    *lens;
+    intmax_t     capacity;
+    intmax_t     count;
+    uint32_t    *line_starts;  // index of the first token of each run
+    uint32_t    *lines;        // line of each run
+    intmax_t     line_capacity;
+    intmax_t     line_count;
+    intmax_t     line_hint;    // last run looked up
+} token_soa_t;
+
+// _KPARSER_STATS counters, rescans (parser_update, parser_init_parallel 
+// merges) count again
+typedef struct {
+    intmax_t     bytes_scanned;    // bytes the cursor moved over
+    intmax_t     ignored_bytes;    // of those, inside punc_ignore regions
+    intmax_t     quote_bytes;      // of those, inside quoted tokens
+    intmax_t     tokens;
+    intmax_t     identifiers;      // tokens with id -1 (identifiers, quoted slices)
+    intmax_t     tokens_by_id[P_STATS_IDS]; // punc_t tokens by id
+    intmax_t     tokens_other_ids; // punc_t tokens with an id outside [0, P_STATS_IDS)
+    intmax_t     punc_attempts;    // parser_is_punctuation lookups
+    intmax_t     punc_hits;        // of those, found a punc_t
+    intmax_t     token_reallocs;   // token array (tokens.items or soa) growth
+} parser_stats_t;
+
 typedef struct {
     int                  options;
     const char          *buffer;
     const punc_list_t   *punctuation;
     intmax_t             buffer_size;
     token_list_t         tokens;
+    token_soa_t          soa;           // used instead of tokens with P_SOA
     intmax_t             current_token;
+    intmax_t             cursor;        // scan position in the buffer
+    intmax_t             cursor_line;   // line at the scan position
+    intmax_t             produced;      // tokens scanned so far (P_STREAMING)
+    token_t              lookahead[P_LOOKAHEAD];
+    punc_class_t         space_class;
+    punc_class_t         quote_class[2]; // quote + backslash, double then single
+    void                *mapping;       // parser_init_file mmap, unmapped in parser_destroy
+    intmax_t             mapping_size;
+    char                *owned;         // buffer owned by the parser, freed in parser_destroy
+    intmax_t             owned_capacity;
+    int                  incomplete;    // parser_feed input may still arrive
+    intmax_t             resume;        // scan position inside the partial token at the cursor (0 if none)
+    intmax_t             resume_line;
+    parser_arena_block_t *arena;        // token text, newest block first
+    intmax_t             arena_hint;    // buffer bytes the first block is sized for
+    intmax_t             arena_dead;    // bytes of token text no token points at any more
+    int                  failed;        // the last scan ran out of memory (token text or array)
+    parser_stats_t      *stats;         // nullptr without _KPARSER_STATS
 } parser_t;
 
+// phases reported to the parser_set_phase_callback callback
+#define P_PHASE_LOAD          0 // parser_init_file mapping or reading the file (parser is nullptr)
+#define P_PHASE_SCAN          1 // tokenizing (parser_init_n, parser_feed, parser_finish)
+#define P_PHASE_PARALLEL      2 // parser_init_parallel starting threads, the first slice is scanned on the caller's
+#define P_PHASE_MERGE         3 // parser_init_parallel waiting for the other slices and stitching them together
+#define P_PHASE_UPDATE        4 // parser_update rescan and splice
+
+// called with done 0 when a phase starts and 1 when it ends, on the thread
+// that called into the parser
+typedef void (*parser_phase_fn)(void *user, const parser_t *parser, int phase, int done);
+
 // parser_t options
 // parse single quote slices as a whole token
 #define P_ACCEPT_SINGLEQUOTES 0x01  
 // parse double quoted slices as a whole token
 #define P_ACCEPT_DOUBLEQUOTES 0x02  
+// don't copy token text, token_t.token is nullptr and the token is a view
+// (offset, len) into the buffer. Use parser_token_text/copy/dup to access it.
+#define P_ZEROCOPY            0x04
+// tokenize on demand in parser_get_token/parser_peek_token instead of up
+// front, only the last P_LOOKAHEAD tokens are kept (implies P_ZEROCOPY)
+#define P_STREAMING           0x08
+
+// store tokens as separate id/offset/len arrays (parser->soa) instead of
+// token_t structs, less than a third of the memory and id scans can be 
+// vectorized. The buffer must be smaller than 4GB (implies P_ZEROCOPY, not 
+// used with P_STREAMING)
+#define P_SOA                 0x10
+
+// token id when parser_feed has to supply more input first (-2 is EOF)
+#define P_TOKEN_PENDING       -3
 
 //
 // punc_t/Delimiter management
@@ -123,57 +320,442 @@ typedef struct {
 punc_list_t        *punc_init();
 // will calculate the length of the punc_t as well
 void                punc_add(punc_list_t *list, const char *token, int id);
+// build the first-byte table and trie used for longest-match lookups, once
+// compiled the order punctuation was added in no longer matters (later
+// punc_add calls keep it up to date). Out of memory the list is left 
+// uncompiled, matching the first punc_t in the order they were added
+void                punc_compile(punc_list_t *list);
+// drop everything from a punc_t with the id up to and including close (e.g.
+// "//" to "\n" or "/*" to "*/") without tokenizing it, the region runs to 
+// the end of the input if it isn't closed. close isn't copied
+void                punc_ignore(punc_list_t *list, int id, const char *close);
 void                punc_destroy(punc_list_t *list);
 
 //
 // Parsing 
 //
 parser_t           *parser_init(const char *buffer, const punc_list_t *punctuation, int options);
+// parse exactly size bytes, the buffer doesn't need to be NUL-terminated
+parser_t           *parser_init_n(const char *buffer, intmax_t size, const punc_list_t *punctuation, int options);
+// mmap the file (read it without mmap support) and parse it, best used with
+// P_ZEROCOPY so tokens are views into the page cache 
+parser_t           *parser_init_file(const char *path, const punc_list_t *punctuation, int options);
+// split the buffer at newlines and tokenize the slices on nthreads threads,
+// the result is the same as parser_init_n (P_STREAMING parses serially)
+parser_t           *parser_init_parallel(const char *buffer, intmax_t size, const punc_list_t *punctuation, 
+                                         int options, int nthreads);
+// start with no input and push it with parser_feed as it arrives, tokens are
+// available as soon as they are complete (P_TOKEN_PENDING until then) and 
+// parser_finish marks the end of the input. Both return 0 if out of memory,
+// the tokens so far are kept and the next call carries on from there (a 
+// chunk parser_feed couldn't copy isn't kept, feed it again)
+parser_t           *parser_init_feed(const punc_list_t *punctuation, int options);
+int                 parser_feed(parser_t *parser, const char *chunk, intmax_t len);
+int                 parser_finish(parser_t *parser);
+// Apply an edit to the parsed buffer (removed_len bytes at edit_offset 
+// replaced by inserted) and rescan only from the last token before it until
+// the tokens line up with the old ones again, the rest are shifted. The 
+// parser edits its own copy of the buffer, not with P_STREAMING or while 
+// parser_feed input is pending. 0 if out of memory. Without P_ZEROCOPY the
+// token text is moved into one block once more of it belongs to replaced
+// tokens than to live ones, token_t.token of tokens copied out before an
+// update can be invalid after it
+int                 parser_update(parser_t *parser, intmax_t edit_offset, intmax_t removed_len, 
+                                  const char *inserted, intmax_t inserted_len);
+// Tokenize a new buffer (size bytes) with the same punctuation and options.
+// The token array and the largest block of token text are kept, so a buffer
+// that doesn't need more than the last one allocates nothing. Tokens from 
+// before are invalid, a parser_init_file mapping or copy of the input is 
+// released. 0 if out of memory, the parser is left as it was if its token 
+// array couldn't grow and the tokens up to there are kept if the scan ran out
+int                 parser_reset(parser_t *parser, const char *buffer, intmax_t size);
 void                parser_destroy(parser_t *parser);
 
 
 const token_t       parser_get_token(parser_t *parser);   // return the current token and progress the cursor
-void                parser_unget_token(parser_t *parser); // reset to the previous token
-const token_t       parser_peek_token(parser_t *parser);  // peek the next token, but don't move the cursor (-2 if EOF)
+void                parser_unget_token(parser_t *parser); // reset to the previous token (at most P_LOOKAHEAD-1 back if P_STREAMING)
+const token_t       parser_peek_token(parser_t *parser);  // peek the next token, but don't move the cursor (-2 if EOF, P_TOKEN_PENDING if waiting for parser_feed)
 intmax_t            parser_get_line(parser_t *parser);   // get the current line in the script
 int                 parser_is_punctuation(parser_t *parser, intmax_t start_offset);
+intmax_t            parser_token_count(const parser_t *parser);  // tokens scanned so far
+token_t             parser_token_at(parser_t *parser, intmax_t index); // EOF token if out of range
+const int32_t      *parser_token_ids(const parser_t *parser);    // P_SOA id array, nullptr otherwise
+
+//
+// Stats (_KPARSER_STATS)
+//
+// copy the parser's counters into stats, 0 (and stats zeroed) if they aren't
+// compiled in
+int                 parser_get_stats(const parser_t *parser, parser_stats_t *stats);
+// set the callback for every parser (nullptr to remove it), not thread-safe
+// with parsing in progress. Does nothing without _KPARSER_STATS
+void                parser_set_phase_callback(parser_phase_fn callback, void *user);
+
+//
+// Token text (works for both copied and P_ZEROCOPY tokens)
+//
+// pointer to the token in the buffer (not NUL-terminated, nullptr if EOF)
+const char         *parser_token_text(const parser_t *parser, const token_t *token);
+// copy into dest (always NUL-terminated), returns the number of chars copied
+intmax_t            parser_token_copy(const parser_t *parser, const token_t *token, char *dest, intmax_t size);
+// allocate a NUL-terminated copy of the token, release with _KFREE
+char               *parser_token_dup(const parser_t *parser, const token_t *token);
 #ifdef __cplusplus
 };
 #endif // __cplusplus
 
 #endif // _KPARSER_H
 
-#ifdef _KPARSER_IMPLEMENTATION
-// return -1 if not, *index* of the punc_t if it is
-int parser_is_punctuation(parser_t *parser, intmax_t start_offset) 
+#if defined(_KPARSER_IMPLEMENTATION) && !defined(_KPARSER_IMPLEMENTED)
+#define _KPARSER_IMPLEMENTED // klexer.h includes this header again
+
+#include <stdio.h>
+#if !defined(_KPARSER_NO_MMAP) && (defined(__unix__) || defined(__APPLE__))
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+    #define _KP_MMAP
+#endif // _KPARSER_NO_MMAP
+#if !defined(_KPARSER_NO_THREADS)
+    #if defined(_WIN32)
+        #include <windows.h>
+        #define _KP_THREADS_WIN32
+    #elif defined(__unix__) || defined(__APPLE__)
+        #include <pthread.h>
+        #define _KP_THREADS_PTHREAD
+    #endif
+#endif // _KPARSER_NO_THREADS
+
+#if defined(_KPARSER_STATS)
+static parser_phase_fn _parser_phase_callback = nullptr;
+static void *_parser_phase_user = nullptr;
+
+    #define _KP_STAT(p, field, n) ((p)->stats ? (void)((p)->stats->field += (n)) : (void)0)
+    #define _KP_PHASE(p, phase, done) \
+        (_parser_phase_callback ? _parser_phase_callback(_parser_phase_user, p, phase, done) : (void)0)
+#else
+    #define _KP_STAT(p, field, n) ((void)sizeof(n)) // not evaluated
+    #define _KP_PHASE(p, phase, done) ((void)0)
+#endif // _KPARSER_STATS
+
+#if !defined(_KPARSER_NO_SIMD)
+    #if defined(__AVX2__)
+        #include <immintrin.h>
+        #define _KP_SIMD_AVX2
+        #define _KP_SIMD_WIDTH 32
+        #define _KP_SIMD_SHIFT 0 // mask bits per byte (log2)
+    #elif defined(__SSSE3__)
+        #include <tmmintrin.h>
+        #define _KP_SIMD_SSSE3
+        #define _KP_SIMD_WIDTH 16
+        #define _KP_SIMD_SHIFT 0
+    #elif defined(__ARM_NEON) && defined(__aarch64__)
+        #include <arm_neon.h>
+        #define _KP_SIMD_NEON
+        #define _KP_SIMD_WIDTH 16
+        #define _KP_SIMD_SHIFT 2
+    #endif
+#endif // _KPARSER_NO_SIMD
+
+#if defined(_KP_SIMD_WIDTH)
+    #if defined(_MSC_VER) && !defined(__clang__)
+        #include <intrin.h>
+        #define _kp_ctz64(x)      ((int)_tzcnt_u64(x))
+        #define _kp_popcount64(x) ((int)__popcnt64(x))
+    #else
+        #define _kp_ctz64(x)      __builtin_ctzll(x)
+        #define _kp_popcount64(x) __builtin_popcountll(x)
+    #endif
+#endif // _KP_SIMD_WIDTH
+
+static inline int _punc_class_has(const punc_class_t *cls, unsigned char c)
 {
-    intmax_t offset = start_offset;
-    int punc_t = -1;
-    int found_punc = 0;
-    int p_index = 0;
+    return (cls->bits[c >> 3] >> (c & 7)) & 1;
+}
 
-    for (int k = 0; k < parser->punctuation->count; k++) {
-        // first char match
-        if (parser->buffer[offset] == parser->punctuation->items[k].p[p_index]) {
-            found_punc = 1;
-            // match remaining chars
-            while (++offset < parser->buffer_size && ++p_index < parser->punctuation->items[k].len) {
-                if (parser->buffer[offset] != parser->punctuation->items[k].p[p_index]) {
-                    found_punc = 0;
-                    offset = start_offset; // reverse
-                    p_index = 0;
-                    break;
-                }
-            }
+static void _punc_class_add(punc_class_t *cls, unsigned char c)
+{
+    cls->bits[c >> 3] |= (uint8_t)(1 << (c & 7));
+    cls->lo[c >> 7][c & 15] |= (uint8_t)(1 << ((c >> 4) & 7));
+}
 
-            if (found_punc) {
-                punc_t = k;
-                break;
+static void _punc_class_init(punc_class_t *cls, const char *chars)
+{
+    memset(cls, 0, sizeof(punc_class_t));
+    while (*chars) {
+        _punc_class_add(cls, (unsigned char)*chars++);
+    }
+}
+
+#if defined(_KP_SIMD_AVX2)
+// membership mask of 32 bytes, and a mask of the newlines among them
+static inline uint64_t _parser_classify(const punc_class_t *cls, const char *at, uint64_t *newlines)
+{
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    const __m256i bit = _mm256_setr_epi8(
+        1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128,
+        1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+    const __m256i t0 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)cls->lo[0]));
+    const __m256i t1 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)cls->lo[1]));
+
+    __m256i v = _mm256_loadu_si256((const __m256i*)at);
+    __m256i lo = _mm256_and_si256(v, nibble);
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble);
+    __m256i row = _mm256_blendv_epi8(_mm256_shuffle_epi8(t0, lo), _mm256_shuffle_epi8(t1, lo),
+                                     _mm256_cmpgt_epi8(hi, _mm256_set1_epi8(7)));
+    __m256i mask = _mm256_shuffle_epi8(bit, hi);
+    __m256i hit = _mm256_cmpeq_epi8(_mm256_and_si256(row, mask), mask);
+
+    *newlines = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+    return (uint32_t)_mm256_movemask_epi8(hit);
+}
+#elif defined(_KP_SIMD_SSSE3)
+static inline uint64_t _parser_classify(const punc_class_t *cls, const char *at, uint64_t *newlines)
+{
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+    const __m128i bit = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+    const __m128i t0 = _mm_loadu_si128((const __m128i*)cls->lo[0]);
+    const __m128i t1 = _mm_loadu_si128((const __m128i*)cls->lo[1]);
+
+    __m128i v = _mm_loadu_si128((const __m128i*)at);
+    __m128i lo = _mm_and_si128(v, nibble);
+    __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), nibble);
+    __m128i high = _mm_cmpgt_epi8(hi, _mm_set1_epi8(7));
+    __m128i row = _mm_or_si128(_mm_and_si128(high, _mm_shuffle_epi8(t1, lo)),
+                               _mm_andnot_si128(high, _mm_shuffle_epi8(t0, lo)));
+    __m128i mask = _mm_shuffle_epi8(bit, hi);
+    __m128i hit = _mm_cmpeq_epi8(_mm_and_si128(row, mask), mask);
+
+    *newlines = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+    return (uint32_t)_mm_movemask_epi8(hit);
+}
+#elif defined(_KP_SIMD_NEON)
+// NEON has no movemask, the masks have 4 bits per byte
+static inline uint64_t _parser_classify(const punc_class_t *cls, const char *at, uint64_t *newlines)
+{
+    static const uint8_t bits[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+
+    uint8x16_t v = vld1q_u8((const uint8_t*)at);
+    uint8x16_t lo = vandq_u8(v, vdupq_n_u8(0x0f));
+    uint8x16_t hi = vshrq_n_u8(v, 4);
+    uint8x16_t row = vbslq_u8(vcgtq_u8(hi, vdupq_n_u8(7)),
+                              vqtbl1q_u8(vld1q_u8(cls->lo[1]), lo),
+                              vqtbl1q_u8(vld1q_u8(cls->lo[0]), lo));
+    uint8x16_t hit = vtstq_u8(row, vqtbl1q_u8(vld1q_u8(bits), hi));
+    uint8x16_t nl = vceqq_u8(v, vdupq_n_u8('\n'));
+
+    *newlines = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(nl), 4)), 0);
+    return vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(hit), 4)), 0);
+}
+#endif
+
+// Skip bytes while their membership of cls equals member, adding the newlines
+// skipped to *lines. Returns the offset of the first byte that doesn't.
+static inline intmax_t _parser_span(const punc_class_t *cls, int member, const char *buffer, 
+                                    intmax_t i, intmax_t size, intmax_t *lines)
+{
+#if defined(_KP_SIMD_WIDTH)
+    const uint64_t all = ~(uint64_t)0 >> (64 - (_KP_SIMD_WIDTH << _KP_SIMD_SHIFT));
+
+    while (i + _KP_SIMD_WIDTH <= size) {
+        uint64_t newlines;
+        uint64_t stop = _parser_classify(cls, buffer + i, &newlines);
+        if (member) {
+            stop = ~stop & all;
+        }
+
+        if (stop) {
+            int k = _kp_ctz64(stop);
+            *lines += _kp_popcount64(newlines & ((((uint64_t)1) << k) - 1)) >> _KP_SIMD_SHIFT;
+            return i + (k >> _KP_SIMD_SHIFT);
+        }
+
+        *lines += _kp_popcount64(newlines) >> _KP_SIMD_SHIFT;
+        i += _KP_SIMD_WIDTH;
+    }
+#endif // _KP_SIMD_WIDTH
+
+    while (i < size && _punc_class_has(cls, (unsigned char)buffer[i]) == member) {
+        if (buffer[i] == '\n') (*lines)++;
+        i++;
+    }
+
+    return i;
+}
+
+#if defined(_KP_SIMD_AVX2)
+// mask of the bytes equal to c0 and followed by c1, and of the newlines
+static inline uint64_t _parser_pair(const char *at, char c0, char c1, uint64_t *newlines)
+{
+    __m256i a = _mm256_loadu_si256((const __m256i*)at);
+    __m256i b = _mm256_loadu_si256((const __m256i*)(at + 1));
+    __m256i hit = _mm256_and_si256(_mm256_cmpeq_epi8(a, _mm256_set1_epi8(c0)), 
+                                   _mm256_cmpeq_epi8(b, _mm256_set1_epi8(c1)));
+
+    *newlines = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, _mm256_set1_epi8('\n')));
+    return (uint32_t)_mm256_movemask_epi8(hit);
+}
+#elif defined(_KP_SIMD_SSSE3)
+static inline uint64_t _parser_pair(const char *at, char c0, char c1, uint64_t *newlines)
+{
+    __m128i a = _mm_loadu_si128((const __m128i*)at);
+    __m128i b = _mm_loadu_si128((const __m128i*)(at + 1));
+    __m128i hit = _mm_and_si128(_mm_cmpeq_epi8(a, _mm_set1_epi8(c0)), _mm_cmpeq_epi8(b, _mm_set1_epi8(c1)));
+
+    *newlines = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(a, _mm_set1_epi8('\n')));
+    return (uint32_t)_mm_movemask_epi8(hit);
+}
+#elif defined(_KP_SIMD_NEON)
+static inline uint64_t _parser_pair(const char *at, char c0, char c1, uint64_t *newlines)
+{
+    uint8x16_t a = vld1q_u8((const uint8_t*)at);
+    uint8x16_t b = vld1q_u8((const uint8_t*)at + 1);
+    uint8x16_t hit = vandq_u8(vceqq_u8(a, vdupq_n_u8((uint8_t)c0)), vceqq_u8(b, vdupq_n_u8((uint8_t)c1)));
+    uint8x16_t nl = vceqq_u8(a, vdupq_n_u8('\n'));
+
+    *newlines = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(nl), 4)), 0);
+    return vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(hit), 4)), 0);
+}
+#endif
+
+static inline intmax_t _parser_count_lines(const char *buffer, intmax_t i, intmax_t end)
+{
+    intmax_t lines = 0;
+    for (const char *at = buffer + i; 
+         at < buffer + end && (at = (const char*)memchr(at, '\n', buffer + end - at)) != nullptr; at++) {
+        lines++;
+    }
+    return lines;
+}
+
+// Offset of the first close at or after i, adding the newlines before it to
+// *lines. -1 if there's none, the newlines are then those before the last 
+// len-1 bytes (where a close could still start once more input arrives)
+static intmax_t _parser_find(const char *buffer, intmax_t i, intmax_t size, 
+                             const char *close, int len, intmax_t *lines)
+{
+    if (len == 1) {
+        const char *hit = (const char*)memchr(buffer + i, close[0], size - i);
+        intmax_t end = hit ? hit - buffer : size;
+        *lines += _parser_count_lines(buffer, i, end);
+        return hit ? end : -1;
+    }
+
+#if defined(_KP_SIMD_WIDTH)
+    // first two bytes of the close at once, then the rest. Whole chunks stop
+    // short of the last len-1 bytes, their newlines are left to the caller
+    while (i + _KP_SIMD_WIDTH + len - 1 <= size) {
+        uint64_t newlines;
+        uint64_t hits = _parser_pair(buffer + i, close[0], close[1], &newlines);
+
+        while (hits) {
+            int k = _kp_ctz64(hits) >> _KP_SIMD_SHIFT;
+            if (i + k + len <= size && memcmp(buffer + i + k + 2, close + 2, len - 2) == 0) {
+                *lines += _kp_popcount64(newlines & ((((uint64_t)1) << (k << _KP_SIMD_SHIFT)) - 1)) >> _KP_SIMD_SHIFT;
+                return i + k;
             }
+            hits &= ~(((((uint64_t)1) << (1 << _KP_SIMD_SHIFT)) - 1) << (k << _KP_SIMD_SHIFT));
+        }
+
+        *lines += _kp_popcount64(newlines) >> _KP_SIMD_SHIFT;
+        i += _KP_SIMD_WIDTH;
+    }
+#endif // _KP_SIMD_WIDTH
+
+    for (; i + len <= size; i++) {
+        if (buffer[i] == close[0] && memcmp(buffer + i + 1, close + 1, len - 1) == 0) {
+            return i;
+        }
+        if (buffer[i] == '\n') (*lines)++;
+    }
+
+    return -1;
+}
+
+// the ignored region a punc_t at i opens, nullptr if none
+static inline const punc_ignore_t *_parser_ignore(parser_t *p, intmax_t i, int *open_len)
+{
+    const punc_list_t *list = p->punctuation;
+    if (!_punc_class_has(&list->ignore_starts, (unsigned char)p->buffer[i])) {
+        return nullptr;
+    }
+
+    int k = parser_is_punctuation(p, i);
+    if (k < 0) {
+        return nullptr;
+    }
+
+    for (intmax_t r = 0; r < list->ignore_count; r++) {
+        if (list->ignores[r].id == list->items[k].id) {
+            *open_len = list->items[k].len;
+            return &list->ignores[r];
+        }
+    }
+    return nullptr;
+}
+
+// longest match through the compiled trie
+static inline int _punc_match(const punc_list_t *list, const char *at, intmax_t remaining)
+{
+    int32_t node = list->first[(unsigned char)at[0]];
+    int match = -1;
+    intmax_t depth = 0;
+
+    while (node != -1) {
+        if (list->nodes[node].punc >= 0) {
+            match = list->nodes[node].punc;
+        }
+
+        if (++depth >= remaining) {
+            break;
+        }
+
+        int32_t child = list->nodes[node].child;
+        while (child != -1 && list->nodes[child].c != at[depth]) {
+            child = list->nodes[child].sibling;
+        }
+        node = child;
+    }
+
+    return match;
+}
+
+static inline int _parser_punctuation(const parser_t *parser, intmax_t start_offset)
+{
+    const char *at = parser->buffer + start_offset;
+    intmax_t remaining = parser->buffer_size - start_offset;
+
+    if (remaining <= 0) {
+        return -1;
+    }
+
+    if (parser->punctuation->nodes) {
+        return _punc_match(parser->punctuation, at, remaining);
+    }
+
+    // not compiled, first match in the order they were added
+    for (int k = 0; k < parser->punctuation->count; k++) {
+        const punc_t *punc = &parser->punctuation->items[k];
+
+        // first char match, then the remaining chars
+        if (punc->len > 0 && punc->len <= remaining && 
+            at[0] == punc->p[0] && memcmp(at, punc->p, punc->len) == 0) {
+            return k;
         }
     } 
     
-    return punc_t;
+    return -1;
+}
+
+// return -1 if not, *index* of the punc_t if it is
+int parser_is_punctuation(parser_t *parser, intmax_t start_offset) 
+{
+    int match = _parser_punctuation(parser, start_offset);
+    _KP_STAT(parser, punc_attempts, 1);
+    _KP_STAT(parser, punc_hits, match >= 0);
+
+    return match;
 }
 
 punc_list_t *punc_init()
@@ -182,13 +764,119 @@ punc_list_t *punc_init()
     if (list) {
         list->count = 0;
         list->capacity = 16;
+        list->max_len = 0;
         list->items = (punc_t*)_KMALLOC(sizeof(punc_t) * list->capacity);
+        list->nodes = nullptr;
+        list->node_capacity = 0;
+        list->node_count = 0;
+        memset(list->first, 0xff, sizeof(list->first)); // all -1
+        _punc_class_init(&list->stops, " \t\r\n");
+        list->ignores = nullptr;
+        list->ignore_count = 0;
+        _punc_class_init(&list->ignore_starts, "");
         return list;
     }
 
     return nullptr;
 }
 
+// index of a new node, -1 if out of memory
+static int32_t _punc_node(punc_list_t *list, char c)
+{
+    if (list->node_count >= list->node_capacity) {
+        intmax_t capacity = list->node_capacity * 2;
+        punc_node_t *nodes = (punc_node_t*) _KREALLOC(list->nodes, sizeof(punc_node_t) * capacity);
+        if (!nodes) {
+            return -1;
+        }
+        list->nodes = nodes;
+        list->node_capacity = capacity;
+    }
+
+    list->nodes[list->node_count] = (punc_node_t) {
+        .child = -1,
+        .sibling = -1,
+        .punc = -1,
+        .c = c
+    };
+
+    return (int32_t)list->node_count++;
+}
+
+// add items[index] to the trie, 0 if out of memory
+static int _punc_insert(punc_list_t *list, intmax_t index)
+{
+    const punc_t *punc = &list->items[index];
+    if (punc->len <= 0) {
+        return 1;
+    }
+
+    unsigned char first = (unsigned char)punc->p[0];
+    if (list->first[first] == -1) {
+        list->first[first] = _punc_node(list, punc->p[0]);
+        if (list->first[first] == -1) {
+            return 0;
+        }
+    }
+
+    int32_t node = list->first[first];
+    for (int i = 1; i < punc->len; i++) {
+        int32_t child = list->nodes[node].child;
+        while (child != -1 && list->nodes[child].c != punc->p[i]) {
+            child = list->nodes[child].sibling;
+        }
+
+        if (child == -1) {
+            child = _punc_node(list, punc->p[i]);
+            if (child == -1) {
+                return 0;
+            }
+            list->nodes[child].sibling = list->nodes[node].child;
+            list->nodes[node].child = child;
+        }
+        node = child;
+    }
+
+    // duplicates keep the punc_t that was added first
+    if (list->nodes[node].punc == -1) {
+        list->nodes[node].punc = (int32_t)index;
+    }
+    return 1;
+}
+
+// drop the trie, lookups go back to the first match in punc_add order
+static void _punc_uncompile(punc_list_t *list)
+{
+    if (list->nodes) {
+        _KFREE(list->nodes);
+    }
+    list->nodes = nullptr;
+    list->node_capacity = 0;
+    list->node_count = 0;
+    memset(list->first, 0xff, sizeof(list->first)); // all -1
+}
+
+void punc_compile(punc_list_t *list)
+{
+    _KASSERT(list != nullptr);
+
+    _punc_uncompile(list);
+
+    list->node_capacity = 16 + list->count * 2;
+    list->nodes = (punc_node_t*) _KMALLOC(sizeof(punc_node_t) * list->node_capacity);
+    if (!list->nodes) {
+        _punc_uncompile(list);
+        return;
+    }
+
+    for (intmax_t i = 0; i < list->count; i++) {
+        if (!_punc_insert(list, i)) {
+            _punc_uncompile(list);
+            return;
+        }
+    }
+}
+
 void punc_add(punc_list_t *list, const char *token, int id) 
 {
     _KASSERT(list != nullptr);
@@ -203,6 +891,46 @@ void punc_add(punc_list_t *list, const char *token, int id)
         .p = token,
         .len = strlen(token)
     } ;
+
+    if (token[0]) {
+        _punc_class_add(&list->stops, (unsigned char)token[0]);
+        for (intmax_t r = 0; r < list->ignore_count; r++) {
+            if (list->ignores[r].id == id) {
+                _punc_class_add(&list->ignore_starts, (unsigned char)token[0]);
+            }
+        }
+    }
+
+    if (list->items[list->count - 1].len > list->max_len) {
+        list->max_len = list->items[list->count - 1].len;
+    }
+
+    if (list->nodes && !_punc_insert(list, list->count - 1)) {
+        _punc_uncompile(list);
+    }
+}
+
+void punc_ignore(punc_list_t *list, int id, const char *close)
+{
+    _KASSERT(list != nullptr);
+    _KASSERT(close && close[0]);
+
+    punc_ignore_t *ignores = (punc_ignore_t*) _KREALLOC(list->ignores, sizeof(punc_ignore_t) * (list->ignore_count + 1));
+    if (!ignores) {
+        return;
+    }
+    list->ignores = ignores;
+    list->ignores[list->ignore_count++] = (punc_ignore_t) {
+        .id = id,
+        .close = close,
+        .close_len = (int)strlen(close)
+    };
+
+    for (intmax_t k = 0; k < list->count; k++) {
+        if (list->items[k].id == id && list->items[k].len > 0) {
+            _punc_class_add(&list->ignore_starts, (unsigned char)list->items[k].p[0]);
+        }
+    }
 }
 
 void punc_destroy(punc_list_t *list)
@@ -212,204 +940,1556 @@ void punc_destroy(punc_list_t *list)
             _KFREE(list->items);
         }
 
+        if (list->ignores) {
+            _KFREE(list->ignores);
+        }
+
+        if (list->nodes) {
+            _KFREE(list->nodes);
+        }
+
         _KFREE(list);
     }
 }
 
-parser_t *parser_init(const char *buffer, const punc_list_t *punctuation, int options) 
+static inline int _parser_is_space(char c)
 {
-    _KASSERT(punctuation);
-
-    parser_t *p = (parser_t*) _KMALLOC(sizeof(parser_t));
-    if (p) {
-        p->options = options;
-        p->buffer = buffer;
-        p->buffer_size = strlen(buffer);
-        p->punctuation = punctuation;
-        p->tokens.capacity = 255;
-        p->tokens.count = 0;
-        p->tokens.items = (token_t*)_KMALLOC(sizeof(token_t) * p->tokens.capacity);
-        
-        intmax_t current_line = 0, begin_token = 0, end_token = 0;
-        token_t token;
-        
-        // Parse the entire buffer
-        for (intmax_t i = 0; i < p->buffer_size; i++) {
-            while (p->buffer[i] == ' ' && i < p->buffer_size) {
-                i++; // skip starting whitespace
-            }
-
-            if (p->buffer[i] == '\r' && i < p->buffer_size) {
-                i++; // skip \r
-            }
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
 
-            if (p->buffer[i] == '\n') {
-                current_line++;
-            }
+// Carve size bytes of token text out of the parser's arena, a new block twice
+// the size of the last one is added when it runs out.
+static char *_parser_arena_alloc(parser_t *p, intmax_t size)
+{
+    parser_arena_block_t *block = p->arena;
 
-            // are we starting any punctuations
-            int is_punc = parser_is_punctuation(p, i);
-            if (is_punc == -1) {
-                // gobble up until we hit whitespace or another punc_t
-                intmax_t start_offset = i;
-                intmax_t end_offset = start_offset + 1;
-                intmax_t start_line = current_line;
-
-                if (p->options & P_ACCEPT_DOUBLEQUOTES && p->buffer[i] == '"') {
-                    while (i < p->buffer_size) {
-                        int is_escaped = 0;
-                        if (i < p->buffer_size-1 && p->buffer[i-1] == '\\') {
-                            is_escaped = 1;
-                        }
-                        
-                        if (is_escaped == 0 && p->buffer[++i] == '"') break;
-
-                        end_offset++;
-                    }
-                } else if (p->options & P_ACCEPT_SINGLEQUOTES && p->buffer[i] == '\'') {
-                    while (i < p->buffer_size) {
-                        int is_escaped = 0;
-                        if (i < p->buffer_size-1 && p->buffer[i-1] == '\\') {
-                            is_escaped = 1;
-                        }
-                        
-                        if (is_escaped == 0 && p->buffer[++i] == '\'') break;
-
-                        end_offset++;
-                    }
-                } else { 
-                    while (i < p->buffer_size) {
-                        if (p->buffer[i] == '\r' && i < p->buffer_size) i++; // skip \r
-                        if (p->buffer[i] == '\n') current_line++;
-
-                        is_punc = parser_is_punctuation(p, i);
-                        
-                        // delimited by punc_t, reverse so we can track next round
-                        if (is_punc > -1) {
-                            is_punc = -1;
-                            i -= p->punctuation->items[is_punc].len + 1; 
-                            break;
-                        }
-
-                        // we've reached a whitespace break
-                        if (p->buffer[i] == '\n' || p->buffer[i] == '\t' || p->buffer[i] == ' ') break;
-                    
-                        end_offset++;
-                        i++;
-                    }
-                }
-                
-                // normal token
-                if (is_punc < 0) {
-                    token.id = -1;
-                    token.line = start_line;
-                    token.offset = start_offset;
-                    token.len = (end_offset - start_offset) - 1;
-                    token.token = (char*)_KMALLOC(token.len);
-                    
-                    strncpy(token.token, buffer + start_offset, token.len);
-                    token.token[token.len] = '\0';
-                }
-            } 
-
-            if (is_punc >= 0) {
-                token.id = p->punctuation->items[is_punc].id;
-                token.len = p->punctuation->items[is_punc].len;
-                token.offset = i;
-                token.line = current_line;
-                token.token = (char*) _KMALLOC(token.len);
-                strcpy(token.token, p->punctuation->items[is_punc].p);
-
-                if (token.len > 1) {
-                    // increment by the full punc_t size
-                    i += token.len; // -1 because we've already got the first character
-                }
-            } else {
-                if (token.len == 0) continue; // empty tokens
-            }
+    if (!block || block->used + size > block->size) {
+        intmax_t block_size = block ? block->size * 2 : p->arena_hint + p->arena_hint / 2;
+        if (block_size > P_ARENA_MAX_BLOCK) block_size = P_ARENA_MAX_BLOCK;
+        if (block_size < 4096) block_size = 4096;
+        if (block_size < size) block_size = size;
 
-            // Add the token (expand array size if necessary)
-            if (p->tokens.count >= p->tokens.capacity) {
-                p->tokens.capacity *= 2;
-                p->tokens.items = (token_t*) _KREALLOC(p->tokens.items, p->tokens.capacity);
-            }
- 
-            p->tokens.items[p->tokens.count++] = token;
+        block = (parser_arena_block_t*) _KMALLOC(sizeof(parser_arena_block_t) + block_size);
+        if (!block) {
+            return nullptr;
         }
 
-        return p;
+        block->size = block_size;
+        block->used = 0;
+        block->next = p->arena;
+        p->arena = block;
     }
 
-    return nullptr;
+    char *ptr = (char*)(block + 1) + block->used;
+    block->used += size;
+
+    return ptr;
 }
 
-void parser_destroy(parser_t *parser) 
+static void _parser_arena_free(parser_arena_block_t *block)
 {
-    _KASSERT(parser);
-    
-    if (parser->tokens.items) {
-        for (int i = 0; i < parser->tokens.count; i++) {
-            _KFREE(parser->tokens.items[i].token);
-        }
-        _KFREE(parser->tokens.items);
+    while (block) {
+        parser_arena_block_t *next = block->next;
+        _KFREE(block);
+        block = next;
     }
-
-    _KFREE(parser);
-    parser = nullptr;
 }
 
-
-const token_t parser_get_token(parser_t *parser)
+// Move the text of every token into one new block once more of the arena is
+// dead than live (tokens replaced by parser_update or dropped in the
+// parser_init_parallel merge), so it's bounded by the buffer and not by the
+// number of edits. Left as it is if the block can't be allocated.
+static void _parser_arena_compact(parser_t *p)
 {
-    _KASSERT(parser);
+    intmax_t used = 0;
+    for (parser_arena_block_t *block = p->arena; block; block = block->next) {
+        used += block->used;
+    }
+    if (p->arena_dead * 2 <= used || (p->options & P_ZEROCOPY)) {
+        return;
+    }
 
-    if (parser->current_token < parser->tokens.count) {
-        return parser->tokens.items[parser->current_token++];
+    intmax_t live = used - p->arena_dead;
+    intmax_t block_size = live + live / 2; // room for the next edits
+    if (block_size < 4096) block_size = 4096;
+
+    parser_arena_block_t *block = (parser_arena_block_t*) _KMALLOC(sizeof(parser_arena_block_t) + block_size);
+    if (!block) {
+        return;
     }
+    block->size = block_size;
+    block->used = 0;
+    block->next = nullptr;
 
-    const token_t eof_token = {
-        .id = -2,
-        .len = 3,
-        .line = parser->tokens.items[parser->current_token-1].line+1,
-        .offset = parser->tokens.items[parser->current_token-1].offset + parser->tokens.items[parser->current_token-1].len,
-        .token = nullptr
-    };
+    for (intmax_t k = 0; k < p->tokens.count; k++) {
+        token_t *token = &p->tokens.items[k];
+        char *text = (char*)(block + 1) + block->used;
+        memcpy(text, token->token, token->len + 1);
+        token->token = text;
+        block->used += token->len + 1;
+    }
 
-    return eof_token;
+    _parser_arena_free(p->arena);
+    p->arena = block;
+    p->arena_dead = 0;
 }
 
-void parser_unget_token(parser_t *parser)
+// the quote char if c opens a quoted token with the parser's options, 0 if not
+static inline char _parser_quote(const parser_t *p, char c)
 {
-    _KASSERT(parser);
-    if (parser->current_token > 0) {
-        --parser->current_token;
+    if ((p->options & P_ACCEPT_DOUBLEQUOTES && c == '"') ||
+        (p->options & P_ACCEPT_SINGLEQUOTES && c == '\'')) {
+        return c;
     }
+
+    return 0;
 }
 
-const token_t parser_peek_token(parser_t *parser)
+// Scan a single token from the cursor and advance it. Returns 1 for a token,
+// 0 once the end of the buffer has been reached and -1 if parser_feed has to
+// supply more input before the token at the cursor is complete, or with 
+// failed set if its text couldn't be allocated (the cursor stays at it).
+static int _parser_scan(parser_t *p, token_t *token)
 {
-    _KASSERT(parser);
+    const char *buffer = p->buffer;
+    intmax_t size = p->buffer_size;
+    intmax_t i = p->cursor;
+    intmax_t line = p->cursor_line;
 
-    if (parser->current_token < parser->tokens.count) {
-        return parser->tokens.items[parser->current_token + 1];
+    // skip whitespace, and ignored regions straight to their close
+    i = _parser_span(&p->space_class, 1, buffer, i, size, &line);
+    while (p->punctuation->ignore_count && i < size) {
+        int open_len = 0;
+        const punc_ignore_t *ignore = _parser_ignore(p, i, &open_len);
+        if (!ignore || (p->incomplete && i + p->punctuation->max_len > size)) {
+            break; // not one, or the punc_t could still grow
+        }
+
+        intmax_t open_line = line;
+        intmax_t from = i + open_len;
+        if (p->resume > i) {
+            // carry on where the last parser_feed stopped looking
+            from = p->resume;
+            line = p->resume_line;
+        }
+        p->resume = 0;
+
+        intmax_t end = _parser_find(buffer, from, size, ignore->close, ignore->close_len, &line);
+        if (end < 0) {
+            intmax_t tail = size - (ignore->close_len - 1);
+            if (p->incomplete) {
+                _KP_STAT(p, bytes_scanned, i - p->cursor);
+                p->cursor = i;
+                p->cursor_line = open_line;
+                p->resume = tail > from ? tail : from;
+                p->resume_line = line;
+                return -1;
+            }
+            line += _parser_count_lines(buffer, tail > from ? tail : from, size);
+            end = size;
+        } else {
+            line += _parser_count_lines(ignore->close, 0, ignore->close_len);
+            end += ignore->close_len;
+        }
+        _KP_STAT(p, ignored_bytes, end - i);
+
+        i = _parser_span(&p->space_class, 1, buffer, end, size, &line);
+    }
+
+    _KP_STAT(p, bytes_scanned, i - p->cursor);
+    p->cursor = i;
+    p->cursor_line = line;
+
+    if (i >= size) {
+        return p->incomplete ? -1 : 0;
+    }
+
+    token->id = -1;
+    token->offset = i;
+    token->line = line;
+
+    intmax_t start = i;
+    int is_punc = -1;
+    int more = 0; // the token runs into the end of the input
+    char quote = 0;
+
+    if (p->resume > start) {
+        // carry on with the partial token the last parser_feed stopped in
+        quote = _parser_quote(p, buffer[start]);
+        i = p->resume;
+        line = p->resume_line;
+    } else {
+        is_punc = parser_is_punctuation(p, i);
+        if (is_punc < 0) {
+            quote = _parser_quote(p, buffer[i]);
+            if (quote) i++;
+        }
     }
+    p->resume = 0;
+
+    if (is_punc >= 0) {
+        token->id = p->punctuation->items[is_punc].id;
+        i += p->punctuation->items[is_punc].len;
+        more = i >= size; // could still grow into a longer punc_t
+    } else if (quote) {
+        // the whole quoted slice (quotes included) is the token
+        const punc_class_t *quote_class = &p->quote_class[quote == '"' ? 0 : 1];
+        more = 1;
+
+        while (i < size) {
+            i = _parser_span(quote_class, 0, buffer, i, size, &line);
+            if (i >= size) break;
+
+            if (buffer[i] == quote) {
+                i++; // closing quote
+                more = 0;
+                break;
+            }
+
+            // skip the escaped char, a trailing backslash waits for it
+            if (i + 1 >= size) {
+                if (!p->incomplete) i++;
+                break;
+            }
+
+            if (buffer[i + 1] == '\n') line++;
+            i += 2;
+        }
+        _KP_STAT(p, quote_bytes, i - start);
+    } else { 
+        // gobble up until we hit whitespace or another punc_t, only bytes 
+        // that can start a punc_t need the full check
+        for (;;) {
+            i = _parser_span(&p->punctuation->stops, 0, buffer, i, size, &line);
+            if (i >= size || _parser_is_space(buffer[i]) || parser_is_punctuation(p, i) != -1) break;
+            i++;
+        }
+        more = i >= size;
+    }
+
+    intmax_t max_len = p->punctuation->max_len;
+    if (p->incomplete && (more || start + max_len > size)) {
+        // a token starting less than max_len bytes from the end may still turn
+        // into a (longer) punc_t. Otherwise remember how far we got, the last
+        // max_len-1 bytes of an identifier could still begin a punc_t
+        if (more && is_punc < 0 && start + max_len <= size) {
+            intmax_t resume = quote ? i : size - (max_len > 1 ? max_len - 1 : 0);
+            if (resume > start) {
+                p->resume = resume;
+                p->resume_line = line;
+            }
+        }
+
+        return -1;
+    }
+
+    token->len = i - token->offset;
+    token->token = nullptr;
+
+    if (!(p->options & P_ZEROCOPY)) {
+        token->token = _parser_arena_alloc(p, token->len + 1);
+        if (!token->token) {
+            p->failed = 1;
+            return -1;
+        }
+        memcpy(token->token, buffer + token->offset, token->len);
+        token->token[token->len] = '\0';
+    }
+
+#if defined(_KPARSER_STATS)
+    if (p->stats) {
+        p->stats->bytes_scanned += i - p->cursor;
+        p->stats->tokens++;
+        if (token->id == -1) {
+            p->stats->identifiers++;
+        } else if (token->id >= 0 && token->id < P_STATS_IDS) {
+            p->stats->tokens_by_id[token->id]++;
+        } else {
+            p->stats->tokens_other_ids++;
+        }
+    }
+#endif // _KPARSER_STATS
+
+    p->cursor = i;
+    p->cursor_line = line;
+
+    return 1;
+}
+
+// room for needed line runs, 0 if the arrays couldn't grow (they're kept as
+// they were)
+static int _parser_soa_reserve_lines(token_soa_t *soa, intmax_t needed)
+{
+    if (needed <= soa->line_capacity) {
+        return 1;
+    }
+
+    intmax_t capacity = soa->line_capacity;
+    while (capacity < needed) capacity *= 2;
+    uint32_t *line_starts = (uint32_t*) _KREALLOC(soa->line_starts, sizeof(uint32_t) * capacity);
+    if (line_starts) soa->line_starts = line_starts;
+    uint32_t *lines = line_starts ? (uint32_t*) _KREALLOC(soa->lines, sizeof(uint32_t) * capacity) : nullptr;
+    if (!lines) {
+        return 0;
+    }
+    soa->lines = lines;
+    soa->line_capacity = capacity;
+    return 1;
+}
+
+// 0 if the arrays couldn't grow (they're kept as they were)
+static int _parser_soa_push(parser_t *p, const token_t *token)
+{
+    token_soa_t *soa = &p->soa;
+    _KASSERT(token->offset + token->len <= UINT32_MAX);
+
+    if (soa->count >= soa->capacity) {
+        intmax_t capacity = soa->capacity * 2;
+        _KP_STAT(p, token_reallocs, 1);
+        int32_t *ids = (int32_t*) _KREALLOC(soa->ids, sizeof(int32_t) * capacity);
+        if (ids) soa->ids = ids;
+        uint32_t *offsets = ids ? (uint32_t*) _KREALLOC(soa->offsets, sizeof(uint32_t) * capacity) : nullptr;
+        if (offsets) soa->offsets = offsets;
+        uint32_t *lens = offsets ? (uint32_t*) _KREALLOC(soa->lens, sizeof(uint32_t) * capacity) : nullptr;
+        if (!lens) {
+            return 0;
+        }
+        soa->lens = lens;
+        soa->capacity = capacity;
+    }
+
+    // start a new run when the line changes
+    if (soa->line_count == 0 || soa->lines[soa->line_count - 1] != (uint32_t)token->line) {
+        if (!_parser_soa_reserve_lines(soa, soa->line_count + 1)) {
+            return 0;
+        }
+
+        soa->line_starts[soa->line_count] = (uint32_t)soa->count;
+        soa->lines[soa->line_count++] = (uint32_t)token->line;
+    }
+
+    soa->ids[soa->count] = token->id;
+    soa->offsets[soa->count] = (uint32_t)token->offset;
+    soa->lens[soa->count] = (uint32_t)token->len;
+    soa->count++;
+    return 1;
+}
 
+static intmax_t _parser_soa_line(parser_t *p, intmax_t index)
+{
+    token_soa_t *soa = &p->soa;
+    intmax_t run = soa->line_hint;
+
+    // mostly walking forward, so try the last run and the one after it first
+    if (run >= soa->line_count || soa->line_starts[run] > index) {
+        run = 0;
+    }
+    if (run + 1 < soa->line_count && soa->line_starts[run + 1] <= index) {
+        run++;
+    }
+
+    if (run + 1 < soa->line_count && soa->line_starts[run + 1] <= index) {
+        intmax_t lo = run + 1, hi = soa->line_count - 1;
+        while (lo < hi) {
+            intmax_t mid = lo + (hi - lo + 1) / 2;
+            if (soa->line_starts[mid] <= index) {
+                lo = mid;
+            } else {
+                hi = mid - 1;
+            }
+        }
+        run = lo;
+    }
+
+    soa->line_hint = run;
+    return soa->lines[run];
+}
+
+// Add a scanned token. If the array can't grow it fails the parser with the
+// cursor back at the token, so a later parser_feed scans it again.
+static int _parser_push(parser_t *p, const token_t *token)
+{
+    if (p->options & P_SOA) {
+        if (_parser_soa_push(p, token)) {
+            return 1;
+        }
+    } else {
+        // Add the token (expand array size if necessary)
+        if (p->tokens.count >= p->tokens.capacity) {
+            intmax_t capacity = p->tokens.capacity * 2;
+            _KP_STAT(p, token_reallocs, 1);
+            token_t *items = (token_t*) _KREALLOC(p->tokens.items, sizeof(token_t) * capacity);
+            if (items) {
+                p->tokens.items = items;
+                p->tokens.capacity = capacity;
+            }
+        }
+
+        if (p->tokens.count < p->tokens.capacity) {
+            p->tokens.items[p->tokens.count++] = *token;
+            return 1;
+        }
+    }
+
+    if (token->token) {
+        p->arena_dead += token->len + 1;
+    }
+    p->cursor = token->offset;
+    p->cursor_line = token->line;
+    p->failed = 1;
+    return 0;
+}
+
+// Get the token at index, scanning ahead if P_STREAMING. Returns 0 if the
+// index is past the last token and -1 if it is waiting for parser_feed.
+static int _parser_fetch(parser_t *p, intmax_t index, token_t *token)
+{
+    if (p->options & P_STREAMING) {
+        while (p->produced <= index) {
+            token_t next;
+            int scanned = _parser_scan(p, &next);
+            if (scanned <= 0) {
+                return scanned;
+            }
+
+            p->lookahead[p->produced++ % P_LOOKAHEAD] = next;
+        }
+
+        // fell out of the lookahead window
+        _KASSERT(index >= p->produced - P_LOOKAHEAD);
+
+        *token = p->lookahead[index % P_LOOKAHEAD];
+        return 1;
+    }
+
+    if (p->options & P_SOA) {
+        if (index < p->soa.count) {
+            token->id = p->soa.ids[index];
+            token->offset = p->soa.offsets[index];
+            token->len = p->soa.lens[index];
+            token->line = _parser_soa_line(p, index);
+            token->token = nullptr;
+            return 1;
+        }
+    } else if (index < p->tokens.count) {
+        *token = p->tokens.items[index];
+        return 1;
+    }
+
+    return p->incomplete ? -1 : 0;
+}
+
+// scan everything available into the token list, 0 if out of memory
+static int _parser_drain(parser_t *p)
+{
+    if (p->options & P_STREAMING) {
+        return 1; // tokens are scanned in parser_get_token/parser_peek_token
+    }
+
+    _KP_PHASE(p, P_PHASE_SCAN, 0);
+    token_t token;
+    p->failed = 0;
+    while (_parser_scan(p, &token) > 0 && _parser_push(p, &token)) {
+    }
+    _KP_PHASE(p, P_PHASE_SCAN, 1);
+    return !p->failed;
+}
+
+// initial token array capacity for a buffer of size bytes
+static inline intmax_t _parser_token_hint(intmax_t size)
+{
+    intmax_t capacity = size / P_TOKEN_HINT;
+    return capacity > 255 ? capacity : 255;
+}
+
+static token_t _parser_eof_token(const parser_t *p)
+{
     const token_t eof_token = {
-        .id = -2,
-        .len = 3,
-        .line = parser->tokens.items[parser->current_token-1].line+1,
-        .offset = parser->tokens.items[parser->current_token-1].offset + parser->tokens.items[parser->current_token-1].len,
+        .id = p->incomplete ? P_TOKEN_PENDING : -2,
+        .len = 0,
+        .line = p->cursor_line,
+        .offset = p->cursor,
         .token = nullptr
     };
 
     return eof_token;
 }
 
+parser_t *parser_init(const char *buffer, const punc_list_t *punctuation, int options) 
+{
+    _KASSERT(buffer);
+
+    return parser_init_n(buffer, strlen(buffer), punctuation, options);
+}
+
+parser_t *parser_init_n(const char *buffer, intmax_t size, const punc_list_t *punctuation, int options) 
+{
+    _KASSERT(punctuation);
+    _KASSERT(buffer || size == 0);
+    _KASSERT(size >= 0);
+
+    parser_t *p = (parser_t*) _KMALLOC(sizeof(parser_t));
+    if (p) {
+        if (options & P_STREAMING) {
+            options &= ~P_SOA;
+        }
+        if (options & (P_STREAMING | P_SOA)) {
+            options |= P_ZEROCOPY; // nothing would own the copies
+        }
+
+        p->options = options;
+        p->buffer = buffer;
+        p->buffer_size = size;
+        p->punctuation = punctuation;
+        p->current_token = 0;
+        p->cursor = 0;
+        p->cursor_line = 0;
+        p->produced = 0;
+        p->tokens.capacity = 0;
+        p->tokens.count = 0;
+        p->tokens.items = nullptr;
+        memset(&p->soa, 0, sizeof(token_soa_t));
+        p->mapping = nullptr;
+        p->mapping_size = 0;
+        p->owned = nullptr;
+        p->owned_capacity = 0;
+        p->incomplete = 0;
+        p->resume = 0;
+        p->resume_line = 0;
+        p->arena = nullptr;
+        p->arena_hint = size;
+        p->arena_dead = 0;
+        p->failed = 0;
+        p->stats = nullptr;
+#if defined(_KPARSER_STATS)
+        p->stats = (parser_stats_t*)_KMALLOC(sizeof(parser_stats_t));
+        if (p->stats) {
+            memset(p->stats, 0, sizeof(parser_stats_t));
+        }
+#endif // _KPARSER_STATS
+        _punc_class_init(&p->space_class, " \t\r\n");
+        _punc_class_init(&p->quote_class[0], "\"\\");
+        _punc_class_init(&p->quote_class[1], "'\\");
+
+        if (options & P_SOA) {
+            _KASSERT(size <= UINT32_MAX);
+            p->soa.capacity = _parser_token_hint(size);
+            p->soa.ids = (int32_t*)_KMALLOC(sizeof(int32_t) * p->soa.capacity);
+            p->soa.offsets = (uint32_t*)_KMALLOC(sizeof(uint32_t) * p->soa.capacity);
+            p->soa.lens = (uint32_t*)_KMALLOC(sizeof(uint32_t) * p->soa.capacity);
+            p->soa.line_capacity = 16;
+            p->soa.line_starts = (uint32_t*)_KMALLOC(sizeof(uint32_t) * p->soa.line_capacity);
+            p->soa.lines = (uint32_t*)_KMALLOC(sizeof(uint32_t) * p->soa.line_capacity);
+            p->failed = !p->soa.ids || !p->soa.offsets || !p->soa.lens || !p->soa.line_starts || !p->soa.lines;
+        } else if (!(options & P_STREAMING)) {
+            p->tokens.capacity = _parser_token_hint(size);
+            p->tokens.items = (token_t*)_KMALLOC(sizeof(token_t) * p->tokens.capacity);
+            p->failed = !p->tokens.items;
+        }
+        
+        // Parse the entire buffer
+        if (p->failed || !_parser_drain(p)) {
+            parser_destroy(p);
+            return nullptr;
+        }
+
+        return p;
+    }
+
+    return nullptr;
+}
+
+parser_t *parser_init_file(const char *path, const punc_list_t *punctuation, int options)
+{
+    _KASSERT(path);
+
+#if defined(_KP_MMAP)
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return nullptr;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return nullptr;
+    }
+
+    _KP_PHASE(nullptr, P_PHASE_LOAD, 0);
+    void *mapping = nullptr;
+    if (st.st_size > 0) {
+        mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping == MAP_FAILED) {
+            _KP_PHASE(nullptr, P_PHASE_LOAD, 1);
+            close(fd);
+            return nullptr;
+        }
+#if defined(MADV_SEQUENTIAL)
+        madvise(mapping, st.st_size, MADV_SEQUENTIAL);
+#endif // MADV_SEQUENTIAL
+    }
+    close(fd); // the mapping stays valid
+    _KP_PHASE(nullptr, P_PHASE_LOAD, 1);
+
+    parser_t *p = parser_init_n((const char*)mapping, st.st_size, punctuation, options);
+    if (p) {
+        p->mapping = mapping;
+        p->mapping_size = st.st_size;
+    } else if (mapping) {
+        munmap(mapping, st.st_size);
+    }
+
+    return p;
+#else
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        return nullptr;
+    }
+
+    _KP_PHASE(nullptr, P_PHASE_LOAD, 0);
+    intmax_t size = -1;
+    if (fseek(file, 0, SEEK_END) == 0) {
+        size = ftell(file);
+        rewind(file);
+    }
+
+    char *buffer = size >= 0 ? (char*)_KMALLOC(size + 1) : nullptr;
+    int loaded = buffer && (intmax_t)fread(buffer, 1, size, file) == size;
+    fclose(file);
+    _KP_PHASE(nullptr, P_PHASE_LOAD, 1);
+    if (!loaded) {
+        if (buffer) _KFREE(buffer);
+        return nullptr;
+    }
+
+    parser_t *p = parser_init_n(buffer, size, punctuation, options);
+    if (p) {
+        p->owned = buffer;
+        p->owned_capacity = size + 1;
+    } else {
+        _KFREE(buffer);
+    }
+
+    return p;
+#endif // _KP_MMAP
+}
+
+// parser_init_parallel slice of the buffer
+typedef struct {
+    parser_t             parser;    // copy of the main parser scanning this slice
+    intmax_t             start;     // just after a newline (or 0)
+    intmax_t             end;       // start of the next slice
+    intmax_t             last;      // end of the last token that starts in the slice
+    intmax_t             last_line; // line at last, relative to start
+    intmax_t             lines;     // newlines in [start, end)
+#if defined(_KPARSER_STATS)
+    parser_stats_t       stats;     // added to the main parser's in the merge
+#endif // _KPARSER_STATS
+} _parser_chunk_t;
+
+#if defined(_KPARSER_STATS)
+static void _parser_stats_add(parser_stats_t *to, const parser_stats_t *from)
+{
+    to->bytes_scanned += from->bytes_scanned;
+    to->ignored_bytes += from->ignored_bytes;
+    to->quote_bytes += from->quote_bytes;
+    to->tokens += from->tokens;
+    to->identifiers += from->identifiers;
+    for (int k = 0; k < P_STATS_IDS; k++) {
+        to->tokens_by_id[k] += from->tokens_by_id[k];
+    }
+    to->tokens_other_ids += from->tokens_other_ids;
+    to->punc_attempts += from->punc_attempts;
+    to->punc_hits += from->punc_hits;
+    to->token_reallocs += from->token_reallocs;
+}
+#endif // _KPARSER_STATS
+
+// Tokenize a slice assuming it doesn't start inside a token, the merge in
+// parser_init_parallel checks that assumption.
+static void _parser_scan_chunk(_parser_chunk_t *c)
+{
+    parser_t *w = &c->parser;
+    
+    c->lines = 0;
+    for (const char *at = w->buffer + c->start, *end = w->buffer + c->end; 
+         (at = (const char*)memchr(at, '\n', end - at)) != nullptr; at++) {
+        c->lines++;
+    }
+
+    c->last = c->start;
+    c->last_line = 0;
+
+    token_t token;
+    while (!w->failed) {
+        intmax_t from = w->cursor;
+        w->cursor = _parser_span(&w->space_class, 1, w->buffer, w->cursor, w->buffer_size, &w->cursor_line);
+        _KP_STAT(w, bytes_scanned, w->cursor - from);
+        if (w->cursor >= c->end) {
+            break;
+        }
+        if (_parser_scan(w, &token) <= 0) {
+            // an ignored region (comment) can run past the slice to the end
+            c->last = w->cursor;
+            c->last_line = w->cursor_line;
+            break;
+        }
+
+        if (!_parser_push(w, &token)) {
+            break;
+        }
+        c->last = w->cursor;
+        c->last_line = w->cursor_line;
+    }
+}
+
+#if defined(_KP_THREADS_WIN32)
+static DWORD WINAPI _parser_chunk_thread(LPVOID arg)
+{
+    _parser_scan_chunk((_parser_chunk_t*)arg);
+    return 0;
+}
+#elif defined(_KP_THREADS_PTHREAD)
+static void *_parser_chunk_thread(void *arg)
+{
+    _parser_scan_chunk((_parser_chunk_t*)arg);
+    return nullptr;
+}
+#endif
+
+parser_t *parser_init_parallel(const char *buffer, intmax_t size, const punc_list_t *punctuation, 
+                               int options, int nthreads)
+{
+    _KASSERT(punctuation);
+    _KASSERT(buffer || size == 0);
+
+    if (nthreads > size / P_PARALLEL_MIN_CHUNK) {
+        nthreads = (int)(size / P_PARALLEL_MIN_CHUNK);
+    }
+    if (nthreads > P_PARALLEL_MAX_THREADS) {
+        nthreads = P_PARALLEL_MAX_THREADS;
+    }
+
+    // the merge counts lines by newlines, which a punc_t could hide
+    for (intmax_t k = 0; k < punctuation->count && nthreads > 1; k++) {
+        if (memchr(punctuation->items[k].p, '\n', punctuation->items[k].len)) {
+            nthreads = 1;
+        }
+    }
+
+    if (nthreads <= 1 || (options & P_STREAMING)) {
+        return parser_init_n(buffer, size, punctuation, options);
+    }
+
+    parser_t *p = parser_init_n(buffer, 0, punctuation, options);
+    _parser_chunk_t *chunks = (_parser_chunk_t*)_KMALLOC(sizeof(_parser_chunk_t) * nthreads);
+    if (!p || !chunks) {
+        if (p) parser_destroy(p);
+        if (chunks) _KFREE(chunks);
+        return nullptr;
+    }
+    p->buffer_size = size;
+
+    // slices start right after a newline
+    int count = 0;
+    for (int t = 0; t < nthreads; t++) {
+        intmax_t start = 0;
+        if (t > 0) {
+            start = size / nthreads * t;
+            if (start <= chunks[count - 1].start) continue;
+
+            const char *nl = (const char*)memchr(buffer + start, '\n', size - start);
+            if (!nl) break;
+            start = (nl - buffer) + 1;
+            chunks[count - 1].end = start;
+        }
+
+        _parser_chunk_t *c = &chunks[count++];
+        c->parser = *p;
+        c->parser.options &= ~P_SOA; // merged into the soa arrays below
+        c->parser.arena = nullptr;
+        c->parser.arena_hint = size / nthreads;
+        c->parser.cursor = start;
+        c->parser.cursor_line = 0;
+        c->parser.tokens.count = 0;
+        c->parser.tokens.capacity = (size / nthreads) / P_TOKEN_HINT + 16;
+        c->parser.tokens.items = (token_t*)_KMALLOC(sizeof(token_t) * c->parser.tokens.capacity);
+        c->parser.failed = !c->parser.tokens.items;
+        c->parser.stats = nullptr;
+#if defined(_KPARSER_STATS)
+        memset(&c->stats, 0, sizeof(parser_stats_t));
+        if (p->stats) {
+            c->parser.stats = &c->stats;
+        }
+#endif // _KPARSER_STATS
+        c->start = start;
+        c->end = size;
+    }
+
+#if defined(_KP_THREADS_WIN32)
+    HANDLE threads[P_PARALLEL_MAX_THREADS];
+#elif defined(_KP_THREADS_PTHREAD)
+    pthread_t threads[P_PARALLEL_MAX_THREADS];
+#endif
+    int spawned[P_PARALLEL_MAX_THREADS] = { 0 };
+
+    _KP_PHASE(p, P_PHASE_PARALLEL, 0);
+    for (int t = 1; t < count; t++) {
+#if defined(_KP_THREADS_WIN32)
+        threads[t] = CreateThread(NULL, 0, _parser_chunk_thread, &chunks[t], 0, NULL);
+        spawned[t] = threads[t] != NULL;
+#elif defined(_KP_THREADS_PTHREAD)
+        spawned[t] = pthread_create(&threads[t], NULL, _parser_chunk_thread, &chunks[t]) == 0;
+#endif
+        if (!spawned[t]) {
+            _parser_scan_chunk(&chunks[t]);
+        }
+    }
+    _parser_scan_chunk(&chunks[0]);
+    _KP_PHASE(p, P_PHASE_PARALLEL, 1);
+
+    // Stitch the slices together in order. A slice is only valid if the
+    // previous one ended before it started, otherwise (a quote ran across the
+    // newline) rescan from where the previous token ended until we land on a
+    // token the slice also found, everything after that is identical.
+    intmax_t pos = 0, pos_line = 0, base_line = 0;
+    int failed = 0; // a slice or the rescan ran out of memory, the threads are still joined
+    _KP_PHASE(p, P_PHASE_MERGE, 0);
+    for (int t = 0; t < count; t++) {
+        if (spawned[t]) {
+#if defined(_KP_THREADS_WIN32)
+            WaitForSingleObject(threads[t], INFINITE);
+            CloseHandle(threads[t]);
+#elif defined(_KP_THREADS_PTHREAD)
+            pthread_join(threads[t], NULL);
+#endif
+        }
+
+        _parser_chunk_t *c = &chunks[t];
+        token_list_t *tokens = &c->parser.tokens;
+        intmax_t first = 0;
+        int rescanned = pos > c->start;
+        failed |= c->parser.failed;
+#if defined(_KPARSER_STATS)
+        if (p->stats) {
+            _parser_stats_add(p->stats, &c->stats);
+        }
+#endif // _KPARSER_STATS
+
+        if (rescanned && !failed) {
+            first = -1;
+            p->cursor = pos;
+            p->cursor_line = pos_line;
+
+            token_t token;
+            intmax_t candidate = 0;
+            for (;;) {
+                intmax_t from = p->cursor;
+                p->cursor = _parser_span(&p->space_class, 1, p->buffer, p->cursor, p->buffer_size, &p->cursor_line);
+                _KP_STAT(p, bytes_scanned, p->cursor - from);
+                if (p->cursor >= c->end) break;
+
+                while (candidate < tokens->count && tokens->items[candidate].offset < p->cursor) {
+                    candidate++;
+                }
+                if (candidate < tokens->count && tokens->items[candidate].offset == p->cursor) {
+                    first = candidate;
+                    break;
+                }
+
+                int scanned = _parser_scan(p, &token);
+                if (scanned > 0 && !_parser_push(p, &token)) scanned = -1;
+                pos = p->cursor;
+                pos_line = p->cursor_line;
+                if (scanned <= 0) {
+                    failed |= p->failed;
+                    break;
+                }
+            }
+
+            if (first < 0) {
+                first = tokens->count;
+            }
+        }
+
+        if (failed) {
+            // only joining the rest and collecting their token text
+        } else if (p->options & P_SOA) {
+            for (intmax_t k = first; k < tokens->count && !failed; k++) {
+                tokens->items[k].line += base_line;
+                failed = !_parser_soa_push(p, &tokens->items[k]);
+            }
+        } else if (tokens->count > first) {
+            intmax_t accepted = tokens->count - first;
+            if (p->tokens.count + accepted > p->tokens.capacity) {
+                intmax_t capacity = p->tokens.capacity;
+                while (p->tokens.count + accepted > capacity) {
+                    capacity *= 2;
+                }
+                _KP_STAT(p, token_reallocs, 1);
+                token_t *items = (token_t*) _KREALLOC(p->tokens.items, sizeof(token_t) * capacity);
+                if (items) {
+                    p->tokens.items = items;
+                    p->tokens.capacity = capacity;
+                }
+            }
+
+            if (p->tokens.count + accepted > p->tokens.capacity) {
+                failed = 1; // the token array couldn't grow
+            } else {
+                token_t *dest = p->tokens.items + p->tokens.count;
+                memcpy(dest, tokens->items + first, sizeof(token_t) * accepted);
+                for (intmax_t k = 0; k < accepted; k++) {
+                    dest[k].line += base_line;
+                }
+                p->tokens.count += accepted;
+            }
+        }
+
+        // the slice's own scan is right from first on, and so is where it
+        // stopped even without tokens (an ignored region or quote running on
+        // into the next slices)
+        if (tokens->count > first || (!rescanned && c->last > pos)) {
+            pos = c->last;
+            pos_line = c->last_line + base_line;
+        }
+
+        base_line += c->lines;
+        if (!(p->options & P_ZEROCOPY)) {
+            for (intmax_t k = 0; k < first && k < tokens->count; k++) {
+                p->arena_dead += tokens->items[k].len + 1;
+            }
+        }
+        if (tokens->items) {
+            _KFREE(tokens->items);
+        }
+
+        // the slice's token text (used or not) now belongs to the parser
+        if (c->parser.arena) {
+            parser_arena_block_t *tail = c->parser.arena;
+            while (tail->next) {
+                tail = tail->next;
+            }
+
+            if (p->arena) {
+                tail->next = p->arena->next;
+                p->arena->next = c->parser.arena;
+            } else {
+                p->arena = c->parser.arena;
+            }
+        }
+    }
+
+    _KP_PHASE(p, P_PHASE_MERGE, 1);
+
+    p->cursor = size;
+    p->cursor_line = base_line;
+    _KFREE(chunks);
+
+    if (failed) {
+        parser_destroy(p);
+        return nullptr;
+    }
+    _parser_arena_compact(p);
+
+    return p;
+}
+
+parser_t *parser_init_feed(const punc_list_t *punctuation, int options)
+{
+    parser_t *p = parser_init_n(nullptr, 0, punctuation, options);
+    if (p) {
+        p->incomplete = 1;
+    }
+
+    return p;
+}
+
+int parser_feed(parser_t *parser, const char *chunk, intmax_t len)
+{
+    _KASSERT(parser && parser->incomplete);
+    _KASSERT(chunk || len == 0);
+
+    if (parser->buffer_size + len > parser->owned_capacity) {
+        intmax_t capacity = parser->owned_capacity > 0 ? parser->owned_capacity : 4096;
+        while (capacity < parser->buffer_size + len) {
+            capacity *= 2;
+        }
+
+        char *owned = (char*) _KREALLOC(parser->owned, capacity);
+        if (!owned) {
+            return 0;
+        }
+        parser->owned = owned;
+        parser->owned_capacity = capacity;
+    }
+
+    if (len > 0) {
+        memcpy(parser->owned + parser->buffer_size, chunk, len);
+    }
+    parser->buffer = parser->owned;
+    parser->buffer_size += len;
+    parser->arena_hint = parser->buffer_size;
+
+    return _parser_drain(parser);
+}
+
+int parser_finish(parser_t *parser)
+{
+    _KASSERT(parser);
+
+    parser->incomplete = 0;
+    return _parser_drain(parser);
+}
+
+// index of the first token ending at or after offset (count if none)
+static intmax_t _parser_token_after(const parser_t *p, intmax_t offset)
+{
+    intmax_t lo = 0, hi = (p->options & P_SOA) ? p->soa.count : p->tokens.count;
+    while (lo < hi) {
+        intmax_t mid = lo + (hi - lo) / 2;
+        intmax_t end = (p->options & P_SOA) 
+            ? (intmax_t)p->soa.offsets[mid] + p->soa.lens[mid]
+            : p->tokens.items[mid].offset + p->tokens.items[mid].len;
+        if (end < offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Replace the tokens in [first, last) by the fresh ones, the ones after are
+// moved by delta bytes and delta_lines lines (P_SOA line runs included)
+static int _parser_splice(parser_t *p, intmax_t first, intmax_t last, const token_t *fresh, intmax_t fresh_count,
+                          intmax_t delta, intmax_t delta_lines)
+{
+    intmax_t count = (p->options & P_SOA) ? p->soa.count : p->tokens.count;
+    intmax_t tail = count - last;
+    intmax_t total = first + fresh_count + tail;
+
+    if (!(p->options & P_SOA)) {
+        if (total > p->tokens.capacity) {
+            intmax_t capacity = p->tokens.capacity ? p->tokens.capacity : 255;
+            while (capacity < total) capacity *= 2;
+            _KP_STAT(p, token_reallocs, 1);
+            token_t *items = (token_t*) _KREALLOC(p->tokens.items, sizeof(token_t) * capacity);
+            if (!items) {
+                return 0;
+            }
+            p->tokens.items = items;
+            p->tokens.capacity = capacity;
+        }
+
+        token_t *items = p->tokens.items;
+        if (first + fresh_count != last) {
+            memmove(items + first + fresh_count, items + last, sizeof(token_t) * tail);
+        }
+        if (fresh_count > 0) {
+            memcpy(items + first, fresh, sizeof(token_t) * fresh_count);
+        }
+        for (intmax_t i = first + fresh_count; i < total; i++) {
+            items[i].offset += delta;
+            items[i].line += delta_lines;
+        }
+        p->tokens.count = total;
+        return 1;
+    }
+
+    token_soa_t *soa = &p->soa;
+    if (total > soa->capacity) {
+        intmax_t capacity = soa->capacity;
+        while (capacity < total) capacity *= 2;
+        _KP_STAT(p, token_reallocs, 1);
+        int32_t *ids = (int32_t*) _KREALLOC(soa->ids, sizeof(int32_t) * capacity);
+        if (ids) soa->ids = ids;
+        uint32_t *offsets = ids ? (uint32_t*) _KREALLOC(soa->offsets, sizeof(uint32_t) * capacity) : nullptr;
+        if (offsets) soa->offsets = offsets;
+        uint32_t *lens = offsets ? (uint32_t*) _KREALLOC(soa->lens, sizeof(uint32_t) * capacity) : nullptr;
+        if (!lens) {
+            return 0;
+        }
+        soa->lens = lens;
+        soa->capacity = capacity;
+    }
+
+    // the runs of the tail, from the one its first token is in
+    intmax_t run = 0, hi = soa->line_count - 1;
+    while (run < hi) {
+        intmax_t mid = run + (hi - run + 1) / 2;
+        if (soa->line_starts[mid] <= last) {
+            run = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    intmax_t tail_runs = tail ? soa->line_count - run : 0;
+
+    // at most a run for every fresh token and tail run after the ones kept,
+    // reserved before anything moves so running out leaves the tokens as 
+    // they were
+    if (!_parser_soa_reserve_lines(soa, soa->line_count + fresh_count + tail_runs)) {
+        return 0;
+    }
+
+    uint32_t *saved = nullptr;
+    if (tail_runs) {
+        saved = (uint32_t*) _KMALLOC(sizeof(uint32_t) * 2 * tail_runs);
+        if (!saved) {
+            return 0;
+        }
+        for (intmax_t r = 0; r < tail_runs; r++) {
+            saved[2 * r] = r ? soa->line_starts[run + r] : (uint32_t)last;
+            saved[2 * r + 1] = soa->lines[run + r];
+        }
+    }
+
+    if (first + fresh_count != last) {
+        memmove(soa->ids + first + fresh_count, soa->ids + last, sizeof(int32_t) * tail);
+        memmove(soa->offsets + first + fresh_count, soa->offsets + last, sizeof(uint32_t) * tail);
+        memmove(soa->lens + first + fresh_count, soa->lens + last, sizeof(uint32_t) * tail);
+    }
+    for (intmax_t i = first + fresh_count; i < total; i++) {
+        soa->offsets[i] = (uint32_t)(soa->offsets[i] + delta);
+    }
+
+    // keep the runs that start before first, the fresh tokens go after them
+    while (soa->line_count > 0 && soa->line_starts[soa->line_count - 1] >= first) {
+        soa->line_count--;
+    }
+    soa->count = first;
+    for (intmax_t i = 0; i < fresh_count; i++) {
+        if (!_parser_soa_push(p, &fresh[i])) {
+            if (saved) _KFREE(saved); // can't happen, everything was reserved
+            return 0;
+        }
+    }
+    soa->count = total;
+
+    for (intmax_t r = 0; r < tail_runs; r++) {
+        uint32_t line = (uint32_t)(saved[2 * r + 1] + delta_lines);
+        if (soa->line_count > 0 && soa->lines[soa->line_count - 1] == line) {
+            continue; // the same line as the token before it
+        }
+        soa->line_starts[soa->line_count] = (uint32_t)(saved[2 * r] - last + first + fresh_count);
+        soa->lines[soa->line_count++] = line;
+    }
+    soa->line_hint = 0;
+
+    if (saved) {
+        _KFREE(saved);
+    }
+    return 1;
+}
+
+int parser_update(parser_t *parser, intmax_t edit_offset, intmax_t removed_len, const char *inserted, intmax_t inserted_len)
+{
+    _KASSERT(parser);
+    _KASSERT(!(parser->options & P_STREAMING) && !parser->incomplete);
+    _KASSERT(edit_offset >= 0 && removed_len >= 0 && inserted_len >= 0);
+    _KASSERT(edit_offset + removed_len <= parser->buffer_size);
+    _KASSERT(inserted || inserted_len == 0);
+
+    parser_t *p = parser;
+    intmax_t size = p->buffer_size;
+    intmax_t edit_end = edit_offset + removed_len;
+    intmax_t delta = inserted_len - removed_len;
+    intmax_t delta_lines = (inserted_len ? _parser_count_lines(inserted, 0, inserted_len) : 0) - 
+                           _parser_count_lines(p->buffer, edit_offset, edit_end);
+    if (p->options & P_SOA) {
+        _KASSERT(size + delta <= UINT32_MAX);
+    }
+
+    // A token is only safe if its scan never looked at the edit, punctuation
+    // looks up to max_len bytes past its start. Rescan from the end of the
+    // last safe one.
+    intmax_t lookahead = p->punctuation->max_len > 1 ? p->punctuation->max_len : 1;
+    intmax_t first = _parser_token_after(p, edit_offset - lookahead);
+    intmax_t restart = 0, restart_line = 0;
+    if (first > 0) {
+        token_t before;
+        _parser_fetch(p, first - 1, &before);
+        restart = before.offset + before.len;
+        restart_line = before.line + _parser_count_lines(p->buffer, before.offset, restart);
+    }
+    intmax_t old_count = (p->options & P_SOA) ? p->soa.count : p->tokens.count;
+    intmax_t old_cursor = p->cursor;
+    intmax_t old_cursor_line = p->cursor_line;
+
+    // edit a copy the parser owns, the caller's buffer or a mapping is untouched
+    if (size + delta + 1 > p->owned_capacity || p->buffer != p->owned) {
+        intmax_t capacity = p->owned_capacity > 0 ? p->owned_capacity : 4096;
+        while (capacity < size + delta + 1) {
+            capacity *= 2;
+        }
+
+        char *owned = (char*) _KMALLOC(capacity);
+        if (!owned) {
+            return 0;
+        }
+        memcpy(owned, p->buffer, edit_offset);
+        memcpy(owned + edit_offset + inserted_len, p->buffer + edit_end, size - edit_end);
+        if (p->owned) {
+            _KFREE(p->owned);
+        }
+#if defined(_KP_MMAP)
+        if (p->mapping) {
+            munmap(p->mapping, p->mapping_size);
+            p->mapping = nullptr;
+        }
+#endif // _KP_MMAP
+        p->owned = owned;
+        p->owned_capacity = capacity;
+    } else {
+        memmove(p->owned + edit_offset + inserted_len, p->owned + edit_end, size - edit_end);
+    }
+    if (inserted_len > 0) {
+        memcpy(p->owned + edit_offset, inserted, inserted_len);
+    }
+    p->owned[size + delta] = '\0';
+    p->buffer = p->owned;
+    p->buffer_size = size + delta;
+
+    // rescan until a token starts where an old one after the edit now starts,
+    // everything from there on scans the same
+    token_t *fresh = nullptr;
+    intmax_t fresh_count = 0, fresh_capacity = 0;
+    intmax_t last = old_count;
+    intmax_t candidate = first;
+    int resynced = 0;
+
+    _KP_PHASE(p, P_PHASE_UPDATE, 0);
+    p->cursor = restart;
+    p->cursor_line = restart_line;
+    token_t token;
+    p->failed = 0;
+    while (_parser_scan(p, &token) > 0) {
+        token_t old;
+        while (candidate < old_count && _parser_fetch(p, candidate, &old) > 0 && 
+               (old.offset < edit_end || old.offset + delta < token.offset)) {
+            candidate++;
+        }
+        if (candidate < old_count && old.offset >= edit_end && old.offset + delta == token.offset) {
+            last = candidate;
+            resynced = 1;
+            if (token.token) {
+                p->arena_dead += token.len + 1; // the old one is kept
+            }
+            break;
+        }
+
+        if (fresh_count >= fresh_capacity) {
+            fresh_capacity = fresh_capacity ? fresh_capacity * 2 : 16;
+            token_t *items = (token_t*) _KREALLOC(fresh, sizeof(token_t) * fresh_capacity);
+            if (!items) {
+                if (fresh) _KFREE(fresh);
+                _KP_PHASE(p, P_PHASE_UPDATE, 1);
+                return 0;
+            }
+            fresh = items;
+        }
+        fresh[fresh_count++] = token;
+    }
+    if (p->failed) {
+        if (fresh) _KFREE(fresh);
+        _KP_PHASE(p, P_PHASE_UPDATE, 1);
+        return 0;
+    }
+
+    if (!(p->options & P_ZEROCOPY)) {
+        for (intmax_t k = first; k < last; k++) {
+            p->arena_dead += p->tokens.items[k].len + 1;
+        }
+    }
+
+    int ok = _parser_splice(p, first, last, fresh, fresh_count, delta, delta_lines);
+    if (fresh) {
+        _KFREE(fresh);
+    }
+    if (ok) {
+        _parser_arena_compact(p);
+    }
+
+    if (resynced) {
+        p->cursor = old_cursor + delta;
+        p->cursor_line = old_cursor_line + delta_lines;
+    }
+    // tokens already read stay read, up to the rescanned ones
+    if (p->current_token > first && p->current_token >= last) {
+        p->current_token += first + fresh_count - last;
+    } else if (p->current_token > first) {
+        p->current_token = first;
+    }
+    _KP_PHASE(p, P_PHASE_UPDATE, 1);
+    return ok;
+}
+
+int parser_reset(parser_t *parser, const char *buffer, intmax_t size)
+{
+    _KASSERT(parser);
+    _KASSERT(buffer || size == 0);
+    _KASSERT(size >= 0);
+
+    parser_t *p = parser;
+
+    // the token array only grows, straight to the hint if that's bigger. 
+    // Before anything is released, so the parser is left as it was if it can't
+    intmax_t hint = _parser_token_hint(size);
+    if (p->options & P_SOA) {
+        _KASSERT(size <= UINT32_MAX);
+        token_soa_t *soa = &p->soa;
+        if (soa->capacity < hint) {
+            _KP_STAT(p, token_reallocs, 1);
+            int32_t *ids = (int32_t*) _KREALLOC(soa->ids, sizeof(int32_t) * hint);
+            if (ids) soa->ids = ids;
+            uint32_t *offsets = ids ? (uint32_t*) _KREALLOC(soa->offsets, sizeof(uint32_t) * hint) : nullptr;
+            if (offsets) soa->offsets = offsets;
+            uint32_t *lens = offsets ? (uint32_t*) _KREALLOC(soa->lens, sizeof(uint32_t) * hint) : nullptr;
+            if (!lens) {
+                return 0;
+            }
+            soa->lens = lens;
+            soa->capacity = hint;
+        }
+    } else if (!(p->options & P_STREAMING)) {
+        if (p->tokens.capacity < hint) {
+            _KP_STAT(p, token_reallocs, 1);
+            token_t *items = (token_t*) _KREALLOC(p->tokens.items, sizeof(token_t) * hint);
+            if (!items) {
+                return 0;
+            }
+            p->tokens.items = items;
+            p->tokens.capacity = hint;
+        }
+    }
+
+#if defined(_KP_MMAP)
+    if (p->mapping) {
+        munmap(p->mapping, p->mapping_size);
+        p->mapping = nullptr;
+        p->mapping_size = 0;
+    }
+#endif // _KP_MMAP
+    if (p->owned) {
+        _KFREE(p->owned);
+        p->owned = nullptr;
+        p->owned_capacity = 0;
+    }
+
+    // keep the largest block of token text and start it over
+    parser_arena_block_t *keep = nullptr;
+    for (parser_arena_block_t *block = p->arena; block; block = block->next) {
+        if (!keep || block->size > keep->size) {
+            keep = block;
+        }
+    }
+    for (parser_arena_block_t *block = p->arena; block;) {
+        parser_arena_block_t *next = block->next;
+        if (block != keep) {
+            _KFREE(block);
+        }
+        block = next;
+    }
+    if (keep) {
+        keep->next = nullptr;
+        keep->used = 0;
+    }
+    p->arena = keep;
+    p->arena_dead = 0;
+
+    if (p->options & P_SOA) {
+        token_soa_t *soa = &p->soa;
+        soa->count = 0;
+        soa->line_count = 0;
+        soa->line_hint = 0;
+    } else {
+        p->tokens.count = 0;
+    }
+
+    p->buffer = buffer;
+    p->buffer_size = size;
+    p->current_token = 0;
+    p->cursor = 0;
+    p->cursor_line = 0;
+    p->produced = 0;
+    p->incomplete = 0;
+    p->resume = 0;
+    p->resume_line = 0;
+    p->arena_hint = size;
+
+    return _parser_drain(p);
+}
+
+void parser_destroy(parser_t *parser) 
+{
+    _KASSERT(parser);
+    
+    if (parser->tokens.items) {
+        _KFREE(parser->tokens.items);
+    }
+    _parser_arena_free(parser->arena);
+
+    // any of them can be missing if parser_init_n ran out of memory
+    if (parser->soa.ids) _KFREE(parser->soa.ids);
+    if (parser->soa.offsets) _KFREE(parser->soa.offsets);
+    if (parser->soa.lens) _KFREE(parser->soa.lens);
+    if (parser->soa.line_starts) _KFREE(parser->soa.line_starts);
+    if (parser->soa.lines) _KFREE(parser->soa.lines);
+
+#if defined(_KP_MMAP)
+    if (parser->mapping) {
+        munmap(parser->mapping, parser->mapping_size);
+    }
+#endif // _KP_MMAP
+
+    if (parser->owned) {
+        _KFREE(parser->owned);
+    }
+
+    if (parser->stats) {
+        _KFREE(parser->stats);
+    }
+
+    _KFREE(parser);
+    parser = nullptr;
+}
+
+int parser_get_stats(const parser_t *parser, parser_stats_t *stats)
+{
+    _KASSERT(parser && stats);
+
+    if (!parser->stats) {
+        memset(stats, 0, sizeof(parser_stats_t));
+        return 0;
+    }
+
+    *stats = *parser->stats;
+    return 1;
+}
+
+void parser_set_phase_callback(parser_phase_fn callback, void *user)
+{
+#if defined(_KPARSER_STATS)
+    _parser_phase_callback = callback;
+    _parser_phase_user = user;
+#else
+    (void)callback;
+    (void)user;
+#endif // _KPARSER_STATS
+}
+
+const token_t parser_get_token(parser_t *parser)
+{
+    _KASSERT(parser);
+
+    token_t token;
+    if (_parser_fetch(parser, parser->current_token, &token) > 0) {
+        parser->current_token++;
+        return token;
+    }
+
+    return _parser_eof_token(parser);
+}
+
+void parser_unget_token(parser_t *parser)
+{
+    _KASSERT(parser);
+    if (parser->current_token > 0 && 
+        (!(parser->options & P_STREAMING) || parser->current_token > parser->produced - P_LOOKAHEAD)) {
+        --parser->current_token;
+    }
+}
+
+const token_t parser_peek_token(parser_t *parser)
+{
+    _KASSERT(parser);
+
+    token_t token;
+    if (_parser_fetch(parser, parser->current_token, &token) > 0) {
+        return token;
+    }
+
+    return _parser_eof_token(parser);
+}
+
 intmax_t parser_get_line(parser_t *parser)
 {
     _KASSERT(parser);
     
-    return parser->tokens.items[parser->current_token].line;
+    return parser_peek_token(parser).line;
+}
+
+intmax_t parser_token_count(const parser_t *parser)
+{
+    _KASSERT(parser);
+
+    if (parser->options & P_STREAMING) {
+        return parser->produced;
+    }
+
+    return (parser->options & P_SOA) ? parser->soa.count : parser->tokens.count;
+}
+
+token_t parser_token_at(parser_t *parser, intmax_t index)
+{
+    _KASSERT(parser && index >= 0);
+
+    token_t token;
+    if (_parser_fetch(parser, index, &token) > 0) {
+        return token;
+    }
+
+    return _parser_eof_token(parser);
+}
+
+const int32_t *parser_token_ids(const parser_t *parser)
+{
+    _KASSERT(parser);
+
+    return (parser->options & P_SOA) ? parser->soa.ids : nullptr;
+}
+
+const char *parser_token_text(const parser_t *parser, const token_t *token)
+{
+    _KASSERT(parser && token);
+
+    if (token->id == -2 || token->offset < 0 || token->offset >= parser->buffer_size) {
+        return nullptr;
+    }
+
+    return parser->buffer + token->offset;
+}
+
+intmax_t parser_token_copy(const parser_t *parser, const token_t *token, char *dest, intmax_t size)
+{
+    _KASSERT(dest && size > 0);
+
+    const char *text = parser_token_text(parser, token);
+    intmax_t len = text ? token->len : 0;
+
+    if (len > size - 1) {
+        len = size - 1;
+    }
+
+    if (len > 0) {
+        memcpy(dest, text, len);
+    }
+    dest[len] = '\0';
+
+    return len;
+}
+
+char *parser_token_dup(const parser_t *parser, const token_t *token)
+{
+    intmax_t len = parser_token_text(parser, token) ? token->len : 0;
+    char *copy = (char*) _KMALLOC(len + 1);
+
+    if (copy) {
+        parser_token_copy(parser, token, copy, len + 1);
+    }
+
+    return copy;
 }
 
 #endif // _KPARSER_IMPLEMENTATION
\ No newline at end of file
@@ -7,7 +7,8 @@
 #define KALLOC_IMPLEMENTATION
 #include "kalloc.h"
 
-// Make sure to include multibyte punctuation before single-byte ones
+// Order doesn't matter once the list is compiled with punc_compile,
+// otherwise include multibyte punctuation before single-byte ones
 // e.g. '<<' before '<'
 typedef enum {
     P_ShiftLeft,
@@ -45,6 +46,7 @@ void TestPunctuation()
     for (int i = 0; i < (int)sizeof(punctuation) / sizeof(punctuation[0]); i++) {
         punc_add(plist, punctuation[i].p, punctuation[i].id);
     }
+    punc_compile(plist);
     for (int i = 0; i < plist->count; i++) {
         printf("Punctuation: \"%s\" (%i)\n", plist->items[i].p, plist->items[i].id);
     }
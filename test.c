@@ -0,0 +1,1788 @@
+// Self-checks for kparser.h and klexer.h, every mode's tokens are compared
+// against a plain parser_init_n (or lexer_init) scan of the same input. 
+// kalloc.h and _KPARSER_STATS are checked in the mode they are built in, run
+// each of them:
+//
+//    gcc -O2 test.c -pthread -o test && ./test
+//    gcc -O2 -DKALLOC_HEADERS test.c -pthread -o test && ./test
+//    gcc -O2 -DKALLOC_SAMPLE_RATE=4096 test.c -pthread -lm -o test && ./test
+//    gcc -O2 -D_KPARSER_STATS test.c -pthread -o test && ./test
+//    gcc -O2 -DKALLOC_STACKS -fno-omit-frame-pointer test.c -pthread -o test && ./test
+//
+// Fixed inputs (unclosed comments and quotes among them) are followed by
+// random ones built from fragments that tend to break token boundaries.
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if !defined(_MSC_VER)
+    #include <unistd.h>
+#endif // _MSC_VER
+
+// counted (per thread, parser_init_parallel allocates on its threads) so 
+// parser_reset can be checked not to allocate, with fail_arena set blocks of
+// token text (a header and a power of two of at least 4096 bytes with the 
+// small test inputs) can't be allocated, with fail_reallocs at n the reallocs
+// after the next n fail (growing the token arrays)
+static _Thread_local intmax_t allocations = 0;
+static int fail_arena = 0;
+static int fail_reallocs = -1;
+static int IsArenaBlock(size_t size);
+static void *CountedMalloc(size_t size) 
+{ 
+    allocations++; 
+    return fail_arena && IsArenaBlock(size) ? NULL : malloc(size); 
+}
+static void *CountedRealloc(void *ptr, size_t size) 
+{ 
+    allocations++; 
+    if (fail_reallocs == 0) return NULL;
+    if (fail_reallocs > 0) fail_reallocs--;
+    return realloc(ptr, size); 
+}
+#define _KMALLOC(x) CountedMalloc(x)
+#define _KREALLOC(a,b) CountedRealloc(a,b)
+#define _KFREE(x) free(x)
+
+// ASan and TSan both reject reads of heap memory outside a live block
+#if defined(__SANITIZE_ADDRESS__) || defined(__SANITIZE_THREAD__)
+    #define TEST_SANITIZE
+#elif defined(__has_feature)
+    #if __has_feature(address_sanitizer) || __has_feature(thread_sanitizer)
+        #define TEST_SANITIZE
+    #endif
+#endif
+
+// small slices so parser_init_parallel splits the test inputs
+#define P_PARALLEL_MIN_CHUNK 16
+#define _KPARSER_IMPLEMENTATION
+#include "kparser.h"
+#define _KLEXER_IMPLEMENTATION
+#include "klexer.h"
+// not through USE_KALLOC, the checks call kmem_* themselves
+#define KALLOC_IMPLEMENTATION
+#include "kalloc.h"
+
+static int IsArenaBlock(size_t size)
+{
+    size_t block = size - sizeof(parser_arena_block_t);
+    return size > sizeof(parser_arena_block_t) && block >= 4096 && (block & (block - 1)) == 0;
+}
+
+typedef enum {
+    P_BlockComment,
+    P_LineComment,
+    P_Divide,
+    P_Plus,
+    P_Equals,
+    P_Assign
+} TestPunctuation;
+
+static punc_t punctuation[] = {
+    { "/*", P_BlockComment, 0 },
+    { "//", P_LineComment, 0 },
+    { "/", P_Divide, 0 },
+    { "+", P_Plus, 0 },
+    { "==", P_Equals, 0 },
+    { "=", P_Assign, 0 }
+};
+
+static const char *inputs[] = {
+    "",
+    "a + b == c",
+    "/* start\nabc def\nabc def\nabc def\nabc def\nabc def\nabc def\nabc def\n",
+    "abc def\nabc def\n/* open\nabc def\nabc def\nabc def\nabc def\nabc def\n",
+    "abc def\nabc def\n\"open quote\nabc def\nabc def\nabc def\nabc def\n",
+    "x = 'single\nabc def\nabc def\nabc def\nabc def\nabc def\nabc def\n",
+    "a // line comment without a newline",
+    "a /* closed */ b /* closed\n over lines */ c\n// x\nd\n",
+    "\"escaped \\\" quote\" + 'it\\'s'\nabc def\nabc def\nabc def\n\"tail\\",
+    "a=b==c===d=/=//=\n/**/ /*/ x */ +\n+",
+};
+
+// fragments random inputs are built from
+static const char *fragments[] = {
+    "abc", "de", " ", "  ", "\n", "\n\n", "\t", "/*", "*/", "//", "\"", "'", "\\",
+    "+", "=", "==", "/", "x\ny", "* /", "a+b",
+};
+
+static int checks = 0;
+static int failures = 0;
+
+#define Check(x, ...)                      \
+    do {                                   \
+        checks++;                          \
+        if (!(x)) {                        \
+            failures++;                    \
+            printf("FAILED: " __VA_ARGS__); \
+            printf("\n");                  \
+        }                                  \
+    } while (0)
+
+static uint64_t test_seed = 0x9e3779b97f4a7c15ull;
+static uint32_t Random(uint32_t n)
+{
+    test_seed ^= test_seed << 13;
+    test_seed ^= test_seed >> 7;
+    test_seed ^= test_seed << 17;
+    return (uint32_t)(test_seed % n);
+}
+
+static char *Generate(intmax_t size)
+{
+    char *buffer = (char*)malloc(size + 64);
+    intmax_t at = 0;
+
+    while (at < size) {
+        const char *fragment = fragments[Random(sizeof(fragments) / sizeof(fragments[0]))];
+        intmax_t len = strlen(fragment);
+        memcpy(buffer + at, fragment, len);
+        at += len;
+    }
+    buffer[at] = '\0';
+
+    return buffer;
+}
+
+static punc_list_t *Punctuation()
+{
+    punc_list_t *plist = punc_init();
+    for (int i = 0; i < (int)(sizeof(punctuation) / sizeof(punctuation[0])); i++) {
+        punc_add(plist, punctuation[i].p, punctuation[i].id);
+    }
+    punc_ignore(plist, P_BlockComment, "*/");
+    punc_ignore(plist, P_LineComment, "\n");
+    punc_compile(plist);
+
+    return plist;
+}
+
+// 1 if the token's copy of its text (if it has one) matches the buffer
+static int SameCopy(const parser_t *p, const token_t *x)
+{
+    return !x->token || (x->token[x->len] == '\0' && 
+                         (x->len == 0 || memcmp(x->token, parser_token_text(p, x), x->len) == 0));
+}
+
+// 1 if both tokens are the same (text included)
+static int SameToken(const parser_t *a, const token_t *x, const parser_t *b, const token_t *y)
+{
+    if (x->id != y->id || x->offset != y->offset || x->len != y->len || x->line != y->line ||
+        !SameCopy(a, x) || !SameCopy(b, y)) {
+        return 0;
+    }
+
+    return x->len == 0 || memcmp(parser_token_text(a, x), parser_token_text(b, y), x->len) == 0;
+}
+
+// index of the first token that differs, -1 if the token lists are the same
+static intmax_t Compare(parser_t *expected, parser_t *actual)
+{
+    intmax_t count = parser_token_count(expected);
+    for (intmax_t k = 0; k < count; k++) {
+        token_t x = parser_token_at(expected, k);
+        token_t y = parser_token_at(actual, k);
+        if (!SameToken(expected, &x, actual, &y)) {
+            return k;
+        }
+    }
+
+    return parser_token_count(actual) == count ? -1 : count;
+}
+
+static const int modes[] = { 0, P_ZEROCOPY, P_SOA, P_ACCEPT_DOUBLEQUOTES | P_ACCEPT_SINGLEQUOTES,
+                             P_SOA | P_ACCEPT_DOUBLEQUOTES | P_ACCEPT_SINGLEQUOTES };
+#define MODE_COUNT (int)(sizeof(modes) / sizeof(modes[0]))
+
+static void CheckInput(const char *name, const char *buffer, const punc_list_t *plist)
+{
+    intmax_t size = strlen(buffer);
+
+    for (int m = 0; m < MODE_COUNT; m++) {
+        int options = modes[m];
+        parser_t *expected = parser_init_n(buffer, size, plist, options);
+
+        // sliced across threads
+        for (int nthreads = 2; nthreads <= 8; nthreads *= 2) {
+            parser_t *parser = parser_init_parallel(buffer, size, plist, options, nthreads);
+            intmax_t at = Compare(expected, parser);
+            Check(at < 0, "%s: parser_init_parallel (options %x, %d threads) differs at token %jd",
+                  name, options, nthreads, at);
+            parser_destroy(parser);
+        }
+
+        // fed in random chunks
+        parser_t *parser = parser_init_feed(plist, options);
+        for (intmax_t fed = 0; fed < size;) {
+            intmax_t len = 1 + Random(16);
+            if (len > size - fed) len = size - fed;
+            parser_feed(parser, buffer + fed, len);
+            fed += len;
+        }
+        parser_finish(parser);
+        intmax_t at = Compare(expected, parser);
+        Check(at < 0, "%s: parser_feed (options %x) differs at token %jd", name, options, at);
+        parser_destroy(parser);
+
+        // scanned on demand
+        parser = parser_init_n(buffer, size, plist, options | P_STREAMING);
+        intmax_t k = 0;
+        for (token_t token = parser_get_token(parser); token.id != -2; token = parser_get_token(parser), k++) {
+            token_t x = parser_token_at(expected, k);
+            if (!SameToken(expected, &x, parser, &token)) break;
+        }
+        Check(k == parser_token_count(expected), "%s: P_STREAMING (options %x) differs at token %jd",
+              name, options, k);
+        parser_destroy(parser);
+
+        parser_destroy(expected);
+    }
+}
+
+void TestModes(const punc_list_t *plist)
+{
+    char name[64];
+
+    for (int i = 0; i < (int)(sizeof(inputs) / sizeof(inputs[0])); i++) {
+        snprintf(name, sizeof(name), "input %d", i);
+        CheckInput(name, inputs[i], plist);
+    }
+
+    for (int seed = 1; seed <= 2000; seed++) {
+        test_seed = 0x9e3779b97f4a7c15ull * seed;
+        char *buffer = Generate(16 + Random(512));
+        snprintf(name, sizeof(name), "seed %d", seed);
+        CheckInput(name, buffer, plist);
+        free(buffer);
+    }
+}
+
+// a compiled list matches the longest punc_t whatever order they were added in
+void TestPuncOrder()
+{
+    enum { O_Assign, O_Equals, O_Less, O_ShiftLeft };
+    static const punc_t shortest[] = { { "=", O_Assign, 0 }, { "<", O_Less, 0 }, 
+                                       { "==", O_Equals, 0 }, { "<<", O_ShiftLeft, 0 } };
+    punc_list_t *lists[2];
+    for (int l = 0; l < 2; l++) {
+        lists[l] = punc_init();
+        for (int k = 0; k < 4; k++) {
+            const punc_t *punc = &shortest[l ? 3 - k : k];
+            punc_add(lists[l], punc->p, punc->id);
+        }
+        punc_compile(lists[l]);
+    }
+
+    const char *buffer = "a<<b==c<d=e<<=f===<<<";
+    static const int ids[] = { -1, O_ShiftLeft, -1, O_Equals, -1, O_Less, -1, O_Assign, -1, O_ShiftLeft, 
+                               O_Assign, -1, O_Equals, O_Assign, O_ShiftLeft, O_Less };
+    const int count = (int)(sizeof(ids) / sizeof(ids[0]));
+    parser_t *expected = parser_init(buffer, lists[1], 0);
+    parser_t *parser = parser_init(buffer, lists[0], 0);
+
+    intmax_t at = Compare(expected, parser);
+    Check(at < 0, "punc_compile: \"=\" and \"<\" added first differ at token %jd", at);
+    int same = parser_token_count(parser) == count;
+    for (int k = 0; same && k < count; k++) {
+        same = parser_token_at(parser, k).id == ids[k];
+    }
+    Check(same, "punc_compile: \"=\" and \"<\" added first don't match the longest punc_t");
+
+    parser_destroy(parser);
+    parser_destroy(expected);
+    punc_destroy(lists[0]);
+    punc_destroy(lists[1]);
+
+    // a trie that can't grow (more nodes than it starts with) leaves the list
+    // uncompiled, matching in punc_add order
+    punc_list_t *plist = punc_init();
+    punc_add(plist, "<", O_Less);
+    punc_add(plist, "<<<<<<<<<<<<<<<<<<<<<<<<", O_ShiftLeft);
+    fail_reallocs = 0;
+    punc_compile(plist);
+    fail_reallocs = -1;
+    parser = parser_init("<<", plist, 0);
+    Check(!plist->nodes && parser_token_count(parser) == 2 && parser_token_at(parser, 0).id == O_Less,
+          "punc_compile: out of memory didn't leave the list uncompiled");
+    parser_destroy(parser);
+    punc_compile(plist);
+    Check(plist->nodes != nullptr, "punc_compile: no trie once there is memory again");
+    punc_destroy(plist);
+}
+
+// a close of 3 or more bytes, whose last bytes the search leaves to the 
+// caller when it's not found, over comments of every length around the
+// vector widths
+void TestIgnoreClose()
+{
+    punc_list_t *plist = punc_init();
+    punc_add(plist, "<!--", 1);
+    punc_ignore(plist, 1, "-->");
+    punc_compile(plist);
+
+    char buffer[256];
+    char name[64];
+    for (int len = 0; len < 160; len++) {
+        intmax_t lines = 1;
+        intmax_t size = snprintf(buffer, sizeof(buffer), "a\n<!--");
+        for (int k = 0; k < len; k++) {
+            buffer[size++] = k % 7 == 3 ? '\n' : '-';
+            lines += k % 7 == 3;
+        }
+        buffer[size] = '\0';
+
+        // unclosed, the comment runs to the end
+        parser_t *parser = parser_init_n(buffer, size, plist, 0);
+        parser_get_token(parser);
+        token_t eof = parser_get_token(parser);
+        Check(eof.id == -2 && eof.line == lines, "ignore close: comment of %d bytes ends on line %jd, not %jd",
+              len, eof.line, lines);
+        parser_destroy(parser);
+
+        // fed up to the missing close, then the rest
+        parser = parser_init_feed(plist, 0);
+        parser_feed(parser, buffer, size);
+        parser_feed(parser, "-->\nb", 5);
+        parser_finish(parser);
+        token_t b = parser_token_at(parser, 1);
+        Check(b.line == lines + 1, "ignore close: token after a fed comment of %d bytes on line %jd, not %jd",
+              len, b.line, lines + 1);
+        parser_destroy(parser);
+
+        memcpy(buffer + size, "-->\nb", 6);
+        snprintf(name, sizeof(name), "ignore close %d", len);
+        CheckInput(name, buffer, plist);
+    }
+
+    punc_destroy(plist);
+}
+
+// random edits through parser_update, each compared with a fresh scan of the
+// edited text
+void TestUpdate(const punc_list_t *plist)
+{
+    for (int seed = 1; seed <= 300; seed++) {
+        test_seed = 0xbf58476d1ce4e5b9ull * seed;
+        int options = modes[seed % MODE_COUNT];
+        char *text = Generate(16 + Random(1024));
+        intmax_t size = strlen(text);
+
+        parser_t *parser = parser_init_n(text, size, plist, options);
+        for (int edit = 0; edit < 8; edit++) {
+            intmax_t offset = Random((uint32_t)size + 1);
+            intmax_t removed = Random((uint32_t)(size - offset) + 1 < 32 ? (uint32_t)(size - offset) + 1 : 32);
+            char *inserted = Generate(Random(3) ? Random(24) : 0);
+            intmax_t inserted_len = strlen(inserted);
+
+            // the parser keeps its own copy, apply the edit to ours too
+            char *edited = (char*)malloc(size - removed + inserted_len + 1);
+            memcpy(edited, text, offset);
+            memcpy(edited + offset, inserted, inserted_len);
+            memcpy(edited + offset + inserted_len, text + offset + removed, size - offset - removed + 1);
+
+            // the first edit still reads our buffer
+            int updated = parser_update(parser, offset, removed, inserted, inserted_len);
+            free(text);
+            text = edited;
+            size += inserted_len - removed;
+            parser_t *expected = parser_init_n(text, size, plist, options);
+            intmax_t at = Compare(expected, parser);
+            Check(updated && at < 0, "seed %d: parser_update %d (options %x) differs at token %jd",
+                  seed, edit, options, at);
+            parser_destroy(expected);
+            free(inserted);
+        }
+
+        parser_destroy(parser);
+        free(text);
+    }
+}
+
+// token text of a parser (blocks included whole)
+static intmax_t ArenaBytes(const parser_t *parser)
+{
+    intmax_t bytes = 0;
+    for (const parser_arena_block_t *block = parser->arena; block; block = block->next) {
+        bytes += block->size;
+    }
+
+    return bytes;
+}
+
+// a long-lived parser edited on every keystroke keeps its token text bounded
+// by the buffer, not by the number of edits
+void TestUpdateArena(const punc_list_t *plist)
+{
+    const int options = P_ACCEPT_DOUBLEQUOTES | P_ACCEPT_SINGLEQUOTES;
+    test_seed = 0x8cb92ba72f3d8dd7ull;
+
+    intmax_t size = 4096;
+    char *text = Generate(size);
+    size = strlen(text);
+    parser_t *parser = parser_init_n(text, size, plist, options);
+    intmax_t most = 0;
+
+    for (int edit = 0; edit < 20000; edit++) {
+        // typing: a fragment inserted or one byte removed
+        intmax_t offset = Random((uint32_t)size + 1);
+        int removed = size > 2048 && Random(2) && offset < size;
+        const char *inserted = removed ? "" : fragments[Random(sizeof(fragments) / sizeof(fragments[0]))];
+        intmax_t inserted_len = strlen(inserted);
+
+        char *edited = (char*)malloc(size - removed + inserted_len + 1);
+        memcpy(edited, text, offset);
+        memcpy(edited + offset, inserted, inserted_len);
+        memcpy(edited + offset + inserted_len, text + offset + removed, size - offset - removed + 1);
+
+        Check(parser_update(parser, offset, removed, inserted, inserted_len), "parser_update %d failed", edit);
+        free(text);
+        text = edited;
+        size += inserted_len - removed;
+
+        intmax_t live = 0;
+        for (intmax_t k = 0; k < parser->tokens.count; k++) {
+            live += parser->tokens.items[k].len + 1;
+        }
+        intmax_t bytes = ArenaBytes(parser);
+        if (bytes - 4 * live > most) most = bytes - 4 * live;
+
+        if (edit % 1000 == 999) {
+            parser_t *expected = parser_init_n(text, size, plist, options);
+            intmax_t at = Compare(expected, parser);
+            Check(at < 0, "parser_update %d (long-lived) differs at token %jd", edit, at);
+            parser_destroy(expected);
+        }
+    }
+    Check(most <= 8192, "parser_update token text grew to %jd bytes over 4x the live text", most);
+
+    parser_destroy(parser);
+    free(text);
+}
+
+// one parser reset for a run of inputs of every size, including one it was 
+// fed and one from parser_init_file
+void TestReset(const punc_list_t *plist)
+{
+    for (int m = 0; m < MODE_COUNT; m++) {
+        int options = modes[m];
+        test_seed = 0x94d049bb133111ebull + m;
+
+        for (int start = 0; start < 3; start++) {
+            parser_t *parser = nullptr;
+            if (start == 0) {
+                parser = parser_init_n(inputs[1], strlen(inputs[1]), plist, options);
+            } else if (start == 1) {
+                parser = parser_init_feed(plist, options);
+                parser_feed(parser, inputs[2], strlen(inputs[2]));
+            } else {
+                FILE *file = fopen("test.input", "wb");
+                if (file) {
+                    fputs(inputs[7], file);
+                    fclose(file);
+                }
+                parser = parser_init_file("test.input", plist, options);
+                remove("test.input");
+            }
+            Check(parser != nullptr, "parser_reset (options %x): no parser to start from (%d)", options, start);
+            if (!parser) continue;
+
+            for (int i = 0; i < 24; i++) {
+                char *buffer = Generate(Random(4) ? Random(2048) : 0);
+                intmax_t size = strlen(buffer);
+
+                parser_reset(parser, buffer, size);
+                parser_t *expected = parser_init_n(buffer, size, plist, options);
+                intmax_t at = Compare(expected, parser);
+                Check(at < 0, "parser_reset %d (options %x, from %d) differs at token %jd", i, options, start, at);
+
+                // the same input again fits in what the parser already has
+                intmax_t before = allocations;
+                parser_reset(parser, buffer, size);
+                Check(allocations == before, "parser_reset %d (options %x) allocated again", i, options);
+                at = Compare(expected, parser);
+                Check(at < 0, "parser_reset %d (options %x, again) differs at token %jd", i, options, at);
+
+                parser_destroy(expected);
+                free(buffer);
+            }
+            parser_destroy(parser);
+        }
+
+        // on demand, the tokens of the new buffer from the first one
+        parser_t *streaming = parser_init_n(inputs[3], strlen(inputs[3]), plist, options | P_STREAMING);
+        parser_get_token(streaming);
+        parser_reset(streaming, inputs[8], strlen(inputs[8]));
+        parser_t *expected = parser_init_n(inputs[8], strlen(inputs[8]), plist, options);
+        intmax_t k = 0;
+        for (token_t token = parser_get_token(streaming); token.id != -2; token = parser_get_token(streaming), k++) {
+            token_t x = parser_token_at(expected, k);
+            if (!SameToken(expected, &x, streaming, &token)) break;
+        }
+        Check(k == parser_token_count(expected), "parser_reset P_STREAMING (options %x) differs at token %jd",
+              options, k);
+        parser_destroy(expected);
+        parser_destroy(streaming);
+    }
+}
+
+// token text that can't be allocated fails the parser instead of storing a
+// token without it
+void TestOutOfMemory(const punc_list_t *plist)
+{
+    const int options = P_ACCEPT_DOUBLEQUOTES | P_ACCEPT_SINGLEQUOTES;
+
+    fail_arena = 1;
+    Check(!parser_init_n(inputs[1], strlen(inputs[1]), plist, options), "parser_init_n without token text");
+    Check(!parser_init_parallel(inputs[3], strlen(inputs[3]), plist, options, 4), 
+          "parser_init_parallel without token text");
+    fail_arena = 0;
+
+    // feeding carries on once there is memory again
+    parser_t *expected = parser_init_n(inputs[7], strlen(inputs[7]), plist, options);
+    parser_t *parser = parser_init_feed(plist, options);
+    fail_arena = 1;
+    Check(!parser_feed(parser, inputs[7], strlen(inputs[7])), "parser_feed without token text");
+    fail_arena = 0;
+    Check(parser_finish(parser) && Compare(expected, parser) < 0, "parser_finish after running out of memory");
+    parser_destroy(parser);
+
+    // an update and a reset that need a new block of text
+    parser = parser_init_n(inputs[7], strlen(inputs[7]), plist, options);
+    Check(parser_update(parser, 0, 0, "x", 1), "parser_update failed");
+    parser->arena->used = parser->arena->size;
+    fail_arena = 1;
+    Check(!parser_update(parser, 0, 1, "y", 1), "parser_update without token text");
+    fail_arena = 0;
+
+    test_seed = 0x2545f4914f6cdd1dull;
+    char *buffer = Generate(16384);
+    fail_arena = 1;
+    Check(!parser_reset(parser, buffer, strlen(buffer)), "parser_reset without token text");
+    fail_arena = 0;
+    Check(parser_reset(parser, inputs[7], strlen(inputs[7])) && Compare(expected, parser) < 0, 
+          "parser_reset after running out of memory");
+
+    free(buffer);
+    parser_destroy(parser);
+    parser_destroy(expected);
+
+    // token arrays that can't grow past the size hint (no quotes, so there
+    // are more tokens than that), feeding carries on from the token it 
+    // couldn't add (its first realloc is the copy of the input)
+    test_seed = 0x9fb21c651e98df25ull;
+    buffer = Generate(16000);
+    intmax_t size = strlen(buffer);
+    for (int soa = 0; soa < 2; soa++) {
+        int array_options = soa ? P_SOA : 0;
+
+        fail_reallocs = 0;
+        Check(!parser_init_n(buffer, size, plist, array_options), 
+              "parser_init_n (options %x) without room for the tokens", array_options);
+        Check(!parser_init_parallel(buffer, size, plist, array_options, 4), 
+              "parser_init_parallel (options %x) without room for the tokens", array_options);
+        fail_reallocs = -1;
+
+        expected = parser_init_n(buffer, size, plist, array_options);
+        parser = parser_init_feed(plist, array_options);
+        fail_reallocs = 1;
+        Check(!parser_feed(parser, buffer, size), "parser_feed (options %x) without room for the tokens", 
+              array_options);
+        fail_reallocs = -1;
+        Check(parser_finish(parser) && Compare(expected, parser) < 0, 
+              "parser_finish (options %x) after the token array couldn't grow", array_options);
+        parser_destroy(parser);
+        parser_destroy(expected);
+
+        // a reset that can't grow the array leaves the parser as it was
+        expected = parser_init_n(inputs[7], strlen(inputs[7]), plist, array_options);
+        parser = parser_init_n(inputs[7], strlen(inputs[7]), plist, array_options);
+        fail_reallocs = 0;
+        Check(!parser_reset(parser, buffer, size) && Compare(expected, parser) < 0, 
+              "parser_reset (options %x) without room for the tokens", array_options);
+        fail_reallocs = -1;
+        parser_destroy(expected);
+        expected = parser_init_n(buffer, size, plist, array_options);
+        Check(parser_reset(parser, buffer, size) && Compare(expected, parser) < 0,
+              "parser_reset (options %x) after the token array couldn't grow", array_options);
+        parser_destroy(parser);
+        parser_destroy(expected);
+    }
+    free(buffer);
+
+    // an update with more lines than the P_SOA line runs have room for, 
+    // past the reallocs of its list of new tokens (16 to 128), keeps the 
+    // tokens it had
+    char lines[161];
+    for (int k = 0; k < 160; k += 2) {
+        memcpy(lines + k, "x\n", 2);
+    }
+    lines[160] = '\0';
+    parser = parser_init_n("a b", 3, plist, P_SOA);
+    token_t before = parser_token_at(parser, 1);
+    fail_reallocs = 4;
+    Check(!parser_update(parser, 0, 0, lines, 160), "parser_update (P_SOA) without room for the line runs");
+    fail_reallocs = -1;
+    token_t after = parser_token_at(parser, 1);
+    Check(parser_token_count(parser) == 2 && after.id == before.id && after.offset == before.offset &&
+          after.len == before.len && after.line == before.line, 
+          "parser_update (P_SOA) changed the tokens without room for the line runs");
+    parser_destroy(parser);
+}
+
+#if defined(_KPARSER_STATS)
+static int phase_starts[P_PHASE_UPDATE + 1];
+static int phase_ends[P_PHASE_UPDATE + 1];
+static int phase_open = 0; // a phase ended that hadn't started, or the parser was wrong
+
+static void CountPhase(void *user, const parser_t *parser, int phase, int done)
+{
+    int *open = (int*)user;
+    if ((phase == P_PHASE_LOAD) != (parser == nullptr) || (done && phase_ends[phase] >= phase_starts[phase])) {
+        (*open)++;
+    }
+    (done ? phase_ends : phase_starts)[phase]++;
+}
+#endif // _KPARSER_STATS
+
+// the counters of a known buffer and a callback for every phase
+void TestParserStats(const punc_list_t *plist)
+{
+    const int options = P_ACCEPT_DOUBLEQUOTES | P_ACCEPT_SINGLEQUOTES;
+    const char *buffer = "a + \"q x\" /* c */ b==c";
+    parser_t *parser = parser_init_n(buffer, strlen(buffer), plist, options);
+    parser_stats_t stats;
+
+#if defined(_KPARSER_STATS)
+    Check(parser_get_stats(parser, &stats), "parser_get_stats without stats");
+    Check(stats.bytes_scanned == 22 && stats.ignored_bytes == 7 && stats.quote_bytes == 5, 
+          "parser stats: %jd bytes scanned, %jd ignored, %jd quoted", 
+          stats.bytes_scanned, stats.ignored_bytes, stats.quote_bytes);
+    Check(stats.tokens == 6 && stats.identifiers == 4 && stats.tokens_by_id[P_Plus] == 1 && 
+          stats.tokens_by_id[P_Equals] == 1 && stats.tokens_other_ids == 0,
+          "parser stats: %jd tokens, %jd identifiers", stats.tokens, stats.identifiers);
+    // token starts, the "/*" and the "==" ending b
+    Check(stats.punc_attempts == 8 && stats.punc_hits == 4, "parser stats: %jd punc_t lookups, %jd found", 
+          stats.punc_attempts, stats.punc_hits);
+    Check(stats.token_reallocs == 0, "parser stats: %jd token reallocs", stats.token_reallocs);
+    parser_destroy(parser);
+
+    // more tokens than the hint for 400 bytes (255)
+    char many[401];
+    for (int k = 0; k < 400; k += 2) {
+        memcpy(many + k, "a+", 2);
+    }
+    many[400] = '\0';
+    parser = parser_init_n(many, 400, plist, 0);
+    parser_get_stats(parser, &stats);
+    Check(stats.tokens == 400 && stats.token_reallocs == 1, "parser stats: %jd tokens, %jd token reallocs",
+          stats.tokens, stats.token_reallocs);
+    parser_destroy(parser);
+
+    // every phase starts and ends, LOAD without a parser
+    memset(phase_starts, 0, sizeof(phase_starts));
+    memset(phase_ends, 0, sizeof(phase_ends));
+    parser_set_phase_callback(CountPhase, &phase_open);
+
+    FILE *file = fopen("test.input", "wb");
+    if (file) {
+        fputs(inputs[7], file);
+        fclose(file);
+    }
+    parser = parser_init_file("test.input", plist, options);
+    remove("test.input");
+    Check(parser && parser_update(parser, 0, 1, "x", 1), "parser stats: no parser to update");
+    if (parser) parser_destroy(parser);
+    parser = parser_init_parallel(inputs[3], strlen(inputs[3]), plist, options, 4);
+    parser_destroy(parser);
+
+    parser_set_phase_callback(nullptr, nullptr);
+    for (int phase = P_PHASE_LOAD; phase <= P_PHASE_UPDATE; phase++) {
+        Check(phase_starts[phase] > 0 && phase_starts[phase] == phase_ends[phase], 
+              "parser phase %d started %d times and ended %d times", phase, phase_starts[phase], phase_ends[phase]);
+    }
+    Check(phase_open == 0, "parser phases: %d callbacks out of order", phase_open);
+#else
+    Check(!parser_get_stats(parser, &stats) && stats.tokens == 0, "parser_get_stats without _KPARSER_STATS");
+    parser_destroy(parser);
+#endif // _KPARSER_STATS
+}
+
+// 1 if the lexemes are the same, symbols compared by their text
+static int SameLexemes(const lexer_t *expected, const lexer_t *actual)
+{
+    if (expected->lexemes.count != actual->lexemes.count) {
+        return 0;
+    }
+
+    for (intmax_t k = 0; k < expected->lexemes.count; k++) {
+        const lexeme_t *x = &expected->lexemes.items[k];
+        const lexeme_t *y = &actual->lexemes.items[k];
+        if (x->id != y->id || x->kind != y->kind || x->offset != y->offset || 
+            x->len != y->len || x->line != y->line || !x->symbol != !y->symbol) {
+            return 0;
+        }
+        if (x->symbol && strcmp(symtab_name(expected->symbols, x->symbol), 
+                                symtab_name(actual->symbols, y->symbol)) != 0) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// the class the DFA gives each token, the rejecting paths included
+void TestLexemeKinds(const punc_list_t *plist)
+{
+    static const struct {
+        const char *text;
+        uint32_t kind;
+    } cases[] = {
+        { "0", LEXER_DIGIT }, { "12", LEXER_DIGIT }, { "007", LEXER_DIGIT },
+        { "0x1f", LEXER_DIGIT }, { "0XaBE", LEXER_DIGIT }, { "0x", LEXER_UNKNOWN },
+        { "0xg", LEXER_UNKNOWN }, { "0x1x", LEXER_UNKNOWN }, { "1x2", LEXER_UNKNOWN },
+        { "12.", LEXER_DIGIT }, { "12.5", LEXER_DIGIT }, { "12.5e3", LEXER_DIGIT }, 
+        { "0.5E10", LEXER_DIGIT }, { "1e5", LEXER_DIGIT }, { "1e", LEXER_UNKNOWN }, 
+        { "12.5e", LEXER_UNKNOWN }, { "1.2.3", LEXER_UNKNOWN }, { "1e5.0", LEXER_UNKNOWN },
+        { "0x1f.5", LEXER_UNKNOWN }, { ".5", LEXER_UNKNOWN }, { "12a", LEXER_UNKNOWN },
+        { "abc", LEXER_ALPHANUMERIC }, { "x1", LEXER_ALPHANUMERIC }, { "a1b2", LEXER_ALPHANUMERIC },
+        { "_tmp9", LEXER_ALPHANUMERIC }, { "e10", LEXER_ALPHANUMERIC }, { "x0x", LEXER_ALPHANUMERIC },
+        { "\xc3\xa9t\xc3\xa9", LEXER_ALPHANUMERIC }, { "a.b", LEXER_UNKNOWN }, { "$x", LEXER_UNKNOWN }, 
+        { "a@", LEXER_UNKNOWN }, { "\"s 1\"", LEXER_STRING }, { "'c'", LEXER_STRING }, 
+        { "+", LEXER_PUNCTUATION }, { "==", LEXER_PUNCTUATION },
+    };
+    const int count = (int)(sizeof(cases) / sizeof(cases[0]));
+
+    char buffer[512] = "";
+    for (int k = 0; k < count; k++) {
+        strcat(buffer, cases[k].text);
+        strcat(buffer, " ");
+    }
+
+    lexer_t *lexer = lexer_init(buffer, plist, P_ACCEPT_DOUBLEQUOTES | P_ACCEPT_SINGLEQUOTES);
+    Check(lexer && lexer->lexemes.count == count, "lexeme kinds: %jd lexemes", lexer ? lexer->lexemes.count : -1);
+    for (int k = 0; lexer && k < count && k < lexer->lexemes.count; k++) {
+        const lexeme_t *lexeme = &lexer->lexemes.items[k];
+        Check(lexeme->len == strlen(cases[k].text) && lexeme->kind == cases[k].kind &&
+              !lexeme->symbol == (cases[k].kind != LEXER_ALPHANUMERIC),
+              "lexeme kinds: \"%s\" is kind %u (symbol %u), not %u", cases[k].text, lexeme->kind, 
+              lexeme->symbol, cases[k].kind);
+    }
+    if (lexer) lexer_destroy(lexer);
+
+    // without the quote options a quote is just an unknown byte
+    lexer = lexer_init("\"s\" 's'", plist, 0);
+    Check(lexer && lexer->lexemes.count == 2 && lexer->lexemes.items[0].kind == LEXER_UNKNOWN &&
+          lexer->lexemes.items[1].kind == LEXER_UNKNOWN, "lexeme kinds: quotes without the quote options");
+    if (lexer) lexer_destroy(lexer);
+}
+
+// the tracer's calls, an error and the offset of the lexeme it's about
+static const char *traced_errors[8];
+static intmax_t traced_offsets[8];
+static int traced = 0;
+
+static void TraceRule(const char *msg, const char *file, const char *scope, intmax_t line, intmax_t offset)
+{
+    (void)file;
+    (void)scope;
+    (void)line;
+    if (traced < 8) {
+        traced_errors[traced] = msg;
+        traced_offsets[traced] = offset;
+    }
+    traced++;
+}
+
+// 1 if every lexeme's match is the one in expected
+static int SameJumps(lexer_t *lexer, const intmax_t *expected, intmax_t count)
+{
+    if (lexer->lexemes.count != count) {
+        return 0;
+    }
+    for (intmax_t k = 0; k < count; k++) {
+        if (lexer_match(lexer, k) != expected[k]) {
+            return 0;
+        }
+    }
+    return lexer_match(lexer, count) == -1;
+}
+
+// brackets paired by the declared rules (nested, of other rules and of none)
+// and the errors traced for the ones left unmatched
+void TestRules()
+{
+    enum { R_OpenBrace, R_CloseBrace, R_OpenParen, R_CloseParen, R_OpenBracket, R_CloseBracket };
+    punc_list_t *plist = punc_init();
+    punc_add(plist, "{", R_OpenBrace);
+    punc_add(plist, "}", R_CloseBrace);
+    punc_add(plist, "(", R_OpenParen);
+    punc_add(plist, ")", R_CloseParen);
+    punc_add(plist, "[", R_OpenBracket);
+    punc_add(plist, "]", R_CloseBracket);
+    punc_compile(plist);
+    const char *brace_error = "unmatched brace";
+    const char *paren_error = "unmatched parenthesis";
+
+    //                                  0 1 2 3 4 5 6 7 8 9 10 11 12 13
+    lexer_t *lexer = lexer_init("a { b ( c [ d ] ) { e } } f", plist, 0);
+    lexer_set_tracer(lexer, TraceRule);
+    lexer_declare_rule(lexer, (token_t){ .id = R_OpenBrace }, (token_t){ .id = R_CloseBrace }, brace_error);
+    lexer_declare_rule(lexer, (token_t){ .id = R_OpenParen }, (token_t){ .id = R_CloseParen }, paren_error);
+    traced = 0;
+    static const intmax_t nested[] = { -1, 12, -1, 8, -1, -1, -1, -1, 3, 11, -1, 9, 1, -1 };
+    Check(SameJumps(lexer, nested, 14) && traced == 0, "lexer_match: nested brackets (%d errors)", traced);
+
+    // a new rule rebuilds the index
+    lexer_declare_rule(lexer, (token_t){ .id = R_OpenBracket }, (token_t){ .id = R_CloseBracket }, "bracket");
+    static const intmax_t bracketed[] = { -1, 12, -1, 8, -1, 7, -1, 5, 3, 11, -1, 9, 1, -1 };
+    Check(SameJumps(lexer, bracketed, 14) && traced == 0, "lexer_match: a declared rule didn't pair up");
+    lexer_destroy(lexer);
+
+    // the "}" closes over the "(", whose ")" then has nothing to close, and
+    // so does the last "}"
+    //                   0 2 4 6 8 offsets
+    lexer = lexer_init("{ ( } ) } {", plist, 0);
+    lexer_set_tracer(lexer, TraceRule);
+    lexer_declare_rule(lexer, (token_t){ .id = R_OpenBrace }, (token_t){ .id = R_CloseBrace }, brace_error);
+    lexer_declare_rule(lexer, (token_t){ .id = R_OpenParen }, (token_t){ .id = R_CloseParen }, paren_error);
+    traced = 0;
+    static const intmax_t unbalanced[] = { 2, -1, 0, -1, -1, -1 };
+    Check(SameJumps(lexer, unbalanced, 6), "lexer_match: unbalanced brackets");
+    Check(traced == 4 && traced_errors[0] == paren_error && traced_offsets[0] == 2 &&
+          traced_errors[1] == paren_error && traced_offsets[1] == 6 &&
+          traced_errors[2] == brace_error && traced_offsets[2] == 8 &&
+          traced_errors[3] == brace_error && traced_offsets[3] == 10,
+          "lexer_match: %d errors traced for unbalanced brackets", traced);
+    lexer_destroy(lexer);
+
+    punc_destroy(plist);
+}
+
+void TestScripts(const punc_list_t *plist)
+{
+    #define SCRIPT_COUNT 24
+    const int options = P_ACCEPT_DOUBLEQUOTES | P_ACCEPT_SINGLEQUOTES;
+    char *buffers[SCRIPT_COUNT];
+    lexer_t *expected[SCRIPT_COUNT];
+
+    test_seed = 0x2545f4914f6cdd1dull;
+    for (int i = 0; i < SCRIPT_COUNT; i++) {
+        buffers[i] = Generate(16 + Random(2048));
+        expected[i] = lexer_init(buffers[i], plist, options);
+    }
+
+    // the shared ids only depend on the script order, not the threads
+    symtab_t *first = nullptr;
+    for (int nthreads = 1; nthreads <= 4; nthreads++) {
+        script_t scripts[SCRIPT_COUNT];
+        for (int i = 0; i < SCRIPT_COUNT; i++) {
+            scripts[i].filename = "test";
+            scripts[i].buffer = buffers[i];
+            scripts[i].lexer = nullptr;
+        }
+
+        symtab_t *symbols = symtab_init();
+        intmax_t lexed = lexer_parse_scripts(scripts, SCRIPT_COUNT, plist, symbols, options, nthreads);
+        Check(lexed == SCRIPT_COUNT, "lexer_parse_scripts (%d threads) lexed %jd scripts", nthreads, lexed);
+
+        for (int i = 0; i < SCRIPT_COUNT && lexed == SCRIPT_COUNT; i++) {
+            Check(scripts[i].lexer->symbols == symbols && SameLexemes(expected[i], scripts[i].lexer),
+                  "lexer_parse_scripts (%d threads) script %d differs from lexer_init", nthreads, i);
+        }
+        if (first) {
+            int same = first->count == symbols->count;
+            for (intmax_t id = 1; same && id < symbols->count; id++) {
+                same = strcmp(symtab_name(first, (uint32_t)id), symtab_name(symbols, (uint32_t)id)) == 0;
+            }
+            Check(same, "lexer_parse_scripts (%d threads) symbol ids differ from 1 thread", nthreads);
+        }
+
+        for (int i = 0; i < SCRIPT_COUNT; i++) {
+            if (scripts[i].lexer) lexer_destroy(scripts[i].lexer);
+        }
+        if (first) {
+            symtab_destroy(symbols);
+        } else {
+            first = symbols;
+        }
+    }
+    symtab_destroy(first);
+
+    for (int i = 0; i < SCRIPT_COUNT; i++) {
+        lexer_destroy(expected[i]);
+        free(buffers[i]);
+    }
+}
+
+// write the cache at path to corrupt_path, with whatever corrupt does to it
+static int Corrupt(const char *path, const char *corrupt_path, void (*corrupt)(char *cache, long *size))
+{
+    FILE *file = fopen(path, "rb");
+    if (!file) return 0;
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    rewind(file);
+    char *cache = (char*)malloc(size);
+    int ok = cache && (long)fread(cache, 1, size, file) == size;
+    fclose(file);
+
+    if (ok) {
+        corrupt(cache, &size);
+        file = fopen(corrupt_path, "wb");
+        ok = file && (long)fwrite(cache, 1, size, file) == size;
+        if (file) fclose(file);
+    }
+    free(cache);
+    return ok;
+}
+
+static void Truncate(char *cache, long *size)
+{
+    (void)cache;
+    *size /= 2;
+}
+
+static void LexemeSymbol(char *cache, long *size)
+{
+    (void)size;
+    const _lexer_cache_t *h = (const _lexer_cache_t*)cache;
+    lexeme_t *lexemes = (lexeme_t*)(cache + h->lexemes);
+    for (uint64_t i = 0; i < h->lexeme_count; i++) {
+        if (lexemes[i].symbol) {
+            lexemes[i].symbol = (uint32_t)h->symbol_count + 5;
+            break;
+        }
+    }
+}
+
+static void SymbolOffset(char *cache, long *size)
+{
+    (void)size;
+    const _lexer_cache_t *h = (const _lexer_cache_t*)cache;
+    ((symbol_t*)(cache + h->symbols))[h->symbol_count - 1].offset = (intmax_t)h->pool_size;
+}
+
+static void SlotId(char *cache, long *size)
+{
+    (void)size;
+    const _lexer_cache_t *h = (const _lexer_cache_t*)cache;
+    ((uint32_t*)(cache + h->slots))[0] = (uint32_t)h->symbol_count;
+}
+
+static void ScopeFirst(char *cache, long *size)
+{
+    (void)size;
+    const _lexer_cache_t *h = (const _lexer_cache_t*)cache;
+    const _lexer_cache_scope_t *record = (const _lexer_cache_scope_t*)(cache + h->scopes);
+    uint32_t *variables = (uint32_t*)(cache + record->variables);
+    int32_t *first = (int32_t*)(cache + record->first);
+    for (uint64_t slot = 0; slot < record->capacity; slot++) {
+        if (variables[slot]) {
+            first[slot] = (int32_t)h->lexeme_count;
+            break;
+        }
+    }
+}
+
+void TestCache(const punc_list_t *plist)
+{
+    const int options = P_ACCEPT_DOUBLEQUOTES;
+    const char *path = "test.cache";
+    const char *corrupt_path = "test.corrupt.cache";
+
+    test_seed = 0xd1342543de82ef95ull;
+    char *buffer = Generate(4096);
+    lexer_t *lexer = lexer_init(buffer, plist, options);
+    scope_t *global = lexer_parse_scope(lexer, nullptr);
+    Check(global && lexer_save(lexer, path), "lexer_save failed");
+
+    lexer_t *loaded = lexer_load(path, buffer, plist, options);
+    Check(loaded && SameLexemes(lexer, loaded), "lexer_load differs from lexer_init");
+    if (loaded && global) {
+        int same = loaded->global_scope.count == global->count;
+        for (intmax_t k = 0; same && k < lexer->lexemes.count; k++) {
+            same = scope_find(global, lexer->lexemes.items[k].symbol) == 
+                   scope_find(&loaded->global_scope, loaded->lexemes.items[k].symbol);
+        }
+        Check(same, "lexer_load global scope differs");
+    }
+    if (loaded) lexer_destroy(loaded);
+
+    // stale or corrupt caches are rejected, the caller lexes again
+    Check(!lexer_load(path, buffer, plist, options | P_ACCEPT_SINGLEQUOTES), "lexer_load ignored the options");
+    char c = buffer[0];
+    buffer[0] = c == 'a' ? 'b' : 'a';
+    Check(!lexer_load(path, buffer, plist, options), "lexer_load ignored an edited source");
+    buffer[0] = c;
+
+    void (*corruptions[])(char*, long*) = { Truncate, LexemeSymbol, SymbolOffset, SlotId, ScopeFirst };
+    for (int i = 0; i < (int)(sizeof(corruptions) / sizeof(corruptions[0])); i++) {
+        loaded = Corrupt(path, corrupt_path, corruptions[i]) ? lexer_load(corrupt_path, buffer, plist, options) : nullptr;
+        Check(!loaded, "lexer_load accepted corrupt cache %d", i);
+        if (loaded) lexer_destroy(loaded);
+    }
+
+    remove(path);
+    remove(corrupt_path);
+    lexer_destroy(lexer);
+    free(buffer);
+}
+
+// blocks each thread of a round leaves to a thread of the next one
+#define KMEM_THREADS 8
+#define KMEM_ROUNDS 6
+#define KMEM_BLOCKS 512
+
+typedef struct {
+    int round;
+    int index;
+} KmemWorker;
+
+static void *kmem_blocks[2][KMEM_THREADS][KMEM_BLOCKS];
+
+static size_t KmemSize(int round, int index, int i)
+{
+    uint64_t h = ((uint64_t)round * 131 + index) * 0x9e3779b97f4a7c15ull + i * 0xbf58476d1ce4e5b9ull;
+    return 1 + (size_t)((h ^ (h >> 29)) % 2048);
+}
+
+// Free (some resized first) the blocks a thread of the last round allocated 
+// before exiting, then allocate the ones the next round frees
+static void *KmemWork(void *arg)
+{
+    const KmemWorker *worker = (const KmemWorker*)arg;
+    void **theirs = kmem_blocks[(worker->round + 1) % 2][(worker->index + 1) % KMEM_THREADS];
+    void **ours = kmem_blocks[worker->round % 2][worker->index];
+
+    for (int i = 0; i < KMEM_BLOCKS && worker->round > 0; i++) {
+        if (i % 4 == 0) {
+            theirs[i] = kmem_realloc(theirs[i], KmemSize(worker->round, worker->index, i) * 2, 
+                                     __FILE__, __func__, __LINE__);
+        }
+        kmem_free(theirs[i]);
+        theirs[i] = nullptr;
+    }
+
+    for (int i = 0; i < KMEM_BLOCKS; i++) {
+        size_t size = KmemSize(worker->round, worker->index, i);
+        ours[i] = i % 2 ? kmem_calloc(1, size, __FILE__, __func__, __LINE__)
+                        : kmem_alloc(size, __FILE__, __func__, __LINE__);
+        memset(ours[i], worker->index, size);
+
+        // and some that never leave the thread
+        void *local = kmem_alloc(size, __FILE__, __func__, __LINE__);
+        kmem_free(local);
+    }
+
+    return nullptr;
+}
+
+// Rounds of threads that exit and are replaced, every block is freed by a
+// thread other than the one that allocated it
+void TestKmemThreads()
+{
+    kmem_stats_t stats;
+    kmem_get_stats(&stats);
+    Check(!kmem_leaks() && stats.live_count == 0 && stats.live_bytes == 0, "kmem: live allocations before starting");
+
+    for (int round = 0; round < KMEM_ROUNDS; round++) {
+        KmemWorker workers[KMEM_THREADS];
+        for (int t = 0; t < KMEM_THREADS; t++) {
+            workers[t] = (KmemWorker) { .round = round, .index = t };
+        }
+#if defined(_KMEM_THREADS_PTHREAD)
+        pthread_t threads[KMEM_THREADS];
+        for (int t = 0; t < KMEM_THREADS; t++) {
+            pthread_create(&threads[t], NULL, KmemWork, &workers[t]);
+        }
+        for (int t = 0; t < KMEM_THREADS; t++) {
+            pthread_join(threads[t], NULL);
+        }
+#else
+        for (int t = 0; t < KMEM_THREADS; t++) {
+            KmemWork(&workers[t]);
+        }
+#endif // _KMEM_THREADS_PTHREAD
+
+#if !defined(KALLOC_SAMPLE_RATE)
+        // the records the round left, in the shards of threads that are gone
+        size_t bytes = 0;
+        for (int t = 0; t < KMEM_THREADS; t++) {
+            for (int i = 0; i < KMEM_BLOCKS; i++) {
+                bytes += KmemSize(round, t, i);
+            }
+        }
+        kmem_get_stats(&stats);
+        Check(stats.live_count == KMEM_THREADS * KMEM_BLOCKS && stats.live_bytes == bytes, 
+              "kmem round %d: %zu live (%zu bytes), expected %d (%zu bytes)", 
+              round, stats.live_count, stats.live_bytes, KMEM_THREADS * KMEM_BLOCKS, bytes);
+#endif // KALLOC_SAMPLE_RATE
+    }
+
+#if defined(_KMEM_THREADS_PTHREAD)
+    // threads that started after others exited took over their shards
+    int shards = 0;
+    for (kmem_shard_t *shard = _kmem_shards; shard; shard = shard->next) {
+        shards++;
+    }
+    Check(shards <= KMEM_THREADS + 1, "kmem: %d shards for %d threads at a time", shards, KMEM_THREADS);
+#endif // _KMEM_THREADS_PTHREAD
+
+    // the last round's blocks, from this thread
+    for (int t = 0; t < KMEM_THREADS; t++) {
+        for (int i = 0; i < KMEM_BLOCKS; i++) {
+            kmem_free(kmem_blocks[(KMEM_ROUNDS - 1) % 2][t][i]);
+        }
+    }
+
+    kmem_get_stats(&stats);
+    Check(!kmem_leaks(), "kmem: leaks after every block was freed");
+    Check(stats.live_count == 0 && stats.live_bytes == 0, "kmem: %zu live (%zu bytes) after every block was freed",
+          stats.live_count, stats.live_bytes);
+}
+
+#if !defined(KALLOC_SAMPLE_RATE)
+#if defined(_KMEM_THREADS_PTHREAD)
+// run fn(arg) on a thread of its own (which exits before this returns)
+static void *KmemOnThread(void *(*fn)(void*), void *arg)
+{
+    pthread_t thread;
+    void *result = nullptr;
+    if (pthread_create(&thread, NULL, fn, arg) == 0) {
+        pthread_join(thread, &result);
+    }
+    return result;
+}
+#endif // _KMEM_THREADS_PTHREAD
+
+#if defined(KALLOC_HEADERS)
+static kmem_header_t *KmemHeader(void *ptr)
+{
+    return (kmem_header_t*)((char*)ptr - _KMEM_HEADER_SIZE);
+}
+
+#if defined(_KMEM_THREADS_PTHREAD)
+static void *KmemFree(void *arg)
+{
+    kmem_free(arg);
+    return nullptr;
+}
+
+static void *KmemFreeAll(void *arg)
+{
+    for (void **block = (void**)arg; *block; block++) {
+        kmem_free(*block);
+    }
+    return nullptr;
+}
+
+static void *KmemAlloc(void *arg)
+{
+    (void)arg;
+    return kmem_alloc(48, __FILE__, __func__, __LINE__);
+}
+#endif // _KMEM_THREADS_PTHREAD
+
+// the record lives in the header before the block and is unlinked without a
+// lookup, other threads' frees wait in the owner's queue
+void TestKmemHeaders()
+{
+    kmem_shard_t *local = _kmem_local();
+    size_t count = local->count;
+
+    size_t line = __LINE__ + 1;
+    char *a = (char*)kmem_alloc(100, __FILE__, __func__, line);
+    kmem_header_t *header = KmemHeader(a);
+    Check(header->info.ptr == a && header->info.size == 100 && header->info.line == line && 
+          strcmp(header->info.file, __FILE__) == 0 && header->base == header && header->shard == local,
+          "kmem header: the record isn't the block's");
+    Check(((uintptr_t)a & 15) == 0, "kmem header: block isn't 16-byte aligned");
+
+    // unlinked from the middle, the head and the tail
+    char *b = (char*)kmem_calloc(2, 50, __FILE__, __func__, __LINE__);
+    char *c = (char*)kmem_alloc(300, __FILE__, __func__, __LINE__);
+    Check(local->blocks == KmemHeader(c) && KmemHeader(c)->next == KmemHeader(b) && KmemHeader(b)->next == header &&
+          local->count == count + 3, "kmem header: blocks aren't linked most recent first");
+    kmem_free(b);
+    Check(KmemHeader(c)->next == header && header->prev == KmemHeader(c) && local->count == count + 2,
+          "kmem header: freeing the middle block didn't unlink it");
+    kmem_free(c);
+    Check(local->blocks == header && header->prev == nullptr && local->count == count + 1,
+          "kmem header: freeing the first block didn't unlink it");
+    kmem_free(a);
+    Check(local->count == count, "kmem header: freeing the last block didn't unlink it");
+
+#if defined(_KMEM_THREADS_PTHREAD)
+    // a free from another thread is queued on the owner's shard until the
+    // owner allocates or frees again
+    a = (char*)kmem_alloc(64, __FILE__, __func__, __LINE__);
+    header = KmemHeader(a);
+    KmemOnThread(KmemFree, a);
+    Check(local->remote == header && local->remote_count == 1 && local->count == count + 1,
+          "kmem header: another thread's free wasn't queued on the owner");
+    b = (char*)kmem_alloc(64, __FILE__, __func__, __LINE__);
+    Check(local->remote == nullptr && local->remote_count == 0 && local->count == count + 1,
+          "kmem header: the owner didn't drain its queue");
+    kmem_free(b);
+
+    // a block of a thread that's gone goes on that thread's queue, not ours
+    c = (char*)KmemOnThread(KmemAlloc, nullptr);
+    kmem_shard_t *owner = c ? KmemHeader(c)->shard : nullptr;
+    Check(owner && owner != local, "kmem header: a thread's block is in the caller's shard");
+    if (owner && owner != local) {
+        long queued = owner->remote_count;
+        kmem_free(c);
+        Check(owner->remote == KmemHeader(c) && owner->remote_count == queued + 1 && local->remote == nullptr,
+              "kmem header: a free wasn't queued on the block's own shard");
+    }
+
+    // and drained by the thread freeing once KALLOC_REMOTE_BATCH are queued
+    void *blocks[KALLOC_REMOTE_BATCH + 1];
+    for (int i = 0; i < KALLOC_REMOTE_BATCH; i++) {
+        blocks[i] = kmem_alloc(16 + i, __FILE__, __func__, __LINE__);
+    }
+    blocks[KALLOC_REMOTE_BATCH] = nullptr;
+    KmemOnThread(KmemFreeAll, blocks);
+    Check(local->remote_count < KALLOC_REMOTE_BATCH && local->count == count,
+          "kmem header: %ld frees queued on an idle owner", local->remote_count);
+#endif // _KMEM_THREADS_PTHREAD
+
+#if !defined(TEST_SANITIZE)
+    // a pointer that isn't from kmem_alloc goes straight to free()/realloc()  
+    // (its header check reads before the block, which the sanitizers reject)
+    kmem_stats_t before, after;
+    kmem_get_stats(&before);
+    void *foreign = malloc(64);
+    foreign = kmem_realloc(foreign, 128, __FILE__, __func__, __LINE__);
+    kmem_free(foreign);
+    kmem_get_stats(&after);
+    Check(after.live_count == before.live_count && after.total_count == before.total_count,
+          "kmem header: a foreign pointer changed the stats");
+#endif // TEST_SANITIZE
+
+    Check(!kmem_leaks(), "kmem header: leaks after every block was freed");
+}
+#endif // KALLOC_HEADERS
+
+// records in every shard, one per tracked block
+static size_t KmemRecords()
+{
+    kmem_leak_totals_t totals = { 0 };
+    _kmem_each_shard(_kmem_count_shard, &totals);
+    return totals.count;
+}
+
+// the record of a tracked block, nullptr if there's none
+static const kmem_allocation_t *KmemRecord(void *ptr)
+{
+#if defined(KALLOC_HEADERS)
+    kmem_header_t *header = KmemHeader(ptr);
+    return header->info.ptr == ptr && header->shard ? &header->info : nullptr;
+#else
+    kmem_shard_t *shard = nullptr;
+    kmem_allocation_t *item = _kmem_find_locked(ptr, &shard);
+    if ( item ) {
+        _kmem_unlock(shard);
+    }
+    return item;
+#endif // KALLOC_HEADERS
+}
+
+static void CheckKmemBlock(void *ptr, size_t size, size_t line, size_t records, const kmem_stats_t *before, 
+                           const char *what)
+{
+    kmem_stats_t stats;
+    kmem_get_stats(&stats);
+    const kmem_allocation_t *item = KmemRecord(ptr);
+    Check(item && item->ptr == ptr && item->size == size && item->line == line, "%s", what);
+    Check(KmemRecords() == records + 1, "%s", what);
+    Check(stats.live_count == before->live_count + 1 && stats.live_bytes == before->live_bytes + size, "%s", what);
+}
+
+#if defined(_KMEM_THREADS_PTHREAD)
+static void *KmemGrow(void *arg)
+{
+    return kmem_realloc(arg, 5000, __FILE__, __func__, 1);
+}
+#endif // _KMEM_THREADS_PTHREAD
+
+// A resized block keeps one record with its new size and call site, an 
+// aligned one is aligned and its free puts the stats back
+void TestKmemRealloc()
+{
+    kmem_stats_t before;
+    kmem_get_stats(&before);
+    size_t records = KmemRecords();
+
+    size_t line = __LINE__ + 1;
+    char *p = (char*)kmem_alloc(16, __FILE__, __func__, line);
+    memcpy(p, "0123456789abcde", 16);
+    CheckKmemBlock(p, 16, line, records, &before, "kmem realloc: allocation isn't recorded");
+
+    line = __LINE__ + 1;
+    p = (char*)kmem_realloc(p, 100000, __FILE__, __func__, line);
+    CheckKmemBlock(p, 100000, line, records, &before, "kmem realloc: growing didn't keep one updated record");
+    Check(memcmp(p, "0123456789abcde", 16) == 0, "kmem realloc: growing lost the contents");
+
+    line = __LINE__ + 1;
+    p = (char*)kmem_realloc(p, 8, __FILE__, __func__, line);
+    CheckKmemBlock(p, 8, line, records, &before, "kmem realloc: shrinking didn't keep one updated record");
+    Check(memcmp(p, "01234567", 8) == 0, "kmem realloc: shrinking lost the contents");
+
+#if defined(_KMEM_THREADS_PTHREAD)
+    // the record stays in the owner's shard
+    p = (char*)KmemOnThread(KmemGrow, p);
+    CheckKmemBlock(p, 5000, 1, records, &before, "kmem realloc: another thread's resize didn't keep one record");
+    Check(memcmp(p, "01234567", 8) == 0, "kmem realloc: another thread's resize lost the contents");
+#endif // _KMEM_THREADS_PTHREAD
+
+    kmem_stats_t after;
+    kmem_free(p);
+    kmem_get_stats(&after);
+    Check(KmemRecords() == records && after.live_count == before.live_count && after.live_bytes == before.live_bytes,
+          "kmem realloc: free didn't drop the record");
+
+    for (size_t alignment = 8; alignment <= 4096; alignment *= 2) {
+        size_t size = 100 + alignment;
+        line = __LINE__ + 1;
+        char *block = (char*)kmem_aligned_alloc(alignment, size, __FILE__, __func__, line);
+        Check(block && ((uintptr_t)block & (alignment - 1)) == 0, "kmem aligned: block isn't aligned");
+        if ( !block ) {
+            continue;
+        }
+        memset(block, 0x5a, size);
+        CheckKmemBlock(block, size, line, records, &before, "kmem aligned: block isn't recorded");
+#if defined(KALLOC_HEADERS)
+        char *base = (char*)KmemHeader(block)->base;
+        Check(base <= (char*)KmemHeader(block) && block < base + _KMEM_HEADER_SIZE + alignment,
+              "kmem aligned: header isn't between the base and the block");
+#endif // KALLOC_HEADERS
+
+#if !defined(_MSC_VER)
+        // moves off the aligned base (copied under KALLOC_HEADERS)
+        line = __LINE__ + 1;
+        block = (char*)kmem_realloc(block, size * 2, __FILE__, __func__, line);
+        Check(block && block[0] == 0x5a && block[size - 1] == 0x5a, "kmem aligned: realloc lost the contents");
+        if ( !block ) {
+            continue;
+        }
+        CheckKmemBlock(block, size * 2, line, records, &before, "kmem aligned: realloc didn't keep one record");
+        kmem_free(block);
+#else
+        kmem_aligned_free(block);
+#endif // _MSC_VER
+        kmem_get_stats(&after);
+        Check(KmemRecords() == records && after.live_count == before.live_count && 
+              after.live_bytes == before.live_bytes, "kmem aligned: free didn't put the stats back");
+
+        block = (char*)kmem_aligned_alloc(alignment, size, __FILE__, __func__, __LINE__);
+        kmem_aligned_free(block);
+        kmem_get_stats(&after);
+        Check(KmemRecords() == records && after.live_count == before.live_count && 
+              after.live_bytes == before.live_bytes, "kmem aligned: free didn't put the stats back");
+    }
+    Check(kmem_aligned_alloc(24, 16, __FILE__, __func__, __LINE__) == nullptr, 
+          "kmem aligned: alignment isn't a power of two");
+}
+
+// Known leaks dumped in both formats, collapsed lines end in the call site
+// and its bytes (one line per site, or per block under KALLOC_STACKS) and the
+// pprof header has the kmem_get_stats totals
+void TestKmemDump()
+{
+    void *a = kmem_alloc(100, "dump.c", "DumpA", 10);
+    void *b = kmem_alloc(28, "dump.c", "DumpA", 10);
+    void *c = kmem_alloc(50, "dump.c", "DumpB", 20);
+    kmem_stats_t stats;
+    kmem_get_stats(&stats);
+
+    FILE *out = tmpfile();
+    Check(out && kmem_dump(out, KMEM_DUMP_COLLAPSED), "kmem dump: collapsed dump failed");
+    size_t bytes_a = 0, bytes_b = 0;
+    char line[1024];
+    if (out) {
+        rewind(out);
+        while (fgets(line, sizeof(line), out)) {
+            char *leaf = strrchr(line, ';');
+            leaf = leaf ? leaf + 1 : line;
+
+            char func[64], file[64];
+            size_t site_line = 0, bytes = 0;
+            if (sscanf(leaf, "%63s (%63[^:]:%zu) %zu", func, file, &site_line, &bytes) != 4 || 
+                strcmp(file, "dump.c") != 0) {
+                continue;
+            }
+            if (strcmp(func, "DumpA") == 0 && site_line == 10) bytes_a += bytes;
+            if (strcmp(func, "DumpB") == 0 && site_line == 20) bytes_b += bytes;
+        }
+        fclose(out);
+    }
+    Check(bytes_a == 128 && bytes_b == 50, "kmem dump: collapsed sites have %zu and %zu bytes", bytes_a, bytes_b);
+
+    out = tmpfile();
+#if defined(KALLOC_STACKS)
+    Check(out && kmem_dump(out, KMEM_DUMP_PPROF), "kmem dump: pprof dump failed");
+    size_t count = 0, bytes = 0, total_count = 0, total_bytes = 0;
+    size_t sum_count = 0, sum_bytes = 0;
+    if (out) {
+        rewind(out);
+        Check(fgets(line, sizeof(line), out) &&
+              sscanf(line, "heap profile: %zu: %zu [%zu: %zu] @ heapprofile", 
+                     &count, &bytes, &total_count, &total_bytes) == 4,
+              "kmem dump: no pprof header");
+        size_t n = 0, size = 0;
+        while (fgets(line, sizeof(line), out) && sscanf(line, "%zu: %zu [", &n, &size) == 2) {
+            sum_count += n;
+            sum_bytes += size;
+        }
+        fclose(out);
+    }
+    Check(count == stats.live_count && bytes == stats.live_bytes && total_count == stats.total_count &&
+          total_bytes == stats.total_bytes, "kmem dump: pprof header says %zu: %zu [%zu: %zu]", 
+          count, bytes, total_count, total_bytes);
+    Check(sum_count == count && sum_bytes == bytes, "kmem dump: pprof records add up to %zu: %zu", 
+          sum_count, sum_bytes);
+#else
+    Check(out && !kmem_dump(out, KMEM_DUMP_PPROF), "kmem dump: pprof without KALLOC_STACKS");
+    if (out) fclose(out);
+#endif // KALLOC_STACKS
+
+    kmem_free(a);
+    kmem_free(b);
+    kmem_free(c);
+}
+
+#if defined(KALLOC_STACKS)
+static _KMEM_NOINLINE void *StackAlloc(size_t size)
+{
+    void *ptr = kmem_alloc(size, __FILE__, __func__, __LINE__);
+    memset(ptr, 0, size); // not a tail call
+    return ptr;
+}
+
+// blocks from the same call path share an interned stack, other paths get
+// their own and the leak report counts each stack's blocks
+void TestKmemStacks()
+{
+    void *same[2];
+    volatile int count = 2; // not unrolled into two call sites
+    for (int k = 0; k < count; k++) {
+        same[k] = StackAlloc(32);
+    }
+    void *other = StackAlloc(64);
+    void *direct = kmem_alloc(16, __FILE__, __func__, __LINE__);
+
+    uint32_t id = KmemRecord(same[0])->stack;
+    uint32_t other_id = KmemRecord(other)->stack;
+    uint32_t direct_id = KmemRecord(direct)->stack;
+    Check(id != 0 && other_id != 0 && direct_id != 0, "kmem stacks: no stack captured");
+    Check(KmemRecord(same[1])->stack == id, "kmem stacks: the same call path got two stacks");
+    Check(other_id != id && direct_id != id && direct_id != other_id, 
+          "kmem stacks: different call sites share a stack");
+
+#if !defined(_MSC_VER)
+    // the report goes to stdout
+    FILE *out = tmpfile();
+    size_t counts[3] = { 0, 0, 0 };
+    if (out) {
+        fflush(stdout);
+        int saved = dup(1);
+        dup2(fileno(out), 1);
+        kmem_print_leaks();
+        fflush(stdout);
+        dup2(saved, 1);
+        close(saved);
+
+        char line[1024];
+        int grouped = 0;
+        rewind(out);
+        while (fgets(line, sizeof(line), out)) {
+            unsigned stack = 0;
+            size_t count = 0;
+            if (strcmp(line, "Leaks by stack:\n") == 0) {
+                grouped = 1;
+            } else if (grouped && sscanf(line, "- stack %u: %zu not freed", &stack, &count) == 2) {
+                if (stack == id) counts[0] += count;
+                if (stack == other_id) counts[1] += count;
+                if (stack == direct_id) counts[2] += count;
+            }
+        }
+        fclose(out);
+    }
+    Check(counts[0] == 2 && counts[1] == 1 && counts[2] == 1, 
+          "kmem stacks: leaks by stack count %zu, %zu and %zu blocks", counts[0], counts[1], counts[2]);
+#endif // _MSC_VER
+
+    kmem_free(same[0]);
+    kmem_free(same[1]);
+    kmem_free(other);
+    kmem_free(direct);
+}
+#endif // KALLOC_STACKS
+#endif // KALLOC_SAMPLE_RATE
+
+// a free of anything that isn't a live slot of the pool is ignored
+void TestKpool()
+{
+    kpool_t *pool = kpool_create(24, 8);
+    kpool_t *other = kpool_create(24, 8);
+    void *objects[20];
+    for (int i = 0; i < 20; i++) {
+        objects[i] = kpool_alloc(pool, __FILE__, __func__, __LINE__);
+        Check(objects[i] && ((uintptr_t)objects[i] & 15) == 0, "kpool: object %d missing or misaligned", i);
+        memset(objects[i], i, 24);
+    }
+    Check(pool->count == 20 && pool->slab_count == 3 && kmem_leaks(), "kpool: live objects aren't counted");
+
+    void *theirs = kpool_alloc(other, __FILE__, __func__, __LINE__);
+    void *local[4] = { nullptr };
+    kpool_free(pool, objects[3]);
+    kpool_free(pool, objects[3]);
+    kpool_free(pool, (char*)objects[5] + 8);
+    kpool_free(pool, local);
+    kpool_free(pool, theirs);
+    Check(pool->count == 19 && other->count == 1, "kpool: a double or foreign free was counted");
+
+    // the slot freed twice is only handed out once
+    void *first = kpool_alloc(pool, __FILE__, __func__, __LINE__);
+    void *second = kpool_alloc(pool, __FILE__, __func__, __LINE__);
+    Check(first == objects[3] && second != first, "kpool: a slot freed twice was handed out twice");
+    objects[3] = first;
+    Check(((char*)objects[5])[8] == 5, "kpool: freeing inside a live object touched it");
+
+    for (int i = 0; i < 20; i++) {
+        kpool_free(pool, objects[i]);
+    }
+    kpool_free(pool, second);
+    kpool_free(other, theirs);
+    Check(pool->count == 0 && other->count == 0 && !kmem_leaks(), "kpool: objects left after freeing all of them");
+
+    kpool_destroy(other);
+    kpool_destroy(pool);
+}
+
+// the same allocations after every reset come out of the blocks reserved
+// the first time
+void TestKarena()
+{
+    karena_t arena;
+    karena_init(&arena, 4096);
+    size_t reserved = 0;
+
+    for (int round = 0; round < 50; round++) {
+        test_seed = 0x5851f42d4c957f2dull;
+        karena_mark_t mark = karena_mark(&arena);
+        char *big = (char*)karena_alloc(&arena, 10000, 0);
+        memset(big, round, 10000);
+
+        karena_mark_t inner = {0};
+        char *after = nullptr;
+        size_t after_size = 0, after_align = 0;
+        for (int i = 0; i < 40; i++) {
+            size_t size = 16 + Random(400);
+            size_t align = (size_t)1 << Random(7);
+            if (i == 20) {
+                inner = karena_mark(&arena);
+                after_size = size;
+                after_align = align;
+            }
+            char *ptr = (char*)karena_alloc(&arena, size, align);
+            Check(((uintptr_t)ptr & (align - 1)) == 0, "karena: allocation not aligned to %zu", align);
+            if (i == 20) {
+                after = ptr;
+            }
+        }
+
+        // back to the inner mark, the allocation after it comes out the same
+        size_t used = arena.used;
+        karena_reset(&arena, inner);
+        Check(arena.used == inner.used && arena.used <= used, "karena: reset to a mark didn't release");
+        Check(karena_alloc(&arena, after_size, after_align) == after, "karena: reset to a mark didn't reuse its memory");
+
+        karena_reset(&arena, mark);
+        Check(arena.used == 0 && arena.peak >= 10000, "karena: reset to the start left %zu bytes used", arena.used);
+        if (round == 0) {
+            reserved = arena.reserved;
+        }
+        Check(arena.reserved == reserved, "karena round %d: %zu bytes reserved, %zu the first time", 
+              round, arena.reserved, reserved);
+    }
+    Check(kmem_leaks(), "karena: an arena with blocks isn't reported");
+
+    // the last hook allocation grows and shrinks in place, others move
+    karena_t *previous = karena_bind(&arena);
+    char *a = (char*)karena_hook_alloc(100);
+    memset(a, 'a', 100);
+    size_t used = arena.used;
+    Check(karena_hook_realloc(a, 1000) == a && arena.used == used + 896, "karena: the last allocation didn't grow in place");
+    Check(karena_hook_realloc(a, 50) == a && arena.used == used - 48, "karena: the last allocation didn't shrink in place");
+
+    char *b = (char*)karena_hook_alloc(10);
+    char *moved = (char*)karena_hook_realloc(a, 2000);
+    Check(moved && moved != a && memcmp(moved, "aaaaaaaaaa", 10) == 0, "karena: a moved allocation lost its contents");
+
+    // freeing the last allocation hands its memory back to the next one
+    karena_hook_free(moved);
+    Check(karena_hook_alloc(2000) == moved, "karena: freeing the last allocation didn't hand it back");
+    karena_hook_free(moved);
+    karena_hook_free(b);
+    Check(karena_hook_alloc(10) == b, "karena: freeing the new last allocation didn't hand it back");
+
+    // and without an arena the heap
+    karena_bind(nullptr);
+    char *heap = (char*)karena_hook_alloc(32);
+    memset(heap, 'h', 32);
+    heap = (char*)karena_hook_realloc(heap, 4096);
+    Check(heap && heap[31] == 'h', "karena: a heap hook allocation lost its contents");
+    karena_hook_free(heap);
+
+    karena_bind(previous);
+    karena_free(&arena);
+    Check(!kmem_leaks(), "karena: a freed arena is still reported");
+}
+
+#if defined(KALLOC_SAMPLE_RATE)
+// 1 if estimate is within tolerance (a fraction) of actual
+static int Within(double estimate, double actual, double tolerance)
+{
+    return estimate >= actual * (1.0 - tolerance) && estimate <= actual * (1.0 + tolerance);
+}
+
+// The estimates of a sampled heap land close to what was allocated (within 
+// 5 standard deviations of the sample count), frees of pointers that weren't 
+// sampled leave the stats alone
+void TestKmemSampling()
+{
+    // at most 64MB live, which the 4096 byte rate gets enough samples from
+    double samples = 64.0 * 1024 * 1024 / KALLOC_SAMPLE_RATE;
+    if (samples > 2000) samples = 2000;
+    size_t target = (size_t)(samples * KALLOC_SAMPLE_RATE);
+
+    kmem_stats_t before, after;
+    kmem_get_stats(&before);
+
+    test_seed = 0x9fb21c651e98df25ull;
+    size_t capacity = target / 16 + 1, count = 0, bytes = 0;
+    void **blocks = (void**)malloc(capacity * sizeof(void*));
+    while (bytes < target && count < capacity) {
+        size_t size = 16 + Random(1009);
+        blocks[count++] = kmem_alloc(size, __FILE__, __func__, __LINE__);
+        bytes += size;
+    }
+
+    kmem_get_stats(&after);
+    double tolerance = 5.0 / sqrt(samples) + 0.01;
+    Check(Within((double)(after.live_bytes - before.live_bytes), (double)bytes, tolerance),
+          "kmem sampling: %zu live bytes estimated for %zu", after.live_bytes - before.live_bytes, bytes);
+    Check(Within((double)(after.live_count - before.live_count), (double)count, tolerance),
+          "kmem sampling: %zu live allocations estimated for %zu", after.live_count - before.live_count, count);
+
+    // more of the same freed right away, only the totals keep them
+    size_t total = bytes, total_count = count;
+    while (total < 4 * target) {
+        size_t size = 16 + Random(1009);
+        kmem_free(kmem_alloc(size, __FILE__, __func__, __LINE__));
+        total += size;
+        total_count++;
+    }
+    kmem_get_stats(&after);
+    tolerance = 5.0 / sqrt(4 * samples) + 0.01;
+    Check(Within((double)(after.total_bytes - before.total_bytes), (double)total, tolerance),
+          "kmem sampling: %zu bytes estimated in total for %zu", after.total_bytes - before.total_bytes, total);
+    Check(Within((double)(after.total_count - before.total_count), (double)total_count, tolerance),
+          "kmem sampling: %zu allocations estimated in total for %zu", 
+          after.total_count - before.total_count, total_count);
+
+    // a free of an allocation that wasn't sampled changes nothing, and 
+    // mostly doesn't get past the filter
+    int unsampled = 0, same = 1;
+#if !defined(KALLOC_HEADERS)
+    int filtered = 0;
+#endif // KALLOC_HEADERS
+    void *sampled[64];
+    int sampled_count = 0;
+    for (int i = 0; i < 2000; i++) {
+        kmem_stats_t first, second;
+        kmem_get_stats(&first);
+        void *ptr = kmem_alloc(64, __FILE__, __func__, __LINE__);
+        kmem_get_stats(&second);
+        if (second.total_count != first.total_count) {
+            if (sampled_count < 64) {
+                sampled[sampled_count++] = ptr;
+            } else {
+                kmem_free(ptr);
+            }
+            continue;
+        }
+
+        unsampled++;
+#if !defined(KALLOC_HEADERS)
+        filtered += !_kmem_filter_has(ptr);
+#endif // KALLOC_HEADERS
+        kmem_free(ptr);
+        kmem_get_stats(&second);
+        same &= second.live_bytes == first.live_bytes && second.live_count == first.live_count &&
+                second.total_bytes == first.total_bytes && second.total_count == first.total_count;
+    }
+    Check(unsampled > 1000 && same, "kmem sampling: a free of an unsampled pointer changed the stats");
+#if !defined(KALLOC_HEADERS)
+    Check(filtered >= unsampled * 8 / 10, "kmem sampling: only %d of %d unsampled frees were filtered out", 
+          filtered, unsampled);
+#endif // KALLOC_HEADERS
+
+    for (int i = 0; i < sampled_count; i++) {
+        kmem_free(sampled[i]);
+    }
+    for (size_t i = 0; i < count; i++) {
+        kmem_free(blocks[i]);
+    }
+    free(blocks);
+
+    kmem_get_stats(&after);
+    Check(after.live_count == before.live_count && after.live_bytes == before.live_bytes && !kmem_leaks(),
+          "kmem sampling: %zu live (%zu bytes) after every block was freed", after.live_count, after.live_bytes);
+}
+#endif // KALLOC_SAMPLE_RATE
+
+int main(int argc, char* argv[])
+{
+    (void)argc;
+    (void)argv;
+
+    punc_list_t *plist = Punctuation();
+    TestModes(plist);
+    TestPuncOrder();
+    TestIgnoreClose();
+    TestUpdate(plist);
+    TestUpdateArena(plist);
+    TestReset(plist);
+    TestOutOfMemory(plist);
+    TestParserStats(plist);
+    TestLexemeKinds(plist);
+    TestRules();
+    TestScripts(plist);
+    TestCache(plist);
+    punc_destroy(plist);
+
+    TestKmemThreads();
+#if defined(KALLOC_HEADERS) && !defined(KALLOC_SAMPLE_RATE)
+    TestKmemHeaders();
+#endif // KALLOC_HEADERS && !KALLOC_SAMPLE_RATE
+#if !defined(KALLOC_SAMPLE_RATE)
+    TestKmemRealloc();
+    TestKmemDump();
+#if defined(KALLOC_STACKS)
+    TestKmemStacks();
+#endif // KALLOC_STACKS
+#endif // KALLOC_SAMPLE_RATE
+#if defined(KALLOC_SAMPLE_RATE)
+    TestKmemSampling();
+#endif // KALLOC_SAMPLE_RATE
+    TestKpool();
+    TestKarena();
+
+    printf("%d checks, %d failed\n", checks, failures);
+    return failures ? 1 : 0;
+}